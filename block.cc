@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "block.h"
+#include "keycompare.h"
 
 Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false)
 {}
@@ -40,7 +41,17 @@ Block::~Block()
 
 Block & Block::operator=(const Block &rhs)
 {
-  return *(new (this) Block(rhs));
+  if (this==&rhs) { 
+    return *this;
+  }
+  // Reuse our buffer when it is already the right size
+  if (length!=rhs.length && Resize(rhs.length,false)!=ERROR_NOERROR) { 
+    throw GenericException();
+  }
+  memcpy(data,rhs.data,rhs.length);
+  lastaccessed=rhs.lastaccessed;
+  dirty=rhs.dirty;
+  return *this;
 }
 
 
@@ -86,17 +97,17 @@ static char low2hex(BYTE_T x)
 
 
 
-#define MAX(x,y) ((x)>(y) ? (x) : (y))
-
+// Blocks order like keys: by their common prefix, then shorter first
 bool Block::operator<(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))<0;
+  int rc=CompareKeyBytes(data,rhs.data,MIN(length,rhs.length));
+  return rc<0 || (rc==0 && length<rhs.length);
 }
 
 
 bool Block::operator==(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))==0;
+  return length==rhs.length && CompareKeyBytes(data,rhs.data,length)==0;
 }
 
 ostream & Block::Print(ostream &os) const
@@ -0,0 +1,101 @@
+#include "bloomfilter.h"
+
+#define BLOCK_WORDS 8   // 512 bits, a cache line
+#define BLOCK_BITS (BLOCK_WORDS*64)
+#define MAX_PROBES 7    // each probe takes 9 bits of a 64-bit hash
+
+
+BloomFilter::BloomFilter() :
+  numblocks(0), numprobes(0), numkeys(0), capacity(0),
+  queries(0), ruledout(0), falsepositives(0)
+{}
+
+
+void BloomFilter::Reset(const SIZE_T cap, const SIZE_T bitsperkey)
+{
+  numkeys=0;
+  capacity=cap;
+  if (bitsperkey==0) {
+    numblocks=0;
+    numprobes=0;
+    bits.clear();
+    return;
+  }
+  numblocks=(cap*bitsperkey+BLOCK_BITS-1)/BLOCK_BITS;
+  if (numblocks==0) {
+    numblocks=1;
+  }
+  // bitsperkey*ln 2 probes minimizes the false positive rate
+  numprobes=(bitsperkey*69+50)/100;
+  if (numprobes<1) {
+    numprobes=1;
+  }
+  if (numprobes>MAX_PROBES) {
+    numprobes=MAX_PROBES;
+  }
+  bits.assign(numblocks*BLOCK_WORDS,0);
+}
+
+
+uint64_t BloomFilter::Hash(const BYTE_T *data, const SIZE_T len)
+{
+  // FNV-1a, then the murmur3 finalizer to spread it over all 64 bits
+  uint64_t h=14695981039346656037ULL;
+
+  for (SIZE_T i=0;i<len;i++) {
+    h=(h^data[i])*1099511628211ULL;
+  }
+  h^=h>>33;
+  h*=0xff51afd7ed558ccdULL;
+  h^=h>>33;
+  h*=0xc4ceb9fe1a85ec53ULL;
+  h^=h>>33;
+  return h;
+}
+
+
+// The block comes from the high half of the hash, the bits within it
+// from a second mix of the whole, so the two are independent
+static inline SIZE_T Block(const uint64_t hash, const SIZE_T numblocks)
+{
+  return (SIZE_T)(((hash>>32)*numblocks)>>32);
+}
+
+static inline uint64_t Probes(const uint64_t hash)
+{
+  return hash*0x9e3779b97f4a7c15ULL;
+}
+
+
+void BloomFilter::Add(const uint64_t hash)
+{
+  uint64_t *block=&bits[Block(hash,numblocks)*BLOCK_WORDS];
+  uint64_t p=Probes(hash);
+
+  for (SIZE_T i=0;i<numprobes;i++,p>>=9) {
+    block[(p&(BLOCK_BITS-1))/64]|=1ULL<<(p%64);
+  }
+  numkeys++;
+}
+
+
+bool BloomFilter::MayContain(const uint64_t hash) const
+{
+  const uint64_t *block=&bits[Block(hash,numblocks)*BLOCK_WORDS];
+  uint64_t p=Probes(hash);
+
+  for (SIZE_T i=0;i<numprobes;i++,p>>=9) {
+    if (!(block[(p&(BLOCK_BITS-1))/64]&(1ULL<<(p%64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+double BloomFilter::GetFalsePositiveRate() const
+{
+  SIZE_T absent=ruledout+falsepositives;
+
+  return absent ? (double)falsepositives/absent : 0.0;
+}
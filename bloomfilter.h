@@ -0,0 +1,67 @@
+#ifndef _bloomfilter
+#define _bloomfilter
+
+#include <stdint.h>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// A blocked Bloom filter over 64-bit key hashes.
+//
+// The filter is an array of 512-bit blocks.  A hash picks one block
+// and sets (or tests) a few bits inside it, so a query touches a single
+// cache line.  MayContain never answers false for a hash that was
+// added; it answers true for others at a rate set by the number of bits
+// per key.  Bits are never cleared, so a removed key only costs some
+// accuracy until the filter is next rebuilt.
+//
+// The filter also keeps the counts its owner reports to it, which give
+// the false positive rate seen so far.  These survive Reset.
+//
+
+class BloomFilter {
+ protected:
+  vector<uint64_t> bits;
+  SIZE_T numblocks;
+  SIZE_T numprobes;   // bits set per key
+  SIZE_T numkeys;     // keys added since the last Reset
+  SIZE_T capacity;    // keys it was sized for
+
+  SIZE_T queries;
+  SIZE_T ruledout;
+  SIZE_T falsepositives;
+
+ public:
+  BloomFilter();
+
+  // Empties the filter and sizes it for capacity keys at bitsperkey
+  // bits each.  A bitsperkey of zero turns the filter off
+  void Reset(const SIZE_T capacity, const SIZE_T bitsperkey);
+
+  bool IsEnabled() const { return numblocks>0; }
+  // True once more keys were added than the filter was sized for
+  bool IsOverfull() const { return numkeys>capacity; }
+
+  static uint64_t Hash(const BYTE_T *data, const SIZE_T len);
+
+  void Add(const uint64_t hash);
+  bool MayContain(const uint64_t hash) const;
+
+  // What the owner saw: a query the filter answered, and a query it
+  // let through that then found nothing
+  void NoteQuery(const bool ruledOut) { queries++; if (ruledOut) { ruledout++; } }
+  void NoteFalsePositive() { falsepositives++; }
+
+  SIZE_T GetNumKeys() const { return numkeys; }
+  SIZE_T GetCapacity() const { return capacity; }
+  SIZE_T GetNumQueries() const { return queries; }
+  SIZE_T GetNumRuledOut() const { return ruledout; }
+  SIZE_T GetNumFalsePositives() const { return falsepositives; }
+  // Of the queries for keys that were absent, the fraction let through
+  double GetFalsePositiveRate() const;
+};
+
+#endif
@@ -11,6 +11,7 @@
 
 #include <assert.h>
 #include <string.h>
+#include <algorithm>
 #include "btree.h"
 KeyValuePair::KeyValuePair()
 {}
@@ -39,18 +40,25 @@ KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 BTreeIndex::BTreeIndex(SIZE_T keysize,
                        SIZE_T valuesize,
                        BufferCache *cache,
-                       bool unique)
+                       bool unique,
+                       int format,
+                       int comparator)
 {
     superblock.info.keysize=keysize;
     superblock.info.valuesize=valuesize;
+    superblock.info.format=format;
+    superblock.info.comparator=comparator;
+    superblock.info.unique=unique;
     buffercache=cache;
-    // note: ignoring unique now
+    filterbits=0;
+    pinlevels=BTREE_DEFAULT_PIN_LEVELS;
+    epoch=1;
+    splits=0;
 }
 
 // Default constructor
-BTreeIndex::BTreeIndex()
+BTreeIndex::BTreeIndex() : filterbits(0), pinlevels(BTREE_DEFAULT_PIN_LEVELS), epoch(1), splits(0)
 {
-  // shouldn't have to do anything
 }
 
 
@@ -62,6 +70,12 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
     buffercache=rhs.buffercache;
     superblock_index=rhs.superblock_index;
     superblock=rhs.superblock;
+    filter=rhs.filter;
+    filterbits=rhs.filterbits;
+    pinlevels=rhs.pinlevels;
+    // Snapshots belong to the index that took them
+    epoch=rhs.epoch;
+    splits=rhs.splits;
 }
 
 // Destructor
@@ -104,6 +118,11 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
     superblock.Serialize(buffercache,superblock_index);
     
     buffercache->NotifyAllocateBlock(n);
+
+    if (!snapshots.empty())
+    {
+        born[n]=epoch;
+    }
     
     return ERROR_NOERROR;
 }
@@ -131,6 +150,8 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
     superblock.Serialize(buffercache,superblock_index);
     
     buffercache->NotifyDeallocateBlock(n);
+
+    born.erase(n);
     
     return ERROR_NOERROR;
 }
@@ -172,6 +193,59 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
      */
 
   if (create) {
+    const KeyOrder *order=GetKeyOrder(superblock.info.comparator);
+    if (!order) {
+      return ERROR_BADCONFIG;
+    }
+    // Integer keys must be exactly as wide as the integer
+    if (order->width && superblock.info.keysize!=order->width) {
+      return ERROR_SIZE;
+    }
+    // and cannot be cut short as separators or stored shorter in leaves
+    if (!order->prefixes && FormatHasVarSeparators(superblock.info.format)) {
+      return ERROR_BADCONFIG;
+    }
+    if (superblock.info.format==BTREE_FORMAT_BUFFERED) {
+      // Messages set a key's one value, so there is no room for duplicates
+      if (!superblock.info.unique) {
+	return ERROR_BADCONFIG;
+      }
+      // A flush must be able to leave a message behind and take a new one,
+      // and a split must leave keys on both sides
+      BTreeNode interior(BTREE_INTERIOR_NODE,
+			 superblock.info.keysize,
+			 superblock.info.valuesize,
+			 buffercache->GetBlockSize(),
+			 superblock.info.format,
+			 superblock.info.comparator);
+      if (interior.GetBufferCapacity()<2 || interior.GetNumSlots()<3) {
+	return ERROR_SIZE;
+      }
+    }
+    if (FormatHasVarSeparators(superblock.info.format)) {
+      // Slot offsets in nodes with variable-length keys are 16 bits
+      if (buffercache->GetBlockSize()>BTREE_MAX_VAR_BLOCKSIZE) {
+	return ERROR_SIZE;
+      }
+      // and the nodes must hold enough of the largest entries to split by bytes
+      BTreeNode interior(BTREE_INTERIOR_NODE,
+			 superblock.info.keysize,
+			 superblock.info.valuesize,
+			 buffercache->GetBlockSize(),
+			 superblock.info.format,
+			 superblock.info.comparator);
+      BTreeNode leaf(BTREE_LEAF_NODE,
+		     superblock.info.keysize,
+		     superblock.info.valuesize,
+		     buffercache->GetBlockSize(),
+		     superblock.info.format,
+		     superblock.info.comparator);
+      if (interior.GetFreeBytes()<BTREE_MIN_VAR_ENTRIES*interior.GetMaxEntrySize() ||
+	  leaf.GetFreeBytes()<BTREE_MIN_VAR_ENTRIES*leaf.GetMaxEntrySize()) {
+	return ERROR_SIZE;
+      }
+    }
+
     // build a super block, root node, and a free space list
     //
     // Superblock at superblock_index
@@ -180,10 +254,13 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     BTreeNode newsuperblock(BTREE_SUPERBLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
+			    buffercache->GetBlockSize(),
+			    superblock.info.format,
+			    superblock.info.comparator);
     newsuperblock.info.rootnode=superblock_index+1;
     newsuperblock.info.freelist=superblock_index+2;
     newsuperblock.info.numkeys=0;
+    newsuperblock.info.unique=superblock.info.unique;
 
     buffercache->NotifyAllocateBlock(superblock_index);
 
@@ -194,7 +271,9 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     BTreeNode newrootnode(BTREE_ROOT_NODE,
 			  superblock.info.keysize,
 			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
+			  buffercache->GetBlockSize(),
+			  superblock.info.format,
+			  superblock.info.comparator);
     newrootnode.info.rootnode=superblock_index+1;
     newrootnode.info.freelist=superblock_index+2;
     newrootnode.info.numkeys=0;
@@ -210,7 +289,9 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
       BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
+			    buffercache->GetBlockSize(),
+			    superblock.info.format,
+			    superblock.info.comparator);
       newfreenode.info.rootnode=superblock_index+1;
       newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
       
@@ -222,8 +303,18 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
   }
 
   // OK, now, mounting the btree is simply a matter of reading the superblock 
+  // (and filling the filter, if there is one, from the keys in the tree)
+
+  UnpinAll();
+  snapshots.clear();
+  born.clear();
+  retired.clear();
 
-  return superblock.Unserialize(buffercache,initblock);
+  rc=superblock.Unserialize(buffercache,initblock);
+
+  if (rc) {  return rc;  }
+
+  return RebuildFilter();
 }
     
 
@@ -236,6 +327,12 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
  */
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
+  ERROR_T rc;
+
+  // Snapshots do not outlive the attach, so what only they held is freed
+  snapshots.clear();
+  if ((rc=ReclaimRetired())) {  return rc;  }
+
   return superblock.Serialize(buffercache,superblock_index);
 }
 
@@ -247,13 +344,32 @@ ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
  * Params:  (ostream &o, BTreeDisplayType display_type)
  */
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+{
+    return DisplayTree(superblock.info.rootnode,o,display_type);
+}
+
+
+/*
+ * DisplayTree(const SIZE_T root, ostream &o, BTreeDisplayType display_type)
+ *
+ * Display for the tree under root, the live one or a snapshot's
+ */
+ERROR_T BTreeIndex::DisplayTree(const SIZE_T root, ostream &o, const BTreeDisplayType display_type) const
 {
     ERROR_T rc;
     if (display_type==BTREE_DEPTH_DOT)
     {
         o << "digraph tree { \n";
     }
-    rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+    if (display_type==BTREE_SORTED_KEYVAL && superblock.info.format==BTREE_FORMAT_BUFFERED)
+    {
+        // The pending writes have to be merged into what the leaves hold
+        rc=DisplayBuffered(root,vector<KeyValuePair>(),o);
+    }
+    else
+    {
+        rc=DisplayInternal(root,o,display_type);
+    }
     if (display_type==BTREE_DEPTH_DOT)
     {
         o << "}\n";
@@ -270,7 +386,139 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
  */
 ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
 {
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+    if (WrongSize(key.length, superblock.info.keysize))
+        return ERROR_SIZE;
+    if (FilterRulesOut(key.data, key.length))
+        return ERROR_NONEXISTENT;
+    ERROR_T rc = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+    if (rc == ERROR_NONEXISTENT)
+        FilterMissed();
+    return rc;
+}
+
+
+// Orders the positions of keys in a batch by the keys
+struct BatchKeyLess {
+    const KeyOrder *order;
+    const vector<KEY_T> *keys;
+
+    bool operator()(const SIZE_T lhs, const SIZE_T rhs) const {
+        const KEY_T &l = (*keys)[lhs], &r = (*keys)[rhs];
+        return order->compare((const char *) l.data, l.length, (const char *) r.data, r.length) < 0;
+    }
+};
+
+
+/*
+ * Name:    LookupBatch
+ * Purpose: look up many keys with one descent for the keys under each node
+ * Params:  const vector<KEY_T> &keys
+ *          vector<VALUE_T> &values
+ *          vector<ERROR_T> &results
+ */
+ERROR_T BTreeIndex::LookupBatch(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+                                vector<ERROR_T> &results)
+{
+    vector<SIZE_T> order;
+
+    values.resize(keys.size());
+    results.assign(keys.size(), ERROR_NONEXISTENT);
+    // Keys of the wrong size, or that the filter rules out, never join the descent
+    for (SIZE_T i = 0; i < keys.size(); i++) {
+        if (WrongSize(keys[i].length, superblock.info.keysize))
+            results[i] = ERROR_SIZE;
+        else if (!FilterRulesOut(keys[i].data, keys[i].length))
+            order.push_back(i);
+    }
+    if (!order.empty()) {
+        BatchKeyLess less = { GetKeyOrder(superblock.info.comparator), &keys };
+        stable_sort(order.begin(), order.end(), less);
+        LookupBatchInternal(superblock.info.rootnode, keys, &order[0], &order[0] + order.size(),
+                            values, results);
+    }
+    for (SIZE_T i = 0; i < keys.size(); i++)
+        if (results[i] != ERROR_NOERROR && results[i] != ERROR_NONEXISTENT)
+            return results[i];
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * LookupBatchInternal
+ *
+ * Looks up the keys at the positions first..last, which are in key
+ * order, in the subtree under node.  Their results start out as
+ * ERROR_NONEXISTENT.  An interior node hands each run of keys that go to
+ * the same child down together; the run is reordered in place as the
+ * keys a buffer answers are taken out of it
+ */
+ERROR_T BTreeIndex::LookupBatchInternal(const SIZE_T node, const vector<KEY_T> &keys,
+                                        SIZE_T *first, SIZE_T *last,
+                                        vector<VALUE_T> &values, vector<ERROR_T> &results,
+                                        PinnedNode *parent, const SIZE_T slot)
+{
+    BTreeNode b;
+    const BTreeNode *r;
+    PinnedNode *pin;
+    ERROR_T rc;
+    SIZE_T offset, ptr;
+    SIZE_T *i, *run;
+
+    if ((rc = ReadNode(node, parent, slot, b, r, pin))) {
+        for (i = first; i < last; i++)
+            results[*i] = rc;
+        return rc;
+    }
+
+    switch (r->info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (r->info.numkeys == 0) {
+                for (i = first; i < last; i++)
+                    FilterMissed();
+                return ERROR_NOERROR;
+            }
+            if (r->HasBuffer()) {
+                // Keys with a write pending here are answered by it, and
+                // the rest close up behind them, still in order
+                SIZE_T *kept = first;
+                for (i = first; i < last; i++) {
+                    KEY_T found;
+                    if (r->FindMessage(keys[*i], offset))
+                        results[*i] = r->GetMessage(offset, found, values[*i]);
+                    else
+                        *kept++ = *i;
+                }
+                last = kept;
+            }
+            for (run = first; run < last; run = i) {
+                offset = r->LowerBound(keys[*run]);
+                for (i = run + 1; i < last && r->LowerBound(keys[*i]) == offset; i++)
+                    ;
+                if ((rc = r->GetPtr(offset, ptr))) {
+                    for (; run < i; run++)
+                        results[*run] = rc;
+                    continue;
+                }
+                LookupBatchInternal(ptr, keys, run, i, values, results, pin, offset);
+            }
+            return ERROR_NOERROR;
+
+        case BTREE_LEAF_NODE:
+            for (i = first; i < last; i++) {
+                offset = b.LowerBound(keys[*i]);
+                if (offset < b.info.numkeys && b.CompareKey(offset, keys[*i]) == 0)
+                    results[*i] = GetLeafVal(b, offset, values[*i]);
+                else
+                    FilterMissed();
+            }
+            return ERROR_NOERROR;
+
+        default:
+            for (i = first; i < last; i++)
+                results[*i] = ERROR_INSANE;
+            return ERROR_INSANE;
+    }
 }
 
 
@@ -283,8 +531,47 @@ ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
 ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
 {
     // WROTE ME
+    if (WrongSize(key.length, superblock.info.keysize) ||
+        WrongSize(value.length, superblock.info.valuesize))
+        return ERROR_SIZE;
+    if (FilterRulesOut(key.data, key.length))
+        return ERROR_NONEXISTENT;
+    if (!snapshots.empty()) {
+        // Copy the path out of the snapshots only if there is a key to change
+        VALUE_T old;
+        ERROR_T rc = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, old);
+        if (rc == ERROR_NONEXISTENT)
+            FilterMissed();
+        if (rc || (rc = ShadowPath(key)))
+            return rc;
+    }
+    if (superblock.info.format == BTREE_FORMAT_BUFFERED) {
+        // Once the key is known to be there, the new value goes down
+        // as a message like any other write
+        VALUE_T old;
+        ERROR_T rc = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, old);
+        if (rc == ERROR_NONEXISTENT)
+            FilterMissed();
+        if (rc)
+            return rc;
+        if ((rc = PlaceMessage(superblock.info.rootnode, key, value)))
+            return rc;
+        return SplitRootIfFull();
+    }
+    if (superblock.info.format == BTREE_FORMAT_SLOTTED) {
+        // A longer value can leave its leaf full, so take the insert
+        // path down, which splits full nodes on the way back up
+        ERROR_T error = PlaceKeyVal(superblock.info.rootnode, superblock.info.rootnode,
+                                    key, value, BTREE_OP_UPDATE);
+        if (error)
+            return error;
+        return SplitRootIfFull();
+    }
     VALUE_T valueWritable = value;
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, valueWritable);
+    ERROR_T rc = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, valueWritable);
+    if (rc == ERROR_NONEXISTENT)
+        FilterMissed();
+    return rc;
 }
 
 
@@ -296,22 +583,25 @@ ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
 ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
 					   const BTreeOp op,
 					   const KEY_T &key,
-					   VALUE_T &value)
+					   VALUE_T &value,
+					   PinnedNode *parent,
+					   const SIZE_T slot)
 {
     BTreeNode b;
+    const BTreeNode *r;
+    PinnedNode *pin;
     ERROR_T rc;
     SIZE_T offset;
-    KEY_T testkey;
     SIZE_T ptr;
     
-    rc= b.Unserialize(buffercache,node);
+    rc= ReadNode(node,parent,slot,b,r,pin);
     
     if (rc!=ERROR_NOERROR)
     {
         return rc;
     }
     
-    switch (b.info.nodetype)
+    switch (r->info.nodetype)
     {
         //
         // Internal nodes:
@@ -319,48 +609,45 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
         //
         case BTREE_ROOT_NODE:
         case BTREE_INTERIOR_NODE:
-            // Scan through key/ptr pairs
-            // and recurse if possible
-            for (offset=0;offset<b.info.numkeys;offset++)
-            {
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (key<testkey || key==testkey)
-                {
-                    // OK, so we now have the first key that's larger
-                    // so we ned to recurse on the ptr immediately previous to
-                    // this one, if it exists
-                    rc=b.GetPtr(offset,ptr);
-                    if (rc) { return rc; }
-                    return LookupOrUpdateInternal(ptr,op,key,value);
-                }
-            }
-            // if we got here, we need to go to the next pointer, if it exists
-            if (b.info.numkeys>0)
-            {
-                rc=b.GetPtr(b.info.numkeys,ptr);
-                if (rc) { return rc; }
-                return LookupOrUpdateInternal(ptr,op,key,value);
-            }
-            else
+            if (r->info.numkeys==0)
             {
                 // There are no keys at all on this node, so nowhere to go
                 return ERROR_NONEXISTENT;
             }
+            // A write still waiting in the buffer is newer than anything
+            // below it (only lookups come this way in a BUFFERED index)
+            if (r->HasBuffer() && r->FindMessage(key, offset))
+            {
+                KEY_T found;
+                return r->GetMessage(offset,found,value);
+            }
+            // Find the first key that's at least as large, and recurse
+            // on the ptr immediately previous to it, or on the last ptr
+            // if there is no such key
+            offset=r->LowerBound(key);
+            rc=r->GetPtr(offset,ptr);
+            if (rc) { return rc; }
+            return LookupOrUpdateInternal(ptr,op,key,value,pin,offset);
             break;
             
         //
         // Leaf nodes: store keys and their associated values
+        // (never pinned, so these are always read into b)
         //
         case BTREE_LEAF_NODE:
-            // Scan through keys looking for matching value
-            for (offset=0;offset<b.info.numkeys;offset++)
+            // Search the keys for a matching value
+            offset=b.LowerBound(key);
+            if (offset<b.info.numkeys)
             {
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (testkey==key) {
+                if (b.CompareKey(offset,key)==0) {
                     if (op==BTREE_OP_LOOKUP)
                     {
+                        if (b.IsOverflowVal(offset))
+                        {
+                            OverflowRef ref;
+                            b.GetOverflowVal(offset,ref);
+                            return ReadOverflow(buffercache,ref,value);
+                        }
                         return b.GetVal(offset,value);
                     }
                     else
@@ -386,6 +673,131 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
 }
 
 
+/*
+ * FindLeaf
+ *
+ * Finds the leftmost leaf that could hold key
+ */
+ERROR_T BTreeIndex::FindLeaf(const KEY_T &key, SIZE_T &leaf)
+{
+    BTreeNode b;
+    const BTreeNode *r;
+    PinnedNode *pin = 0;
+    SIZE_T offset = 0;
+    ERROR_T rc;
+
+    leaf = superblock.info.rootnode;
+    for (;;) {
+        if ((rc = ReadNode(leaf, pin, offset, b, r, pin)))
+            return rc;
+        switch (r->info.nodetype) {
+            case BTREE_LEAF_NODE:
+                return ERROR_NOERROR;
+            case BTREE_ROOT_NODE:
+            case BTREE_INTERIOR_NODE:
+                if (r->info.numkeys == 0)
+                    return ERROR_NONEXISTENT;
+                offset = r->LowerBound(key);
+                if ((rc = r->GetPtr(offset, leaf)))
+                    return rc;
+                break;
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+
+/*
+ * GetLeafVal
+ *
+ * Gives the ith value of a leaf, wherever it is stored
+ */
+ERROR_T BTreeIndex::GetLeafVal(const BTreeNode &b, const SIZE_T offset, VALUE_T &value)
+{
+    if (b.IsOverflowVal(offset)) {
+        OverflowRef ref;
+        b.GetOverflowVal(offset, ref);
+        return ReadOverflow(buffercache, ref, value);
+    }
+    return b.GetVal(offset, value);
+}
+
+
+/*
+ * Name:    LookupFirst
+ * Purpose: start a walk over the values stored under key
+ * Params:  const KEY_T &key
+ *          BTreeCursor &cursor
+ *          VALUE_T &value
+ */
+ERROR_T BTreeIndex::LookupFirst(const KEY_T &key, BTreeCursor &cursor, VALUE_T &value)
+{
+    BTreeNode b;
+    ERROR_T rc;
+
+    cursor.key = key;
+    cursor.node = 0;
+    if (FilterRulesOut(key.data, key.length))
+        return ERROR_NONEXISTENT;
+    if (superblock.info.format == BTREE_FORMAT_BUFFERED) {
+        // A unique index with writes pending above the leaves: the one
+        // value is the Lookup, and there is no leaf to walk on from
+        return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+    }
+    if ((rc = FindLeaf(key, cursor.node)))
+        return rc;
+    if ((rc = b.Unserialize(buffercache, cursor.node)))
+        return rc;
+    cursor.offset = b.LowerBound(key);
+    if (cursor.offset == b.info.numkeys) {
+        // The values could only start at the front of the next leaf
+        if ((rc = b.GetPtr(0, cursor.node)))
+            return rc;
+        if (cursor.node == 0)
+            return ERROR_NONEXISTENT;
+        if ((rc = b.Unserialize(buffercache, cursor.node)))
+            return rc;
+        cursor.offset = 0;
+    }
+    if (cursor.offset == b.info.numkeys || b.CompareKey(cursor.offset, key) != 0)
+        return ERROR_NONEXISTENT;
+    return GetLeafVal(b, cursor.offset, value);
+}
+
+
+/*
+ * Name:    LookupNext
+ * Purpose: continue a walk started by LookupFirst
+ * Params:  BTreeCursor &cursor
+ *          VALUE_T &value
+ */
+ERROR_T BTreeIndex::LookupNext(BTreeCursor &cursor, VALUE_T &value)
+{
+    BTreeNode b;
+    ERROR_T rc;
+
+    if (cursor.node == 0)
+        return ERROR_NONEXISTENT;
+    if ((rc = b.Unserialize(buffercache, cursor.node)))
+        return rc;
+    cursor.offset++;
+    // A run of values can carry on into the following leaves
+    while (cursor.offset >= b.info.numkeys) {
+        if ((rc = b.GetPtr(0, cursor.node)))
+            return rc;
+        if (cursor.node == 0)
+            return ERROR_NONEXISTENT;
+        if ((rc = b.Unserialize(buffercache, cursor.node)))
+            return rc;
+        cursor.offset = 0;
+    }
+    if (b.CompareKey(cursor.offset, cursor.key) != 0)
+        return ERROR_NONEXISTENT;
+    return GetLeafVal(b, cursor.offset, value);
+}
+
+
 /*
  * Name:    Delete
  * Purpose: delete the key/value pairassociated with the given key
@@ -414,13 +826,29 @@ ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
 
     ERROR_T error;
     BTreeNode root;
+
+    if (WrongSize(key.length, superblock.info.keysize) ||
+        WrongSize(value.length, superblock.info.valuesize))
+        return ERROR_SIZE;
+
+    if (!snapshots.empty()) {
+        // Copy the path out of the snapshots only if the key can go in
+        VALUE_T temp;
+        if (superblock.info.unique && ERROR_NONEXISTENT != BTreeIndex::Lookup(key, temp))
+            return ERROR_CONFLICT;
+        if ((error = ShadowPath(key)))
+            return error;
+    }
+
     root.Unserialize(buffercache,superblock.info.rootnode);
 
     if (root.info.numkeys == 0) { // This is the case when root is empty
         BTreeNode leaf(BTREE_LEAF_NODE, 
             superblock.info.keysize,
             superblock.info.valuesize,
-            buffercache->GetBlockSize());
+            buffercache->GetBlockSize(),
+            superblock.info.format,
+            superblock.info.comparator);
         
         SIZE_T leftNode;
         SIZE_T rightNode;
@@ -432,51 +860,82 @@ ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
         // Write these new blocks to the disk as leafs
         // (see Attach for how the root and superblock are initialized
         // and written - AllocateNode does not handle all of it!)
-        leaf.Serialize(buffercache, leftNode); 
+        // The left one links to the right one as its next leaf
         leaf.Serialize(buffercache, rightNode);
-        root.info.numkeys += 1;
-        root.SetKey(0, key);
+        leaf.SetPtr(0, rightNode);
+        leaf.Serialize(buffercache, leftNode); 
         root.SetPtr(0, leftNode);
-        root.SetPtr(1, rightNode);
+        if ((error = root.InsertKeyPtr(0, key, rightNode)) != ERROR_NOERROR)
+            return error;
+        Unpin(superblock.info.rootnode);
         root.Serialize(buffercache, superblock.info.rootnode);
     } 
 
     VALUE_T temp;
-    SIZE_T oldRoot=superblock.info.rootnode, newNode;
-    KEY_T splitKey;
 
-    BTreeNode interior(BTREE_INTERIOR_NODE, 
-        superblock.info.keysize,
-        superblock.info.valuesize,
-        buffercache->GetBlockSize());
-
-    if (ERROR_NONEXISTENT == Lookup(key, temp)) {
-        error = PlaceKeyVal(superblock.info.rootnode, superblock.info.rootnode, key, value);
-        if (IsNodeFull(superblock.info.rootnode)) {
-            SplitNode(oldRoot, newNode, splitKey);
-            // Load the node data into Interior nodes (indead of root nodes)
-            // and then save this new node status onto disk (for both nodes)
-            interior.Unserialize(buffercache, oldRoot);
-            interior.Serialize(buffercache, oldRoot);
-            interior.Unserialize(buffercache, newNode);
-            interior.Serialize(buffercache, newNode);
-
-            // Make new root node
-            if ((error = AllocateNode(superblock.info.rootnode)) != ERROR_NOERROR)
-                return error;
-            root.info.numkeys = 1;
-            root.SetKey(0, splitKey);
-            root.SetPtr(0, oldRoot);
-            root.SetPtr(1, newNode);
-            root.Serialize(buffercache, superblock.info.rootnode);
-        }
-        return error;
+    // Only the tree itself counts here, not what an index in front of
+    // it (see lsmindex.h) is still holding
+    if (!superblock.info.unique || ERROR_NONEXISTENT == BTreeIndex::Lookup(key, temp)) {
+        if (superblock.info.format == BTREE_FORMAT_BUFFERED)
+            error = PlaceMessage(superblock.info.rootnode, key, value);
+        else
+            error = PlaceKeyVal(superblock.info.rootnode, superblock.info.rootnode, key, value);
+        ERROR_T splitError = SplitRootIfFull();
+        if (error || splitError)
+            return error ? error : splitError;
+        return FilterAdd(key.data, key.length);
     }
     else
         return ERROR_CONFLICT;
 }
 
 
+/*
+ * SplitRootIfFull
+ *
+ * Splits a full root in two and puts a new root above the halves,
+ * growing the tree by one level
+ */
+ERROR_T BTreeIndex::SplitRootIfFull()
+{
+    ERROR_T error;
+    SIZE_T oldRoot=superblock.info.rootnode, newNode;
+    KEY_T splitKey;
+
+    BTreeNode interior;
+
+    if (IsNodeFull(superblock.info.rootnode)) {
+        // Every node moves down a level
+        UnpinAll();
+        if ((error = SplitNode(oldRoot, newNode, splitKey)) != ERROR_NOERROR)
+            return error;
+        // Load the node data into Interior nodes (indead of root nodes)
+        // and then save this new node status onto disk (for both nodes)
+        interior.Unserialize(buffercache, oldRoot);
+        interior.info.nodetype = BTREE_INTERIOR_NODE;
+        interior.Serialize(buffercache, oldRoot);
+        interior.Unserialize(buffercache, newNode);
+        interior.info.nodetype = BTREE_INTERIOR_NODE;
+        interior.Serialize(buffercache, newNode);
+
+        // Make new root node
+        if ((error = AllocateNode(superblock.info.rootnode)) != ERROR_NOERROR)
+            return error;
+        BTreeNode newRoot(BTREE_ROOT_NODE,
+            superblock.info.keysize,
+            superblock.info.valuesize,
+            buffercache->GetBlockSize(),
+            superblock.info.format,
+            superblock.info.comparator);
+        newRoot.SetPtr(0, oldRoot);
+        if ((error = newRoot.InsertKeyPtr(0, splitKey, newNode)) != ERROR_NOERROR)
+            return error;
+        return newRoot.Serialize(buffercache, superblock.info.rootnode);
+    }
+    return ERROR_NOERROR;
+}
+
+
 // Here you should figure out if your index makes sense
 // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
 // a valid use ratio?
@@ -495,67 +954,146 @@ ERROR_T BTreeIndex::SanityCheck() const
 }
 
 
+/*
+ * MeasureShape
+ *
+ * Adds the nodes below node, at depth levels under the root, to the
+ * shape.  The fills are summed here and made means by GetShape
+ */
+ERROR_T BTreeIndex::MeasureShape(const SIZE_T node, const SIZE_T depth, BTreeShape &shape) const
+{
+    BTreeNode b;
+    SIZE_T ptr, space;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    switch (b.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (b.info.numkeys == 0)
+                return ERROR_NOERROR;
+            space = b.info.GetNumPivotBytes() - sizeof(SIZE_T);
+            shape.interiornodes++;
+            shape.interiorfill += (double) (space - b.GetFreeBytes()) / space;
+            for (SIZE_T i = 0; i <= b.info.numkeys; i++) {
+                if ((rc = b.GetPtr(i, ptr)))
+                    return rc;
+                if ((rc = MeasureShape(ptr, depth + 1, shape)))
+                    return rc;
+            }
+            return ERROR_NOERROR;
+        case BTREE_LEAF_NODE:
+            space = b.info.GetNumDataBytes() - sizeof(SIZE_T);
+            shape.leafnodes++;
+            shape.leaffill += (double) (space - b.GetFreeBytes()) / space;
+            shape.keys += b.info.numkeys;
+            if (depth + 1 > shape.height)
+                shape.height = depth + 1;
+            return ERROR_NOERROR;
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+/*
+ * Name:    GetShape
+ * Purpose: count the levels, nodes and keys of the tree, and how full it is
+ * Params:  BTreeShape &shape
+ */
+ERROR_T BTreeIndex::GetShape(BTreeShape &shape) const
+{
+    ERROR_T rc;
+
+    memset(&shape, 0, sizeof(shape));
+    if ((rc = MeasureShape(superblock.info.rootnode, 0, shape)))
+        return rc;
+    shape.interiorfill = shape.interiornodes ? shape.interiorfill / shape.interiornodes : 0;
+    shape.leaffill = shape.leafnodes ? shape.leaffill / shape.leafnodes : 0;
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    ExportMetrics
+ * Purpose: add the measurements of the index to m
+ * Params:  Metrics &m
+ */
+ERROR_T BTreeIndex::ExportMetrics(Metrics &m) const
+{
+    BTreeShape shape;
+    ERROR_T rc;
+
+    if ((rc = GetShape(shape)))
+        return rc;
+    m.AddGauge("btree_index_height", "Levels of the tree, from the root to the leaves", shape.height);
+    m.AddGauge("btree_index_interior_nodes", "Interior nodes, with the root", shape.interiornodes);
+    m.AddGauge("btree_index_leaf_nodes", "Leaf nodes", shape.leafnodes);
+    m.AddGauge("btree_index_keys", "Keys in the leaves", shape.keys);
+    m.AddGauge("btree_index_interior_fill_ratio", "Mean fraction of interior node space in use",
+               shape.interiorfill);
+    m.AddGauge("btree_index_leaf_fill_ratio", "Mean fraction of leaf space in use", shape.leaffill);
+    m.AddCounter("btree_index_splits_total", "Nodes split", splits);
+    m.AddGauge("btree_index_pinned_nodes", "Nodes pinned in memory", pinned.size());
+    m.AddGauge("btree_index_snapshots", "Snapshots held", snapshots.size());
+    if (filter.IsEnabled()) {
+        m.AddCounter("btree_filter_queries_total", "Lookups the Bloom filter was asked about",
+                     filter.GetNumQueries());
+        m.AddCounter("btree_filter_ruled_out_total", "Lookups the Bloom filter answered",
+                     filter.GetNumRuledOut());
+        m.AddCounter("btree_filter_false_positives_total",
+                     "Lookups the Bloom filter let through that found nothing",
+                     filter.GetNumFalsePositives());
+    }
+    return ERROR_NOERROR;
+}
+
+
 /*
  * PlaceKeyVal
  *
- * Tries to place a key-value pair in the BTree
+ * Tries to place a key-value pair in the BTree.  With BTREE_OP_UPDATE,
+ * the value of an existing key is replaced instead, and ERROR_NONEXISTENT
+ * is returned if there is no such key
  */
-ERROR_T BTreeIndex::PlaceKeyVal(SIZE_T node, SIZE_T parent, const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::PlaceKeyVal(SIZE_T node, SIZE_T parent, const KEY_T &key, const VALUE_T &value,
+                                const BTreeOp op, PinnedNode *pinnedParent, const SIZE_T slot)
 {
     BTreeNode b;
+    const BTreeNode *r;
+    PinnedNode *pin;
     ERROR_T rc;
     SIZE_T offset;
-    KEY_T testkey;
     SIZE_T ptr;
     // Only used in splitting
     SIZE_T newNode;
     KEY_T splitKey;
 
-    b.Unserialize(buffercache, node); 
-    switch (b.info.nodetype) {
+    if ((rc = ReadNode(node, pinnedParent, slot, b, r, pin)))
+        return rc;
+    switch (r->info.nodetype) {
         // Internal nodes:
         // store keys and pointers (disk block #) to other disk blocks
         case BTREE_ROOT_NODE:
         case BTREE_INTERIOR_NODE:
-            // Scan through key/ptr pairs
-            // and recurse if possible
-            for (offset=0;offset<b.info.numkeys;offset++)
-            {
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (key<testkey || key==testkey) {
-                    // OK, so we now have the first key that's larger
-                    // so we ned to recurse on the ptr immediately previous to
-                    // this one, if it exists
-                    rc=b.GetPtr(offset,ptr);
-                    if (rc) { return rc; }
-                    rc=PlaceKeyVal(ptr, node, key, value);
-                    if (rc) { return rc; }
-                    if (IsNodeFull(ptr)) {
-                        rc = SplitNode(ptr, newNode, splitKey);
-                        if (rc) { return rc; }
-                        return AddNewKeyPtr(node, splitKey, newNode);
-                    } else {
-                        return rc;
-                    }
-                }
+            if (r->info.numkeys==0) {
+                // There are no keys at all on this node, so nowhere to go
+                return ERROR_NONEXISTENT;
             }
-            // if we got here, we need to go to the next pointer, if it exists
-            if (b.info.numkeys>0) {
-                rc=b.GetPtr(b.info.numkeys,ptr);
-                if (rc) { return rc; }
-                rc=PlaceKeyVal(ptr, node, key, value);
+            // Recurse on the ptr immediately previous to the first key
+            // that's at least as large, or on the last ptr if there is none
+            offset=r->LowerBound(key);
+            rc=r->GetPtr(offset,ptr);
+            if (rc) { return rc; }
+            rc=PlaceKeyVal(ptr, node, key, value, op, pin, offset);
+            if (rc) { return rc; }
+            if (IsNodeFull(ptr)) {
+                rc = SplitNode(ptr, newNode, splitKey);
                 if (rc) { return rc; }
-                if (IsNodeFull(ptr)) {
-                    rc = SplitNode(ptr, newNode, splitKey);
-                    if (rc) { return rc; }
-                    return AddNewKeyPtr(node, splitKey, newNode);
-                } else {
-                    return rc;
-                }
+                return AddNewKeyPtr(node, offset, splitKey, newNode);
             } else {
-                // There are no keys at all on this node, so nowhere to go
-                return ERROR_NONEXISTENT;
+                return rc;
             }
             break;
             
@@ -569,10 +1107,29 @@ ERROR_T BTreeIndex::PlaceKeyVal(SIZE_T node, SIZE_T parent, const KEY_T &key, co
         // the leaf node is full after this new key-value pair is inserted, and
         // thus the invariant is maintained
         case BTREE_LEAF_NODE:
-            return AddNewKeyVal(node, key, value);
-            break;
-
-        default:
+            if (b.HasVarKeys() && value.length > b.GetMaxInlineValue())
+                return PlaceOverflowVal(node, key, value, op);
+            if (op == BTREE_OP_UPDATE) {
+                offset=b.LowerBound(key);
+                if (offset<b.info.numkeys) {
+                    if (b.CompareKey(offset,key)==0) {
+                        OverflowRef old;
+                        bool wasOverflow = b.IsOverflowVal(offset);
+                        if (wasOverflow)
+                            b.GetOverflowVal(offset, old);
+                        if ((rc = b.SetVal(offset, value)))
+                            return rc;
+                        if ((rc = b.Serialize(buffercache, node)))
+                            return rc;
+                        return wasOverflow ? FreeOverflow(old) : ERROR_NOERROR;
+                    }
+                }
+                return ERROR_NONEXISTENT;
+            }
+            return AddNewKeyVal(node, key, value);
+            break;
+
+        default:
             // We can't be looking at anything other than
             // a root, internal, or leaf [node]
             return ERROR_INSANE;
@@ -583,16 +1140,339 @@ ERROR_T BTreeIndex::PlaceKeyVal(SIZE_T node, SIZE_T parent, const KEY_T &key, co
 }
 
 
+/*
+ * PlaceMessage
+ *
+ * Hands a write to node in a BUFFERED index.  An interior node adds it
+ * to its buffer, first flushing the buffer if it is full; a leaf takes
+ * it in, replacing the value of the key or adding the key.  Either way
+ * node may be left full, for the caller to split as PlaceKeyVal does
+ */
+ERROR_T BTreeIndex::PlaceMessage(const SIZE_T node, const KEY_T &key, const VALUE_T &value)
+{
+    BTreeNode b;
+    SIZE_T offset;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    switch (b.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (b.info.nummessages == b.GetBufferCapacity()) {
+                if ((rc = FlushBuffer(node)))
+                    return rc;
+                if ((rc = b.Unserialize(buffercache, node)))
+                    return rc;
+            }
+            if ((rc = b.AppendMessage(key, value)))
+                return rc;
+            return b.Serialize(buffercache, node);
+        case BTREE_LEAF_NODE:
+            offset = b.LowerBound(key);
+            if (offset < b.info.numkeys && b.CompareKey(offset, key) == 0)
+                rc = b.SetVal(offset, value);
+            else
+                rc = b.InsertKeyVal(offset, key, value);
+            if (rc)
+                return rc;
+            return b.Serialize(buffercache, node);
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+/*
+ * FlushBuffer
+ *
+ * Makes room in the buffer of node by carrying the messages for one
+ * child, the one with the most of them, down a level in a batch.  The
+ * child is split as it fills, and the flush stops early if those splits
+ * fill node; the messages it did not get to stay behind, and node is
+ * left for the caller to split
+ */
+ERROR_T BTreeIndex::FlushBuffer(const SIZE_T node)
+{
+    BTreeNode b;
+    vector<KeyValuePair> messages, batch;
+    KeyValuePair m;
+    SIZE_T offset, ptr, best, i;
+    SIZE_T newNode;
+    KEY_T splitKey;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+
+    // Take every message out, and find the child most of them go to
+    vector<SIZE_T> counts(b.info.numkeys + 1, 0);
+    for (i = 0; i < b.info.nummessages; i++) {
+        if ((rc = b.GetMessage(i, m.key, m.value)))
+            return rc;
+        messages.push_back(m);
+        counts[b.LowerBound(m.key)]++;
+    }
+    best = 0;
+    for (i = 1; i < counts.size(); i++)
+        if (counts[i] > counts[best])
+            best = i;
+
+    // The rest go back in the order they came, so they stay oldest first
+    b.info.nummessages = 0;
+    for (i = 0; i < messages.size(); i++) {
+        if (b.LowerBound(messages[i].key) == best)
+            batch.push_back(messages[i]);
+        else if ((rc = b.AppendMessage(messages[i].key, messages[i].value)))
+            return rc;
+    }
+    if ((rc = b.Serialize(buffercache, node)))
+        return rc;
+
+    for (i = 0; i < batch.size() && !b.IsFull(); i++) {
+        // Splits below add keys here, so each message is routed afresh
+        offset = b.LowerBound(batch[i].key);
+        if ((rc = b.GetPtr(offset, ptr)))
+            return rc;
+        // The flush leaves the path the write came down, so the child
+        // may still be a snapshot's
+        if ((rc = ShadowChild(node, b, offset, ptr)))
+            return rc;
+        if ((rc = PlaceMessage(ptr, batch[i].key, batch[i].value)))
+            return rc;
+        if (IsNodeFull(ptr)) {
+            if ((rc = SplitNode(ptr, newNode, splitKey)))
+                return rc;
+            if ((rc = AddNewKeyPtr(node, offset, splitKey, newNode)))
+                return rc;
+            if ((rc = b.Unserialize(buffercache, node)))
+                return rc;
+        }
+    }
+    if (i == batch.size())
+        return ERROR_NOERROR;
+    for (; i < batch.size(); i++)
+        if ((rc = b.AppendMessage(batch[i].key, batch[i].value)))
+            return rc;
+    return b.Serialize(buffercache, node);
+}
+
+
+/*
+ * PlaceOverflowVal
+ *
+ * Like the leaf case of PlaceKeyVal, for a value too large to keep in the
+ * leaf.  The value goes to a fresh chain of overflow blocks, and the leaf
+ * holds a reference to it.  A chain the value replaces is freed.
+ */
+ERROR_T BTreeIndex::PlaceOverflowVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value,
+                                     const BTreeOp op)
+{
+    BTreeNode b;
+    SIZE_T offset;
+    OverflowRef ref, old;
+    bool wasOverflow = false;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+
+    if (op == BTREE_OP_UPDATE) {
+        offset = b.LowerBound(key);
+        if (offset == b.info.numkeys || b.CompareKey(offset, key) != 0)
+            return ERROR_NONEXISTENT;
+        wasOverflow = b.IsOverflowVal(offset);
+        if (wasOverflow)
+            b.GetOverflowVal(offset, old);
+    } else {
+        offset = b.UpperBound(key);
+    }
+
+    if ((rc = WriteOverflow(value, ref)))
+        return rc;
+
+    if ((op != BTREE_OP_UPDATE && (rc = b.InsertKeyVal(offset, key, VALUE_T()))) ||
+        (rc = b.SetOverflowVal(offset, ref)) ||
+        (rc = b.Serialize(buffercache, node))) {
+        // The leaf does not refer to the new chain
+        FreeOverflow(ref);
+        return rc;
+    }
+    return wasOverflow ? FreeOverflow(old) : ERROR_NOERROR;
+}
+
+
+/*
+ * WriteOverflow
+ *
+ * Stores value in a new chain of overflow blocks and says where it is in ref
+ */
+ERROR_T BTreeIndex::WriteOverflow(const VALUE_T &value, OverflowRef &ref)
+{
+    BTreeNode o(BTREE_OVERFLOW_NODE,
+                superblock.info.keysize,
+                superblock.info.valuesize,
+                buffercache->GetBlockSize(),
+                superblock.info.format,
+                superblock.info.comparator);
+    SIZE_T chunk = o.info.GetNumOverflowBytes();
+    SIZE_T numblocks = (value.length + chunk - 1) / chunk;
+    SIZE_T cur, next;
+    ERROR_T rc, wrc;
+
+    if ((rc = AllocateNode(cur)))
+        return rc;
+
+    ref.block = cur;
+    ref.length = value.length;
+    ref.contiguous = 1;
+
+    for (SIZE_T i = 0; i < numblocks; i++) {
+        SIZE_T len = (i + 1 < numblocks) ? chunk : value.length - i * chunk;
+        VALUE_T piece(len);
+
+        next = 0;
+        rc = (i + 1 < numblocks) ? AllocateNode(next) : ERROR_NOERROR;
+        if (next && next != cur + 1)
+            ref.contiguous = 0;
+
+        memcpy(piece.data, value.data + i * chunk, len);
+        o.SetPtr(0, next);
+        o.SetVal(0, piece);
+
+        if ((wrc = o.Serialize(buffercache, cur))) {
+            // The chain ends before cur, which, like next, was never written
+            FreeOverflow(ref, cur);
+            if (next)
+                ReturnNode(next);
+            ReturnNode(cur);
+            return wrc;
+        }
+        if (rc) {
+            // Out of space part way, so give back what we took
+            FreeOverflow(ref);
+            return rc;
+        }
+        cur = next;
+    }
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * FreeOverflow
+ *
+ * Returns every block of an overflow chain, up to end, to the free
+ * list, or, for the blocks a snapshot still reads, retires them
+ */
+ERROR_T BTreeIndex::FreeOverflow(const OverflowRef &ref, const SIZE_T end)
+{
+    BTreeNode o;
+    SIZE_T block = ref.block, next;
+    ERROR_T rc;
+
+    while (block && block != end) {
+        if ((rc = o.Unserialize(buffercache, block)))
+            return rc;
+        o.GetPtr(0, next);
+        if ((rc = RetireNode(block)))
+            return rc;
+        block = next;
+    }
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * ReturnNode
+ *
+ * Puts a node AllocateNode handed out back on the free list, when
+ * nothing was written to it
+ */
+ERROR_T BTreeIndex::ReturnNode(const SIZE_T node)
+{
+    BTreeNode b;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    b.info.freelist = superblock.info.freelist;
+    if ((rc = b.Serialize(buffercache, node)))
+        return rc;
+    superblock.info.freelist = node;
+    buffercache->NotifyDeallocateBlock(node);
+    born.erase(node);
+    return superblock.Serialize(buffercache, superblock_index);
+}
+
+
+/*
+ * ReadOverflow
+ *
+ * Gathers a value from its chain of overflow blocks.  A chain on 
+ * consecutive blocks is read with one multi-block request
+ */
+ERROR_T ReadOverflow(BufferCache *cache, const OverflowRef &ref, VALUE_T &value)
+{
+    BTreeNode o;
+    SIZE_T copied = 0;
+    ERROR_T rc;
+
+    value.Resize(ref.length, false);
+
+    if (ref.contiguous) {
+        vector<Block> blocks;
+        NodeMetadata geom;
+        geom.blocksize = cache->GetBlockSize();
+        SIZE_T chunk = geom.GetNumOverflowBytes();
+
+        if ((rc = cache->ReadBlocks(ref.block, (ref.length + chunk - 1) / chunk, blocks)))
+            return rc;
+        for (SIZE_T i = 0; i < blocks.size(); i++) {
+            if ((rc = o.Unserialize(blocks[i])))
+                return rc;
+            if (o.info.nodetype != BTREE_OVERFLOW_NODE || copied + o.info.numkeys > ref.length)
+                return ERROR_INSANE;
+            memcpy(value.data + copied, o.ResolveVal(0), o.info.numkeys);
+            copied += o.info.numkeys;
+        }
+    } else {
+        SIZE_T block = ref.block;
+
+        while (block) {
+            if ((rc = o.Unserialize(cache, block)))
+                return rc;
+            if (o.info.nodetype != BTREE_OVERFLOW_NODE || copied + o.info.numkeys > ref.length)
+                return ERROR_INSANE;
+            memcpy(value.data + copied, o.ResolveVal(0), o.info.numkeys);
+            copied += o.info.numkeys;
+            o.GetPtr(0, block);
+        }
+    }
+    return copied == ref.length ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
 /*
  * AddNewKeyPtr
  *
- * Adds new key-pointer pair to an interior node
+ * Adds new key-pointer pair to an interior node, just after the pointer
+ * at offset (the child that was split)
  *
- * (passes a dummy value for the 3rd argument to AddKeyPtrVal)
+ * The offset can't be found again from the key: when keys repeat, several
+ * separators can be equal to it
  */
-ERROR_T BTreeIndex::AddNewKeyPtr(const SIZE_T node, const KEY_T &splitKey, SIZE_T newNode)
+ERROR_T BTreeIndex::AddNewKeyPtr(const SIZE_T node, const SIZE_T offset, const KEY_T &splitKey, SIZE_T newNode)
 {
-    return AddKeyPtrVal(node, splitKey, VALUE_T(), newNode);
+    BTreeNode b;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    if ((rc = b.InsertKeyPtr(offset, splitKey, newNode)))
+        return rc;
+    Unpin(node);
+    return b.Serialize(buffercache, node);
 }
 
 
@@ -617,66 +1497,29 @@ ERROR_T BTreeIndex::AddNewKeyVal(const SIZE_T node, const KEY_T &key, const VALU
 ERROR_T BTreeIndex::AddKeyPtrVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newNode)
 {
     BTreeNode b;
-    b.Unserialize(buffercache, node);
-    KEY_T testkey;
-    SIZE_T entriesToCopy;
-    SIZE_T numkeys = b.info.numkeys;
     SIZE_T offset;
     ERROR_T rc;
-    SIZE_T entrySize;
 
-    // Set entry size, and check for valid node type
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+
+    // The new key goes in front of the first key that is greater than it,
+    // or becomes the last key if there is none
+    offset = b.UpperBound(key);
+
     switch (b.info.nodetype) {
         case BTREE_ROOT_NODE:
         case BTREE_INTERIOR_NODE:
-            entrySize = b.info.keysize + sizeof(SIZE_T);
+            rc = b.InsertKeyPtr(offset, key, newNode);
             break;
         case BTREE_LEAF_NODE:
-            entrySize = b.info.keysize + b.info.valuesize;
+            rc = b.InsertKeyVal(offset, key, value);
             break;
         default: // Invalid node type
             return ERROR_INSANE;
     }
-
-    b.info.numkeys++;
-    if (numkeys > 0) {
-        for (offset=0, entriesToCopy = numkeys;
-                offset < numkeys;
-                offset++, entriesToCopy--) {
-            if ((rc = b.GetKey(offset, testkey)))
-                return rc;
-            // If the new key is less than the current key, shift all greater keys up
-            // and put this new key in the current location
-            if (key < testkey) {
-                void *src = b.ResolveKey(offset);
-                void *dest = b.ResolveKey(offset + 1);
-                memmove(dest, src, entriesToCopy * entrySize);
-                if (b.info.nodetype == BTREE_LEAF_NODE) {
-                    if ((rc = b.SetKey(offset, key)) || (rc = b.SetVal(offset, value)))
-                        return rc;
-                } else {
-                    if ((rc = b.SetKey(offset, key)) || (rc = b.SetPtr(offset+1, newNode)))
-                        return rc;
-                }
-                break;
-            }
-            if (offset == numkeys - 1) { 
-                // If we are on the last key, and the new key was not less than this one, 
-                // then the new key becomes the last key
-                if (b.info.nodetype == BTREE_LEAF_NODE) {
-                    if ((rc = b.SetKey(numkeys, key)) || (rc = b.SetVal(numkeys, value)))
-                        return rc;
-                } else {
-                    if ((rc = b.SetKey(numkeys, key)) || (rc = b.SetPtr(numkeys+1, newNode)))
-                        return rc;
-                }
-                break;
-            }
-        }
-    } else { // 0 keys in table - only when adding leaves to small initial table
-        if ((rc = b.SetKey(0, key)) || (rc = b.SetVal(0, value)))
-            return rc;
-    }
+    if (rc)
+        return rc;
     return b.Serialize(buffercache, node);
 }
 
@@ -694,15 +1537,62 @@ bool BTreeIndex::IsNodeFull(const SIZE_T node)
     switch (b.info.nodetype) {
         case BTREE_ROOT_NODE:
         case BTREE_INTERIOR_NODE:
-            return (b.info.GetNumSlotsAsInterior() == b.info.numkeys);
         case BTREE_LEAF_NODE:
-            return (b.info.GetNumSlotsAsLeaf() == b.info.numkeys);
+            // Full as soon as one more entry of the largest size might
+            // not fit; for FIXED nodes, once every slot is taken
+            return b.IsFull();
     }
     cerr << "Invalid node type passed to IsNodeFull in btree.cc" << endl;
     return false;
 }
 
 
+/*
+ * ShortestSeparator
+ *
+ * Finds a key sep, as short as we can cheaply make it, with lo <= sep < hi.
+ * Every key of the left node is <= lo and every key of the right node
+ * is >= hi, so sep routes lookups in the parent exactly as lo would.
+ * The shortest prefix of hi that differs from lo does the job, unless
+ * that prefix is all of hi, in which case we fall back on lo itself.
+ */
+static void ShortestSeparator(const KEY_T &lo, const KEY_T &hi, KEY_T &sep)
+{
+    SIZE_T prefix;
+
+    for (prefix = 0;
+         prefix < lo.length && prefix < hi.length && lo.data[prefix] == hi.data[prefix];
+         prefix++) ;
+
+    if (prefix + 1 < hi.length) {
+        sep.Resize(prefix + 1, false);
+        memcpy(sep.data, hi.data, prefix + 1);
+    } else {
+        sep = lo;
+    }
+}
+
+
+/*
+ * ByteSplitPoint
+ *
+ * For nodes with variable-length slots: the number of leading entries
+ * that take up about half of the node's bytes, kept within [lo, hi]
+ */
+static SIZE_T ByteSplitPoint(const BTreeNode &b, const SIZE_T lo, const SIZE_T hi)
+{
+    SIZE_T half = (b.info.numkeys * b.GetSlotSize() + b.info.heapused) / 2;
+    SIZE_T used = 0;
+    SIZE_T count;
+
+    for (count = 0; count < lo; count++)
+        used += b.GetEntrySize(count);
+    while (count < hi && used + b.GetEntrySize(count) <= half)
+        used += b.GetEntrySize(count++);
+    return count;
+}
+
+
 /*
  * SplitNode
  *
@@ -715,25 +1605,94 @@ ERROR_T BTreeIndex::SplitNode(const SIZE_T node, SIZE_T &newNode, KEY_T &splitKe
     BTreeNode left;
     SIZE_T keysLeft, keysRight;
     ERROR_T error;
+    Unpin(node);
     left.Unserialize(buffercache, node);
+    // Nodes with separate key and pointer/value arrays are split in key
+    // order, and put back in their own layout at the end
+    int layout = left.info.format;
+    left.SetFormat(BTREE_FORMAT_SEPARATED);
     BTreeNode right = left;
+    KEY_T key;
+    VALUE_T value;
+    SIZE_T ptr;
 
     if ((error = AllocateNode(newNode)))
         return error;
+    splits++;
     if ((error = right.Serialize(buffercache, newNode)))
         return error;
     
     if (left.info.nodetype == BTREE_LEAF_NODE) {
-        keysLeft = (left.info.numkeys + 2) / 2; // Ceiling of (n+1) / 2
+        if (left.HasVarKeys()) {
+            // Records vary in length, so split by bytes rather than by count
+            keysLeft = ByteSplitPoint(left, 1, left.info.numkeys - 1);
+        } else {
+            keysLeft = (left.info.numkeys + 2) / 2; // Ceiling of (n+1) / 2
+        }
         keysRight = left.info.numkeys - keysLeft;
 
-        left.GetKey(keysLeft - 1, splitKey);
+        // The new leaf goes between this one and its old next leaf
+        // (the copy in right already links to that one)
+        left.SetPtr(0, newNode);
+
+        if (FormatHasVarSeparators(layout)) {
+            // The parent only needs enough of a key to tell the two
+            // leaves apart, not the whole last key of the left leaf
+            KEY_T leftMax, rightMin;
+            left.GetKey(keysLeft - 1, leftMax);
+            left.GetKey(keysLeft, rightMin);
+            ShortestSeparator(leftMax, rightMin, splitKey);
+        } else {
+            left.GetKey(keysLeft - 1, splitKey);
+        }
 
-        // get location of first key in left/old node that will be moved
-        char *src = left.ResolveKeyVal(keysLeft); 
-        char *dest = right.ResolveKeyVal(0);
+        if (left.HasVarKeys()) {
+            right.Truncate(0);
+            for (SIZE_T i = 0; i < keysRight; i++) {
+                left.GetKey(keysLeft + i, key);
+                left.GetVal(keysLeft + i, value);
+                if ((error = right.InsertKeyVal(i, key, value)))
+                    return error;
+                right.SetOverflowFlag(i, left.IsOverflowVal(keysLeft + i));
+            }
+        } else if (left.HasSplitArrays()) {
+            memcpy(right.ResolveKey(0), left.ResolveKey(keysLeft), keysRight * left.info.keysize);
+            memcpy(right.ResolveVal(0), left.ResolveVal(keysLeft), keysRight * left.info.valuesize);
+            right.info.numkeys = keysRight;
+        } else {
+            // get location of first key in left/old node that will be moved
+            char *src = left.ResolveKeyVal(keysLeft); 
+            char *dest = right.ResolveKeyVal(0);
+
+            memcpy(dest, src, keysRight * (left.info.keysize + left.info.valuesize));
+            right.info.numkeys = keysRight;
+        }
+    } else if (left.HasVarKeys()) {
+        // Separators vary in length, so split by bytes rather than by count;
+        // the key after the left node's share is promoted
+        keysLeft = ByteSplitPoint(left, 1, left.info.numkeys - 2);
+        keysRight = left.info.numkeys - keysLeft - 1; // one key will be promoted
+
+        left.GetKey(keysLeft, splitKey);
+
+        right.Truncate(0);
+        left.GetPtr(keysLeft + 1, ptr);
+        right.SetPtr(0, ptr);
+        for (SIZE_T i = 0; i < keysRight; i++) {
+            left.GetKey(keysLeft + 1 + i, key);
+            left.GetPtr(keysLeft + 2 + i, ptr);
+            if ((error = right.InsertKeyPtr(i, key, ptr)))
+                return error;
+        }
+    } else if (left.HasSplitArrays()) {
+        keysLeft = left.info.numkeys / 2; // Floor of n / 2
+        keysRight = left.info.numkeys - keysLeft - 1; // one key will be promoted
 
-        memcpy(dest, src, keysRight * (left.info.keysize + left.info.valuesize));
+        left.GetKey(keysLeft, splitKey);
+
+        memcpy(right.ResolveKey(0), left.ResolveKey(keysLeft + 1), keysRight * left.info.keysize);
+        memcpy(right.ResolvePtr(0), left.ResolvePtr(keysLeft + 1), (keysRight + 1) * sizeof(SIZE_T));
+        right.info.numkeys = keysRight;
     } else { // Root or intermediate node
         keysLeft = left.info.numkeys / 2; // Floor of n / 2
         keysRight = left.info.numkeys - keysLeft - 1; // one key will be promoted
@@ -744,9 +1703,29 @@ ERROR_T BTreeIndex::SplitNode(const SIZE_T node, SIZE_T &newNode, KEY_T &splitKe
         char *dest = right.ResolvePtr(0);
         
         memcpy(dest, src, keysRight * (left.info.keysize + sizeof(SIZE_T)) + sizeof(SIZE_T));
+        right.info.numkeys = keysRight;
     }
-    left.info.numkeys = keysLeft;
-    right.info.numkeys = keysRight;
+    if (left.HasBuffer()) {
+        // Each pending message goes with the keys it is for: those up to
+        // the promoted key stay on the left
+        const KeyOrder *order = GetKeyOrder(left.info.comparator);
+        BTreeNode old = left;
+        left.info.nummessages = 0;
+        right.info.nummessages = 0;
+        for (SIZE_T i = 0; i < old.info.nummessages; i++) {
+            if ((error = old.GetMessage(i, key, value)))
+                return error;
+            BTreeNode &side = order->compare((const char *) key.data, key.length,
+                                             (const char *) splitKey.data, splitKey.length) <= 0
+                ? left : right;
+            if ((error = side.AppendMessage(key, value)))
+                return error;
+        }
+    }
+    if ((error = left.Truncate(keysLeft)))
+        return error;
+    left.SetFormat(layout);
+    right.SetFormat(layout);
 
     if ((error = left.Serialize(buffercache, node)))
         return error;
@@ -754,7 +1733,463 @@ ERROR_T BTreeIndex::SplitNode(const SIZE_T node, SIZE_T &newNode, KEY_T &splitKe
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+/*
+ * WrongSize
+ *
+ * Keys and values of a SLOTTED index may be any length up to keysize
+ * and valuesize; every other format stores them at exactly that size
+ */
+bool BTreeIndex::WrongSize(const SIZE_T length, const SIZE_T size) const
+{
+    if (superblock.info.format == BTREE_FORMAT_SLOTTED)
+        return length > size;
+    return length != size;
+}
+
+
+/*
+ * FindPinned
+ *
+ * Gives the pinned copy of node, reached through slot of parent (0 at
+ * the root and below the pinned levels), or 0 if it is not pinned.
+ * depth is set to the level of node.  A pinned node found by number is
+ * swizzled into the parent's slot on the way
+ */
+PinnedNode *BTreeIndex::FindPinned(const SIZE_T node, PinnedNode *parent, const SIZE_T slot,
+                                   SIZE_T &depth)
+{
+    if (parent) {
+        if (parent->children[slot])
+            return parent->children[slot];
+        depth = parent->depth + 1;
+    } else {
+        depth = node == superblock.info.rootnode ? 0 : pinlevels;
+    }
+    if (depth >= pinlevels)
+        return 0;
+
+    map<SIZE_T, PinnedNode>::iterator i = pinned.find(node);
+    if (i == pinned.end())
+        return 0;
+    if (parent) {
+        parent->children[slot] = &i->second;
+        i->second.parent = parent;
+        i->second.slot = slot;
+    }
+    return &i->second;
+}
+
+
+/*
+ * Pin
+ *
+ * Keeps a copy of interior node b, at depth, swizzled into slot of parent
+ */
+PinnedNode *BTreeIndex::Pin(const SIZE_T node, const BTreeNode &b, const SIZE_T depth,
+                            PinnedNode *parent, const SIZE_T slot)
+{
+    Unpin(node);
+
+    PinnedNode &p = pinned[node];
+    p.node = b;
+    p.depth = depth;
+    p.children.assign(b.info.numkeys + 1, (PinnedNode *) 0);
+    p.parent = parent;
+    p.slot = slot;
+    if (parent)
+        parent->children[slot] = &p;
+    return &p;
+}
+
+
+/*
+ * Unpin
+ *
+ * Drops the copy of node, unswizzling the slots that lead to and from it
+ */
+void BTreeIndex::Unpin(const SIZE_T node)
+{
+    map<SIZE_T, PinnedNode>::iterator i = pinned.find(node);
+
+    if (i == pinned.end())
+        return;
+    PinnedNode &p = i->second;
+    if (p.parent)
+        p.parent->children[p.slot] = 0;
+    for (SIZE_T c = 0; c < p.children.size(); c++)
+        if (p.children[c])
+            p.children[c]->parent = 0;
+    pinned.erase(i);
+}
+
+
+/*
+ * ReadNode
+ *
+ * Gives node, reached through slot of parent, for a descent to route
+ * through.  r points at the pinned copy if there is one; otherwise the
+ * node is read into b, and, if it is an interior node in the pinned
+ * levels, a copy is pinned.  pin is the pinned copy, or 0, for the
+ * descent to pass on to the next level.  Leaves are never pinned, so a
+ * leaf is always in b, free to be changed and written back
+ */
+ERROR_T BTreeIndex::ReadNode(const SIZE_T node, PinnedNode *parent, const SIZE_T slot,
+                             BTreeNode &b, const BTreeNode *&r, PinnedNode *&pin)
+{
+    SIZE_T depth;
+    ERROR_T rc;
+
+    if ((pin = FindPinned(node, parent, slot, depth))) {
+        r = &pin->node;
+        return ERROR_NOERROR;
+    }
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    r = &b;
+    // Nodes with a buffer change on every write, so they are never pinned
+    if (depth < pinlevels && !b.HasBuffer() &&
+        (b.info.nodetype == BTREE_ROOT_NODE || b.info.nodetype == BTREE_INTERIOR_NODE)) {
+        pin = Pin(node, b, depth, parent, slot);
+        r = &pin->node;
+    }
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * IsShared
+ *
+ * True if a snapshot can reach node, so it must not be changed in place.
+ * Every block the live tree has was in it when the newest snapshot was
+ * taken, unless it was allocated since
+ */
+bool BTreeIndex::IsShared(const SIZE_T node) const
+{
+    if (snapshots.empty())
+        return false;
+    map<SIZE_T, SIZE_T>::const_iterator b = born.find(node);
+    return b == born.end() || b->second <= snapshots.rbegin()->first;
+}
+
+
+/*
+ * ShadowNode
+ *
+ * Copies node to a new block for the live tree to use in its place,
+ * and retires node.  The caller points the parent at the copy
+ */
+ERROR_T BTreeIndex::ShadowNode(const SIZE_T node, SIZE_T &copy)
+{
+    BTreeNode b;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    if ((rc = AllocateNode(copy)))
+        return rc;
+    if ((rc = b.Serialize(buffercache, copy)))
+        return rc;
+    Unpin(node);
+    return RetireNode(node);
+}
+
+
+/*
+ * ShadowChild
+ *
+ * Makes sure child, the pointer at offset of node (which is in b and
+ * is not shared), can be changed in place, copying it if need be
+ */
+ERROR_T BTreeIndex::ShadowChild(const SIZE_T node, BTreeNode &b, const SIZE_T offset, SIZE_T &child)
+{
+    SIZE_T copy;
+    ERROR_T rc;
+
+    if (!IsShared(child))
+        return ERROR_NOERROR;
+    if ((rc = ShadowNode(child, copy)))
+        return rc;
+    child = copy;
+    if ((rc = b.SetPtr(offset, child)))
+        return rc;
+    Unpin(node);
+    return b.Serialize(buffercache, node);
+}
+
+
+/*
+ * ShadowPath
+ *
+ * Copies the nodes a snapshot shares on the path down to key, from a
+ * new root if the root is shared, so a write along it only changes
+ * blocks of the live tree.  Splits on the way back up only change
+ * nodes on the path, and new ones
+ */
+ERROR_T BTreeIndex::ShadowPath(const KEY_T &key)
+{
+    BTreeNode b;
+    SIZE_T node = superblock.info.rootnode, child, offset;
+    ERROR_T rc;
+
+    if (snapshots.empty())
+        return ERROR_NOERROR;
+    if (IsShared(node)) {
+        if ((rc = ShadowNode(node, superblock.info.rootnode)))
+            return rc;
+        node = superblock.info.rootnode;
+    }
+    for (;;) {
+        if ((rc = b.Unserialize(buffercache, node)))
+            return rc;
+        if (b.info.nodetype == BTREE_LEAF_NODE || b.info.numkeys == 0)
+            return ERROR_NOERROR;
+        offset = b.LowerBound(key);
+        if ((rc = b.GetPtr(offset, child)))
+            return rc;
+        if ((rc = ShadowChild(node, b, offset, child)))
+            return rc;
+        node = child;
+    }
+}
+
+
+/*
+ * RetireNode
+ *
+ * Takes node out of the live tree: frees it, or, if a snapshot still
+ * reads it, sets it aside until the last such snapshot is released
+ */
+ERROR_T BTreeIndex::RetireNode(const SIZE_T node)
+{
+    if (!IsShared(node))
+        return DeallocateNode(node);
+
+    RetiredNode r;
+    map<SIZE_T, SIZE_T>::const_iterator b = born.find(node);
+    r.block = node;
+    r.born = b == born.end() ? 0 : b->second;
+    r.died = epoch;
+    retired.push_back(r);
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * ReclaimRetired
+ *
+ * Frees the retired blocks no remaining snapshot reads
+ */
+ERROR_T BTreeIndex::ReclaimRetired()
+{
+    ERROR_T rc;
+    SIZE_T kept = 0;
+
+    for (SIZE_T i = 0; i < retired.size(); i++) {
+        map<SIZE_T, SIZE_T>::const_iterator s = snapshots.lower_bound(retired[i].born);
+        if (s != snapshots.end() && s->first < retired[i].died) {
+            retired[kept++] = retired[i];
+        } else if ((rc = DeallocateNode(retired[i].block))) {
+            return rc;
+        }
+    }
+    retired.resize(kept);
+    // Everything left is in the live tree alone
+    if (snapshots.empty())
+        born.clear();
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    CreateSnapshot
+ * Purpose: take a snapshot of the tree as it is now
+ * Params:  SIZE_T &snapshot
+ */
+ERROR_T BTreeIndex::CreateSnapshot(SIZE_T &snapshot)
+{
+    if (!superblock.info.unique)
+        return ERROR_BADCONFIG;
+    snapshot = epoch++;
+    snapshots[snapshot] = superblock.info.rootnode;
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    ReleaseSnapshot
+ * Purpose: drop a snapshot, freeing the blocks only it still read
+ * Params:  const SIZE_T snapshot
+ */
+ERROR_T BTreeIndex::ReleaseSnapshot(const SIZE_T snapshot)
+{
+    if (!snapshots.erase(snapshot))
+        return ERROR_NONEXISTENT;
+    return ReclaimRetired();
+}
+
+
+/*
+ * Name:    LookupSnapshot
+ * Purpose: return the value the key had when the snapshot was taken
+ * Params:  const SIZE_T snapshot
+ *          const KEY_T &key,
+ *          VALUE_T &value
+ */
+ERROR_T BTreeIndex::LookupSnapshot(const SIZE_T snapshot, const KEY_T &key, VALUE_T &value)
+{
+    map<SIZE_T, SIZE_T>::const_iterator s = snapshots.find(snapshot);
+
+    if (s == snapshots.end())
+        return ERROR_BADCONFIG;
+    // Nothing of an old root is pinned, so this reads from the cache
+    return LookupOrUpdateInternal(s->second, BTREE_OP_LOOKUP, key, value);
+}
+
+
+/*
+ * Name:    DisplaySnapshot
+ * Purpose: Display, for the tree as it was when the snapshot was taken
+ */
+ERROR_T BTreeIndex::DisplaySnapshot(const SIZE_T snapshot, ostream &o,
+                                    BTreeDisplayType display_type) const
+{
+    map<SIZE_T, SIZE_T>::const_iterator s = snapshots.find(snapshot);
+
+    if (s == snapshots.end())
+        return ERROR_BADCONFIG;
+    return DisplayTree(s->second, o, display_type);
+}
+
+
+/*
+ * KeyHash
+ *
+ * Hashes the part of a key its order looks at, so keys that compare
+ * equal hash alike (STRING keys end at their first NUL)
+ */
+uint64_t BTreeIndex::KeyHash(const BYTE_T *key, const SIZE_T len) const
+{
+    if (superblock.info.comparator == BTREE_COMPARE_STRING)
+        return BloomFilter::Hash(key, strnlen((const char *) key, len));
+    return BloomFilter::Hash(key, len);
+}
+
+
+/*
+ * FilterRulesOut
+ *
+ * True if the filter shows the key is not in the tree.  Every answer
+ * is counted; a caller that goes on to miss reports it with FilterMissed
+ */
+bool BTreeIndex::FilterRulesOut(const BYTE_T *key, const SIZE_T len)
+{
+    if (!filter.IsEnabled())
+        return false;
+    bool ruledOut = !filter.MayContain(KeyHash(key, len));
+    filter.NoteQuery(ruledOut);
+    return ruledOut;
+}
+
+
+/*
+ * FilterMissed
+ *
+ * Records that a key the filter let through was not in the tree
+ */
+void BTreeIndex::FilterMissed()
+{
+    if (filter.IsEnabled())
+        filter.NoteFalsePositive();
+}
+
+
+/*
+ * FilterAdd
+ *
+ * Adds an inserted key to the filter.  Once the filter holds more keys
+ * than it was sized for its false positive rate climbs, so it is
+ * rebuilt at twice the size; that happens each time the tree doubles
+ */
+ERROR_T BTreeIndex::FilterAdd(const BYTE_T *key, const SIZE_T len)
+{
+    if (!filter.IsEnabled())
+        return ERROR_NOERROR;
+    filter.Add(KeyHash(key, len));
+    return filter.IsOverfull() ? RebuildFilter() : ERROR_NOERROR;
+}
+
+
+/*
+ * RebuildFilter
+ *
+ * Refills the filter from every key in the tree
+ */
+ERROR_T BTreeIndex::RebuildFilter()
+{
+    vector<uint64_t> hashes;
+    ERROR_T rc;
+
+    if (filterbits == 0) {
+        filter.Reset(0, 0);
+        return ERROR_NOERROR;
+    }
+    if ((rc = CollectKeyHashes(superblock.info.rootnode, hashes)))
+        return rc;
+    filter.Reset(hashes.size() < 512 ? 1024 : 2 * hashes.size(), filterbits);
+    for (SIZE_T i = 0; i < hashes.size(); i++)
+        filter.Add(hashes[i]);
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * CollectKeyHashes
+ *
+ * Gathers the filter hash of every key in the leaves below node
+ */
+ERROR_T BTreeIndex::CollectKeyHashes(const SIZE_T node, vector<uint64_t> &hashes) const
+{
+    BTreeNode b;
+    KEY_T key;
+    SIZE_T ptr;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    switch (b.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (b.info.numkeys == 0)
+                return ERROR_NOERROR;
+            // Keys still in a buffer may not have reached a leaf yet
+            for (SIZE_T i = 0; i < b.info.nummessages; i++) {
+                VALUE_T value;
+                if ((rc = b.GetMessage(i, key, value)))
+                    return rc;
+                hashes.push_back(KeyHash(key.data, key.length));
+            }
+            for (SIZE_T i = 0; i <= b.info.numkeys; i++) {
+                if ((rc = b.GetPtr(i, ptr)))
+                    return rc;
+                if ((rc = CollectKeyHashes(ptr, hashes)))
+                    return rc;
+            }
+            return ERROR_NOERROR;
+        case BTREE_LEAF_NODE:
+            for (SIZE_T i = 0; i < b.info.numkeys; i++) {
+                if ((rc = b.GetKey(i, key)))
+                    return rc;
+                hashes.push_back(KeyHash(key.data, key.length));
+            }
+            return ERROR_NOERROR;
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt,
+                         BufferCache *cache)
 {
     KEY_T key;
     VALUE_T value;
@@ -793,12 +2228,31 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
                     if (offset==b.info.numkeys) break;
                     rc=b.GetKey(offset,key);
                     if (rc) {  return rc; }
-                    for (i=0;i<b.info.keysize;i++)
+                    for (i=0;i<key.length;i++)
                     {
                         os << key.data[i];
                     }
                     os << " ";
                 }
+                if (b.HasBuffer() && b.info.nummessages>0)
+                {
+                    os << "| ";
+                    for (offset=0;offset<b.info.nummessages;offset++)
+                    {
+                        rc=b.GetMessage(offset,key,value);
+                        if (rc) {  return rc; }
+                        for (i=0;i<key.length;i++)
+                        {
+                            os << key.data[i];
+                        }
+                        os << "=";
+                        for (i=0;i<value.length;i++)
+                        {
+                            os << value.data[i];
+                        }
+                        os << " ";
+                    }
+                }
             }
             break;
         case BTREE_LEAF_NODE:
@@ -823,7 +2277,7 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
                 rc=b.GetKey(offset,key);
                 
                 if (rc) {  return rc; }
-                for (i=0;i<b.info.keysize;i++)
+                for (i=0;i<key.length;i++)
                 {
                     os << key.data[i];
                 }
@@ -831,10 +2285,19 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
                 if (dt==BTREE_SORTED_KEYVAL) {  os << ",";  }
                 else {  os << " ";  }
                 
-                rc=b.GetVal(offset,value);
+                if (b.IsOverflowVal(offset))
+                {
+                    OverflowRef ref;
+                    b.GetOverflowVal(offset,ref);
+                    rc=ReadOverflow(cache,ref,value);
+                }
+                else
+                {
+                    rc=b.GetVal(offset,value);
+                }
                 if (rc) {  return rc; }
                 
-                for (i=0;i<b.info.valuesize;i++)
+                for (i=0;i<value.length;i++)
                 {
                     os << value.data[i];
                 }
@@ -888,7 +2351,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
         return rc;
     }
     
-    rc = PrintNode(o,node,b,display_type);
+    rc = PrintNode(o,node,b,display_type,buffercache);
     
     if (rc) {  return rc;  }
     
@@ -937,6 +2400,89 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 }
 
 
+// Orders key-value pairs by key
+struct KeyValueLess {
+    const KeyOrder *order;
+
+    bool operator()(const KeyValuePair &lhs, const KeyValuePair &rhs) const {
+        return order->compare((const char *) lhs.key.data, lhs.key.length,
+                              (const char *) rhs.key.data, rhs.key.length) < 0;
+    }
+};
+
+
+/*
+ * DisplayBuffered(const SIZE_T node, const vector<KeyValuePair> &pending,
+                   ostream &o) const
+ *
+ * BTREE_SORTED_KEYVAL for a BUFFERED index.  pending holds the messages
+ * from above node that are bound for it, oldest first.  Messages are
+ * routed down with the node's own (which are older) until they reach
+ * the leaves, where they are applied to a copy before it is printed
+ */
+ERROR_T BTreeIndex::DisplayBuffered(const SIZE_T node, const vector<KeyValuePair> &pending,
+                                    ostream &o) const
+{
+    BTreeNode b;
+    KeyValuePair m;
+    SIZE_T offset, ptr;
+    ERROR_T rc;
+    unsigned i;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    switch (b.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE: {
+            if (b.info.numkeys == 0)
+                return ERROR_NOERROR;
+            vector<vector<KeyValuePair> > routed(b.info.numkeys + 1);
+            for (offset = 0; offset < b.info.nummessages; offset++) {
+                if ((rc = b.GetMessage(offset, m.key, m.value)))
+                    return rc;
+                routed[b.LowerBound(m.key)].push_back(m);
+            }
+            for (offset = 0; offset < pending.size(); offset++)
+                routed[b.LowerBound(pending[offset].key)].push_back(pending[offset]);
+            for (offset = 0; offset <= b.info.numkeys; offset++) {
+                if ((rc = b.GetPtr(offset, ptr)))
+                    return rc;
+                if ((rc = DisplayBuffered(ptr, routed[offset], o)))
+                    return rc;
+            }
+            return ERROR_NOERROR;
+        }
+        case BTREE_LEAF_NODE: {
+            KeyValueLess less = { GetKeyOrder(b.info.comparator) };
+            vector<KeyValuePair> entries(b.info.numkeys);
+            for (offset = 0; offset < b.info.numkeys; offset++)
+                if ((rc = b.GetKeyVal(offset, entries[offset])))
+                    return rc;
+            for (offset = 0; offset < pending.size(); offset++) {
+                vector<KeyValuePair>::iterator e =
+                    lower_bound(entries.begin(), entries.end(), pending[offset], less);
+                if (e != entries.end() && !less(pending[offset], *e))
+                    e->value = pending[offset].value;
+                else
+                    entries.insert(e, pending[offset]);
+            }
+            for (offset = 0; offset < entries.size(); offset++) {
+                o << "(";
+                for (i = 0; i < entries[offset].key.length; i++)
+                    o << entries[offset].key.data[i];
+                o << ",";
+                for (i = 0; i < entries[offset].value.length; i++)
+                    o << entries[offset].value.data[i];
+                o << ")\n";
+            }
+            return ERROR_NOERROR;
+        }
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
 /*
  * Name:    Print
  * Purpose:
@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <string>
+#include <map>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
@@ -10,6 +12,8 @@
 #include "buffercache.h"
 
 #include "btree_ds.h"
+#include "bloomfilter.h"
+#include "metrics.h"
 
 using namespace std;
 
@@ -39,34 +43,150 @@ struct KeyValuePair {
 
 enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE, BTREE_OP_LOOKUP};
 
+// Gathers a value from the chain of overflow blocks ref points to
+ERROR_T ReadOverflow(BufferCache *cache, const OverflowRef &ref, VALUE_T &value);
+
+// Position in a walk over the values stored under one key
+struct BTreeCursor {
+  KEY_T  key;
+  SIZE_T node;    // leaf holding the current value
+  SIZE_T offset;  // and its offset in that leaf
+};
+
+// Levels of the tree, counting the root as the first, that an index keeps
+// in memory unless told otherwise
+#define BTREE_DEFAULT_PIN_LEVELS 2
+
+// A node an index keeps in memory.  While a child is pinned too, the
+// parent's slot for it is swizzled: it holds the child itself rather
+// than its block number, so a descent goes straight from one to the
+// other.  Unpinning either one unswizzles the slot
+struct PinnedNode {
+  BTreeNode            node;
+  SIZE_T               depth;     // levels below the root
+  vector<PinnedNode *> children;  // by pointer offset, 0 if not swizzled
+  PinnedNode          *parent;    // the node whose slot holds this one
+  SIZE_T               slot;
+};
+
+// A block the live tree stopped using while snapshots still held it.
+// It is freed once no snapshot taken from epoch born up to (but not
+// including) epoch died remains
+struct RetiredNode {
+  SIZE_T block;
+  SIZE_T born;
+  SIZE_T died;
+};
+
+// How big the tree is and how full its nodes are, as GetShape finds them
+struct BTreeShape {
+  SIZE_T height;         // levels, counting the root and the leaves; 0 if empty
+  SIZE_T interiornodes;  // counting the root
+  SIZE_T leafnodes;
+  SIZE_T keys;           // in the leaves
+  double interiorfill;   // mean fraction of the space for keys in use
+  double leaffill;
+};
+
 enum BTreeInsertType {BTREE_INS_KEYPTR, BTREE_INS_KEYVAL};
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
 class BTreeIndex {
- private:
+ protected:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
 
- protected:
+  // Optional filter over the keys in the tree, which lets a lookup of
+  // an absent key stop before the descent.  It lives only in memory
+  BloomFilter  filter;
+  SIZE_T       filterbits;   // bits per key, or 0 if there is no filter
+
+  // Decoded copies of the root and the interior nodes of the levels
+  // just below it, which every descent passes through.  A node is
+  // pinned when a descent first reads it, and unpinned when a split
+  // rewrites it
+  map<SIZE_T, PinnedNode> pinned;
+  SIZE_T       pinlevels;
+
+  // Snapshots, by the epoch they were taken in, and the root each one
+  // keeps.  While there are any, a write first copies each node it
+  // would change that a snapshot can reach to a new block, and points
+  // the parent (or the superblock) at the copy.  A block belongs to
+  // every snapshot taken in or after the epoch it was allocated in, up
+  // to the one where it was copied away from
+  map<SIZE_T, SIZE_T> snapshots;
+  map<SIZE_T, SIZE_T> born;      // epoch of the blocks allocated while there are snapshots
+  vector<RetiredNode> retired;
+  SIZE_T       epoch;
+
+  SIZE_T       splits;       // of nodes (or buckets), since construction
+
+  bool         IsShared(const SIZE_T node) const;
+  ERROR_T      ShadowNode(const SIZE_T node, SIZE_T &copy);
+  ERROR_T      ShadowChild(const SIZE_T node, BTreeNode &b, const SIZE_T offset, SIZE_T &child);
+  ERROR_T      ShadowPath(const KEY_T &key);
+  ERROR_T      RetireNode(const SIZE_T node);
+  ERROR_T      ReclaimRetired();
+
+  PinnedNode  *FindPinned(const SIZE_T node, PinnedNode *parent, const SIZE_T slot,
+			  SIZE_T &depth);
+  PinnedNode  *Pin(const SIZE_T node, const BTreeNode &b, const SIZE_T depth,
+		   PinnedNode *parent, const SIZE_T slot);
+  void         Unpin(const SIZE_T node);
+  void         UnpinAll() { pinned.clear(); }
+  ERROR_T      ReadNode(const SIZE_T node, PinnedNode *parent, const SIZE_T slot,
+			BTreeNode &b, const BTreeNode *&r, PinnedNode *&pin);
 
   ERROR_T      AllocateNode(SIZE_T &node);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
+  ERROR_T      FindLeaf(const KEY_T &key, SIZE_T &leaf);
+  ERROR_T      GetLeafVal(const BTreeNode &b, const SIZE_T offset, VALUE_T &value);
+
+  ERROR_T      LookupBatchInternal(const SIZE_T node, const vector<KEY_T> &keys,
+				   SIZE_T *first, SIZE_T *last,
+				   vector<VALUE_T> &values, vector<ERROR_T> &results,
+				   PinnedNode *parent=0, const SIZE_T slot=0);
+
   ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
 				      const BTreeOp op, 
 				      const KEY_T &key,
-				      VALUE_T &val);
+				      VALUE_T &val,
+				      PinnedNode *parent=0,
+				      const SIZE_T slot=0);
   
-  ERROR_T      PlaceKeyVal(SIZE_T node, SIZE_T parentNode, const KEY_T &key, const VALUE_T &value);
-  ERROR_T      AddNewKeyPtr(const SIZE_T node, const KEY_T &splitKey, SIZE_T newNode);
+  ERROR_T      PlaceKeyVal(SIZE_T node, SIZE_T parentNode, const KEY_T &key, const VALUE_T &value,
+			   const BTreeOp op=BTREE_OP_INSERT,
+			   PinnedNode *pinnedParent=0, const SIZE_T slot=0);
+  ERROR_T      PlaceMessage(const SIZE_T node, const KEY_T &key, const VALUE_T &value);
+  ERROR_T      FlushBuffer(const SIZE_T node);
+  ERROR_T      PlaceOverflowVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value,
+				const BTreeOp op);
+  ERROR_T      WriteOverflow(const VALUE_T &value, OverflowRef &ref);
+  ERROR_T      FreeOverflow(const OverflowRef &ref, const SIZE_T end=0);
+  ERROR_T      ReturnNode(const SIZE_T node);
+  ERROR_T      AddNewKeyPtr(const SIZE_T node, const SIZE_T offset, const KEY_T &splitKey, SIZE_T newNode);
   ERROR_T      AddNewKeyVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value);
   ERROR_T      AddKeyPtrVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newNode);
   bool         IsNodeFull(const SIZE_T node);
   ERROR_T      SplitNode(const SIZE_T node, SIZE_T &newNode, KEY_T &splitKey);
+  ERROR_T      SplitRootIfFull();
+  bool         WrongSize(const SIZE_T length, const SIZE_T size) const;
+
+  uint64_t     KeyHash(const BYTE_T *key, const SIZE_T len) const;
+  bool         FilterRulesOut(const BYTE_T *key, const SIZE_T len);
+  void         FilterMissed();
+  ERROR_T      FilterAdd(const BYTE_T *key, const SIZE_T len);
+  ERROR_T      RebuildFilter();
+  ERROR_T      CollectKeyHashes(const SIZE_T node, vector<uint64_t> &hashes) const;
+  ERROR_T      MeasureShape(const SIZE_T node, const SIZE_T depth, BTreeShape &shape) const;
 
+  ERROR_T      DisplayTree(const SIZE_T root, ostream &o, const BTreeDisplayType display_type) const;
+  ERROR_T      DisplayBuffered(const SIZE_T node, const vector<KeyValuePair> &pending,
+			       ostream &o) const;
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
                const BTreeDisplayType display_type=BTREE_DEPTH_DOT) const;
@@ -85,7 +205,9 @@ public:
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,    // true if a  key maps to a single value
+	     int format=BTREE_FORMAT_FIXED,   // one of BTREE_FORMAT_*
+	     int comparator=BTREE_COMPARE_BYTES);  // one of BTREE_COMPARE_*
 
 
   BTreeIndex();
@@ -102,38 +224,98 @@ public:
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
   // giving you an incorrect block to start with
-  ERROR_T Attach(const SIZE_T initblock, const bool create=false );
+  virtual ERROR_T Attach(const SIZE_T initblock, const bool create=false );
   
   // This is called after all inserts, updates, or deletes are done.
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
-  ERROR_T Detach(SIZE_T &initblock);
+  virtual ERROR_T Detach(SIZE_T &initblock);
+
+  // Keeps a Bloom filter of the keys with bitsperkey bits per key
+  // (0 for none), for an Attach that follows.  Attach builds it from the
+  // tree, and it then follows inserts.  The filter is not stored, so
+  // each Attach rebuilds it
+  void UseFilter(const SIZE_T bitsperkey) { filterbits=bitsperkey; }
+  const BloomFilter &GetFilter() const { return filter; }
+
+  // Takes a snapshot of the tree as it is now, which reads through
+  // LookupSnapshot and DisplaySnapshot see however the tree changes
+  // afterwards, until ReleaseSnapshot.  Writes copy the nodes they
+  // change rather than wait for the snapshot's readers.  Snapshots live
+  // only in memory: Attach starts with none, and Detach releases them.
+  // return ERROR_BADCONFIG for a non-unique index, whose walks over
+  // duplicates follow the links between leaves, which copies break
+  virtual ERROR_T CreateSnapshot(SIZE_T &snapshot);
+  ERROR_T ReleaseSnapshot(const SIZE_T snapshot);
+  bool    HasSnapshots() const { return !snapshots.empty(); }
+  ERROR_T LookupSnapshot(const SIZE_T snapshot, const KEY_T &key, VALUE_T &value);
+  ERROR_T DisplaySnapshot(const SIZE_T snapshot, ostream &o,
+			  BTreeDisplayType display_type=BTREE_SORTED_KEYVAL) const;
+
+  // Number of nodes split so far, for attributing I/O to operations
+  SIZE_T GetNumSplits() const { return splits; }
+
+  // Keeps the top levels levels of the tree (the root is one) in memory
+  // so descents only go to the buffer cache below them; 0 pins nothing.
+  // A BUFFERED index pins nothing, as every write changes its root
+  void PinLevels(const SIZE_T levels) { pinlevels=levels; UnpinAll(); }
   
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
+  //   (for a BTREE_FORMAT_SLOTTED index, longer than keysize or valuesize)
   // return ERROR_CONFLICT if the key already exists and it's a unique index
-  ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  //   (a non-unique index keeps every value inserted under a key)
+  //
+  // The operations are virtual so that a specialized index (see
+  // btree_fixed.h) or a write buffer (see lsmindex.h) can be put in
+  // front of them, and another kind of index (see hashindex.h) can
+  // stand in for the tree
+  virtual ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
-  ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  // In a non-unique index, the first value stored under the key is replaced
+  virtual ERROR_T Update(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
-  ERROR_T Delete(const KEY_T &key);
+  virtual ERROR_T Delete(const KEY_T &key);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
-  ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+  // return ERROR_SIZE if the key is the wrong size for this index
+  // In a non-unique index, this gives the first value stored under the key
+  virtual ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+  // Looks up many keys at once, giving values[i] and results[i] (what
+  // Lookup would return) for keys[i].  The keys are sorted first, and
+  // the keys under a node share one descent to it, so each node on
+  // their paths is read once for the whole batch.
+  // return zero, or the first error other than ERROR_NONEXISTENT
+  virtual ERROR_T LookupBatch(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+			      vector<ERROR_T> &results);
+
+  // Walk every value stored under a key: LookupFirst gives the first
+  // and sets up the cursor, and each LookupNext gives the next one.
+  // Both return ERROR_NONEXISTENT when there are no more values
+  virtual ERROR_T LookupFirst(const KEY_T &key, BTreeCursor &cursor, VALUE_T &value);
+  virtual ERROR_T LookupNext(BTreeCursor &cursor, VALUE_T &value);
 
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
   ERROR_T SanityCheck() const;
 
+  // Walks the tree, through the buffer cache, to measure it
+  virtual ERROR_T GetShape(BTreeShape &shape) const;
+  // Adds the shape, the splits and the filter's counts.  The walk for
+  // the shape goes through the buffer cache, so export the cache's
+  // metrics first
+  virtual ERROR_T ExportMetrics(Metrics &m) const;
+
   // Display tree
   // BTREE_DEPTH means to do a depth first traversal of 
   // the tree, printing each node
@@ -144,7 +326,7 @@ public:
   // key/value pairs in the leaves, one "(key, value)" tuple
   // per line.  This will be the keys and values in the tree
   // sorted in order of keys.
-  ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH_DOT) const; //display_type=BTREE_DEPTH) const;
+  virtual ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH_DOT) const; //display_type=BTREE_DEPTH) const;
   
   ostream & Print(ostream &os) const;
   
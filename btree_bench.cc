@@ -0,0 +1,473 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+#include "btree.h"
+#include "btree_fixed.h"
+#include "hashindex.h"
+#include "lsmindex.h"
+#include "latency.h"
+
+using namespace std;
+
+//
+// Drives an index directly with generated workloads, rather than through
+// gen_test_sequence.pl, sim and compare.pl, so that what is timed is the
+// index and not the parsing of text.
+//
+// The records are numbered from 0, and record k has the key k in decimal,
+// zero-padded to keysize bytes, so keys sort as their numbers do.  The
+// load phase inserts the records in a scrambled order.  The run phase
+// then draws ops from a mix, and the records they touch from a
+// distribution:
+//
+//   uniform    - every record equally likely
+//   zipfian    - a few records are hot (theta 0.99), scattered over the keys
+//   sequential - records in turn, wrapping around
+//   latest     - zipfian, with the most recently inserted records hottest
+//
+// The mixes are those of YCSB:
+//
+//   A  50% read, 50% update, zipfian
+//   B  95% read, 5% update, zipfian
+//   C  100% read, zipfian
+//   D  95% read, 5% insert, latest
+//   E  95% scan, 5% insert, zipfian
+//   F  50% read, 50% read-modify-write, zipfian
+//
+// An insert adds the next record.  There is no range scan in the index
+// interface, so a scan looks up a run of up to scanlength consecutive
+// records.  Warm-up ops run first, with the same mix, and are not reported.
+//
+
+void usage()
+{
+  cerr << "usage: btree_bench filestem cachesize [options]\n"
+       << "  workload=A..F|load  dist=uniform|zipfian|sequential|latest\n"
+       << "  keysize=N valuesize=N records=N ops=N warmup=N scanlength=N seed=N\n"
+       << "  read=% update=% insert=% scan=% rmw=%   (in place of the workload's mix)\n"
+       << "  format comparator bloom[=bits] pin=N lsm[=entries] hash   (as for sim's INIT)\n";
+}
+
+
+enum { OP_READ, OP_UPDATE, OP_INSERT, OP_SCAN, OP_RMW, NUM_OPS };
+
+static const char *opnames[NUM_OPS+1]={"read","update","insert","scan","rmw",0};
+
+enum { DIST_UNIFORM, DIST_ZIPFIAN, DIST_SEQUENTIAL, DIST_LATEST };
+
+struct Workload {
+  char name;
+  int  mix[NUM_OPS];   // percentages
+  int  dist;
+};
+
+static const Workload workloads[]={
+  {'A',{50,50,0,0,0},DIST_ZIPFIAN},
+  {'B',{95,5,0,0,0},DIST_ZIPFIAN},
+  {'C',{100,0,0,0,0},DIST_ZIPFIAN},
+  {'D',{95,0,5,0,0},DIST_LATEST},
+  {'E',{0,0,5,95,0},DIST_ZIPFIAN},
+  {'F',{50,0,0,0,50},DIST_ZIPFIAN},
+  {0,{0,0,0,0,0},0}
+};
+
+
+static double Now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+
+static unsigned long long Gcd(unsigned long long a, unsigned long long b)
+{
+  while (b) {
+    unsigned long long t=a%b;
+    a=b;
+    b=t;
+  }
+  return a;
+}
+
+
+static unsigned long long Scramble(unsigned long long x)
+{
+  // FNV-1a over the bytes of x
+  unsigned long long h=14695981039346656037ULL;
+  for (int i=0;i<8;i++) {
+    h^=(x>>(8*i))&0xff;
+    h*=1099511628211ULL;
+  }
+  return h;
+}
+
+
+//
+// Ranks drawn from a Zipfian distribution over [0,n), as in Gray et al.,
+// "Quickly generating billion-record synthetic databases".  The zeta sum
+// is extended as n grows rather than recomputed.
+//
+class Zipfian {
+  double theta, alpha, zeta2, zetan, eta;
+  unsigned long long counted;
+
+  void Extend(const unsigned long long n) {
+    for (;counted<n;counted++) {
+      zetan+=1.0/pow((double)(counted+1),theta);
+    }
+    eta=(1-pow(2.0/n,1-theta))/(1-zeta2/zetan);
+  }
+ public:
+  Zipfian(const double t=0.99) :
+    theta(t), alpha(1/(1-t)), zeta2(1+pow(0.5,t)), zetan(0), eta(0), counted(0) {}
+
+  unsigned long long Next(const unsigned long long n) {
+    if (n!=counted) {
+      Extend(n);
+    }
+    double u=drand48();
+    double uz=u*zetan;
+    if (uz<1) {
+      return 0;
+    }
+    if (uz<1+pow(0.5,theta)) {
+      return 1;
+    }
+    unsigned long long r=(unsigned long long)(n*pow(eta*u-eta+1,alpha));
+    return r<n ? r : n-1;
+  }
+};
+
+
+class Bench {
+  BTreeIndex     *index;
+  OpStats        &stats;
+  SIZE_T          keysize, valuesize;
+  unsigned long long records;      // records 0..records-1 are in the index
+  unsigned long long next;         // for the sequential distribution
+  int             dist;
+  int             mix[NUM_OPS];
+  SIZE_T          scanlength;
+  Zipfian         zipf;
+  KEY_T           key;
+  VALUE_T         value, old;
+
+ public:
+  Bench(BTreeIndex *i, OpStats &s, SIZE_T ks, SIZE_T vs, int d, const int *m, SIZE_T scan) :
+    index(i), stats(s), keysize(ks), valuesize(vs), records(0), next(0), dist(d), scanlength(scan) {
+    memcpy(mix,m,sizeof(mix));
+    key.Resize(keysize,false);
+    value.Resize(valuesize,false);
+  }
+
+  // The decimal digits of k, right-aligned and padded with '0', or the
+  // low digits if the key is too short for them all
+  void SetKey(unsigned long long k) {
+    memset(key.data,'0',keysize);
+    for (SIZE_T i=keysize; i>0 && k; i--, k/=10) {
+      key.data[i-1]='0'+k%10;
+    }
+  }
+
+  void SetValue() {
+    for (SIZE_T i=0;i<valuesize;i++) {
+      value.data[i]='a'+lrand48()%26;
+    }
+  }
+
+  unsigned long long Choose() {
+    switch (dist) {
+    case DIST_UNIFORM:
+      return lrand48()%records;
+    case DIST_SEQUENTIAL:
+      return next++%records;
+    case DIST_LATEST:
+      return records-1-zipf.Next(records);
+    default:
+      return Scramble(zipf.Next(records))%records;
+    }
+  }
+
+  int ChooseOp() {
+    int r=lrand48()%100;
+    int op;
+    for (op=0;op<NUM_OPS-1;op++) {
+      if (r<mix[op]) {
+	break;
+      }
+      r-=mix[op];
+    }
+    return op;
+  }
+
+  // Inserts records [0,n) in a scrambled order
+  ERROR_T Load(const unsigned long long n) {
+    // A stride prime to n visits each record once
+    unsigned long long stride=1000003%n ? 1000003%n : 1;
+    while (Gcd(stride,n)!=1) {
+      stride++;
+    }
+    for (unsigned long long i=0;i<n;i++) {
+      SetKey((i*stride)%n);
+      SetValue();
+      ERROR_T rc=index->Insert(key,value);
+      if (rc) {
+	return rc;
+      }
+    }
+    records=n;
+    return ERROR_NOERROR;
+  }
+
+  void Run(const unsigned long long ops, const bool measure) {
+    for (unsigned long long i=0;i<ops;i++) {
+      int op=ChooseOp();
+      bool ok=true;
+
+      if (measure) {
+	stats.Begin();
+      }
+
+      switch (op) {
+      case OP_READ:
+	SetKey(Choose());
+	ok=index->Lookup(key,old)==ERROR_NOERROR;
+	break;
+      case OP_UPDATE:
+	SetKey(Choose());
+	SetValue();
+	ok=index->Update(key,value)==ERROR_NOERROR;
+	break;
+      case OP_INSERT:
+	SetKey(records);
+	SetValue();
+	ok=index->Insert(key,value)==ERROR_NOERROR;
+	if (ok) {
+	  records++;
+	}
+	break;
+      case OP_SCAN: {
+	unsigned long long k=Choose();
+	unsigned long long n=1+lrand48()%scanlength;
+	for (;n>0 && k<records && ok;n--,k++) {
+	  SetKey(k);
+	  ok=index->Lookup(key,old)==ERROR_NOERROR;
+	}
+	break;
+      }
+      case OP_RMW:
+	SetKey(Choose());
+	ok=index->Lookup(key,old)==ERROR_NOERROR;
+	SetValue();
+	ok=ok && index->Update(key,value)==ERROR_NOERROR;
+	break;
+      }
+      if (measure) {
+	stats.End(op,ok);
+      }
+    }
+  }
+};
+
+
+static bool Option(const string &option, const char *name, unsigned long long &n)
+{
+  size_t len=strlen(name);
+  if (option.compare(0,len,name)!=0 || option.size()==len || option[len]!='=') {
+    return false;
+  }
+  n=strtoull(option.c_str()+len+1,0,10);
+  return true;
+}
+
+
+int main(int argc, char **argv)
+{
+  unsigned long long keysize=8, valuesize=8, records=100000, ops=100000, warmup=10000,
+    scan=100, seed=1, n;
+  int fmt=BTREE_FORMAT_FIXED, cmp=BTREE_COMPARE_BYTES, pinlevels=-1;
+  SIZE_T bloombits=0, memtable=0;
+  bool hash=false, loadonly=false, ownmix=false;
+  const Workload *w=&workloads[0];
+  int dist=-1;
+  int mix[NUM_OPS]={0,0,0,0,0};
+  ERROR_T rc;
+
+  if (argc<3) {
+    usage();
+    return -1;
+  }
+
+  for (int i=3;i<argc;i++) {
+    string option=argv[i];
+    if (option.compare(0,9,"workload=")==0 && option.size()==10) {
+      for (w=workloads;w->name && w->name!=toupper(option[9]);w++) {}
+      if (!w->name) {
+	cerr << "Unknown workload "<<option.substr(9)<<"\n";
+	return -1;
+      }
+    } else if (option=="workload=load") {
+      loadonly=true;
+    } else if (option.compare(0,5,"dist=")==0) {
+      string d=option.substr(5);
+      dist = d=="uniform" ? DIST_UNIFORM : d=="zipfian" ? DIST_ZIPFIAN :
+	d=="sequential" ? DIST_SEQUENTIAL : d=="latest" ? DIST_LATEST : -2;
+      if (dist==-2) {
+	cerr << "Unknown distribution "<<d<<"\n";
+	return -1;
+      }
+    } else if (Option(option,"keysize",keysize) || Option(option,"valuesize",valuesize) ||
+	       Option(option,"records",records) || Option(option,"ops",ops) ||
+	       Option(option,"warmup",warmup) || Option(option,"scanlength",scan) ||
+	       Option(option,"seed",seed)) {
+    } else if (Option(option,"read",n) || Option(option,"update",n) ||
+	       Option(option,"insert",n) || Option(option,"scan",n) || Option(option,"rmw",n)) {
+      string name=option.substr(0,option.find('='));
+      for (int op=0;op<NUM_OPS;op++) {
+	if (name==opnames[op]) {
+	  mix[op]=n;
+	}
+      }
+      ownmix=true;
+    } else if (option=="hash") {
+      hash=true;
+    } else if (option=="bloom") {
+      bloombits=10;
+    } else if (Option(option,"bloom",n) && n>0) {
+      bloombits=n;
+    } else if (option=="lsm") {
+      memtable=LSM_DEFAULT_MEMTABLE;
+    } else if (Option(option,"lsm",n) && n>0) {
+      memtable=n;
+    } else if (Option(option,"pin",n)) {
+      pinlevels=n;
+    } else if (FormatFromName(option.c_str())>=0) {
+      fmt=FormatFromName(option.c_str());
+    } else if (KeyOrderFromName(option.c_str())>=0) {
+      cmp=KeyOrderFromName(option.c_str());
+    } else {
+      cerr << "Unknown option "<<option<<"\n";
+      usage();
+      return -1;
+    }
+  }
+
+  if (!ownmix) {
+    memcpy(mix,w->mix,sizeof(mix));
+  }
+  if (mix[0]+mix[1]+mix[2]+mix[3]+mix[4]!=100) {
+    cerr << "The mix must add up to 100%\n";
+    return -1;
+  }
+  if (dist<0) {
+    dist=w->dist;
+  }
+  // Any warm-up or measured op may insert a new key, when the mix has inserts
+  if (keysize<20 && records+(mix[OP_INSERT] ? warmup+ops : 0)>pow(10.0,(double)keysize)) {
+    cerr << "Too many records for "<<keysize<<" digit keys\n";
+    return -1;
+  }
+  if (records==0 || scan==0) {
+    cerr << "records and scanlength must be at least 1\n";
+    return -1;
+  }
+  if ((hash && (fmt!=BTREE_FORMAT_FIXED || bloombits || memtable)) ||
+      (memtable && fmt==BTREE_FORMAT_BUFFERED)) {
+    cerr << "hash takes no format, filter or memtable, and lsm no buffered format\n";
+    return -1;
+  }
+  srand48(seed);
+
+  DiskSystem disk(argv[1]);
+  BufferCache cache(&disk,atoi(argv[2]));
+  BTreeIndex *index;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  if (hash) {
+    index=new HashIndex(keysize,valuesize,&cache,cmp);
+  } else if (memtable) {
+    index=new LSMIndex(keysize,valuesize,&cache,fmt,cmp,memtable);
+  } else if (fmt==BTREE_FORMAT_FIXED && keysize==8 && valuesize==8 && cmp==BTREE_COMPARE_BYTES) {
+    // as sim does, the common case gets the specialized index
+    index=new BTreeIndexT<8,8,BigEndianU64KeyCompare>(&cache);
+  } else {
+    index=new BTreeIndex(keysize,valuesize,&cache,true,fmt,cmp);
+  }
+  index->UseFilter(bloombits);
+  if (pinlevels>=0 && !hash) {
+    index->PinLevels(pinlevels);
+  }
+  if ((rc=index->Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't create index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  OpStats stats(&cache,opnames);
+  stats.SetIndex(index);
+  Bench bench(index,stats,keysize,valuesize,dist,mix,scan);
+  static const char *distnames[]={"uniform","zipfian","sequential","latest"};
+
+  cout << "keysize "<<keysize<<", valuesize "<<valuesize<<", format "<<FormatName(fmt)
+       << ", cache "<<cache.GetCacheSize()<<" blocks of "<<cache.GetBlockSize()<<endl;
+
+  double wall=Now(), sim=cache.GetCurrentTime();
+  SIZE_T diskreads=cache.GetNumDiskReads(), diskwrites=cache.GetNumDiskWrites();
+  if ((rc=bench.Load(records))!=ERROR_NOERROR) {
+    cerr << "Load failed due to error "<<rc<<endl;
+    return -1;
+  }
+  wall=Now()-wall;
+  cout << "load: "<<records<<" inserts in "<<fixed<<setprecision(3)<<wall<<" s, "
+       << setprecision(0)<<records/wall<<" ops/s, "
+       << setprecision(1)<<cache.GetCurrentTime()-sim<<" simulated ms, "
+       << cache.GetNumDiskReads()-diskreads<<" disk reads, "
+       << cache.GetNumDiskWrites()-diskwrites<<" disk writes"<<endl;
+
+  if (!loadonly) {
+    bench.Run(warmup,false);
+
+    wall=Now();
+    sim=cache.GetCurrentTime();
+    diskreads=cache.GetNumDiskReads();
+    diskwrites=cache.GetNumDiskWrites();
+    bench.Run(ops,true);
+    wall=Now()-wall;
+
+    cout << "run: workload "<<(ownmix ? '-' : w->name)<<" (";
+    for (int op=0, first=1;op<NUM_OPS;op++) {
+      if (mix[op]) {
+	cout << (first ? "" : " ") << mix[op] << "% " << opnames[op];
+	first=0;
+      }
+    }
+    cout << "), "<<distnames[dist]<<", "<<warmup<<" warm-up ops"<<endl;
+    cout << "  "<<ops<<" ops in "<<setprecision(3)<<wall<<" s, "
+	 << setprecision(0)<<ops/wall<<" ops/s, "
+	 << setprecision(1)<<cache.GetCurrentTime()-sim<<" simulated ms, "
+	 << cache.GetNumDiskReads()-diskreads<<" disk reads, "
+	 << cache.GetNumDiskWrites()-diskwrites<<" disk writes"<<endl;
+    cout << stats;
+  }
+
+  SIZE_T superblocknum;
+  if ((rc=index->Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr << "Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr << "Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+  delete index;
+  return 0;
+}
@@ -1,9 +1,17 @@
 #include <stdlib.h>
 #include "btree.h"
+#include "session.h"
 
 void usage() 
 {
-  cerr << "usage: btree_delete filestem cachesize key\n";
+  cerr << "usage: btree_delete filestem cachesize [key]\n";
+  cerr << "  with no key, deletes the key on each line of stdin\n";
+}
+
+
+static ERROR_T Delete(BTreeIndex &b, const KEY_T &k, const VALUE_T &, VALUE_T &)
+{
+  return b.Delete(k);
 }
 
 
@@ -14,14 +22,14 @@ int main(int argc, char **argv)
   SIZE_T superblocknum;
   char *key;
 
-  if (argc!=4) { 
+  if (argc!=4 && argc!=3) { 
     usage();
     return -1;
   }
 
   filestem=argv[1];
   cachesize=atoi(argv[2]);
-  key=argv[3];
+  key=argc==4 ? argv[3] : 0;
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
@@ -40,10 +48,14 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    if ((rc=btree.Delete(KEY_T(key)))!=ERROR_NOERROR) { 
-      cerr <<"Can't delete from index due to error "<<rc<<endl;
+    if (key) {
+      if ((rc=btree.Delete(KEY_T(key)))!=ERROR_NOERROR) { 
+        cerr <<"Can't delete from index due to error "<<rc<<endl;
+      } else {
+        cerr <<"Delete succeeded\n";
+      }
     } else {
-      cerr <<"Delete succeeded\n";
+      RunKeyLines(stdin,cout,btree,Delete,false,"deletes");
     }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
@@ -61,6 +73,11 @@ int main(int argc, char **argv)
     cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
     cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
     cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << "numhits         = "<<cache.GetNumHits()<<endl;
+    cerr << "nummisses       = "<<cache.GetNumMisses()<<endl;
+    cerr << "numevictions    = "<<cache.GetNumEvictions()<<endl;
+    cerr << "numwritebacks   = "<<cache.GetNumWritebacks()<<endl;
+    cerr << "numsplits       = "<<btree.GetNumSplits()<<endl;
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
@@ -2,14 +2,45 @@
 #include <iostream>
 #include <assert.h>
 #include <string.h>
+#include <vector>
 
 #include "btree_ds.h"
 #include "buffercache.h"
+#include "keycompare.h"
 
 #include "btree.h"
 
 using namespace std;
 
+static const char *formatnames[] = { "fixed", "truncated", "slotted", "separated", "eytzinger",
+				      "buffered" };
+
+#define NUM_FORMATS (sizeof(formatnames)/sizeof(formatnames[0]))
+
+const char *FormatName(const int format)
+{
+  if (format<0 || (SIZE_T)format>=NUM_FORMATS) { 
+    return "unknown";
+  }
+  return formatnames[format];
+}
+
+int FormatFromName(const char *name)
+{
+  for (SIZE_T i=0;i<NUM_FORMATS;i++) { 
+    if (!strcmp(name,formatnames[i])) { 
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool FormatHasVarSeparators(const int format)
+{
+  return format==BTREE_FORMAT_TRUNCATED || format==BTREE_FORMAT_SLOTTED;
+}
+
+
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
   SIZE_T n=blocksize-sizeof(*this);
@@ -17,9 +48,20 @@ SIZE_T NodeMetadata::GetNumDataBytes() const
 }
 
 
+SIZE_T NodeMetadata::GetNumPivotBytes() const
+{
+  return format==BTREE_FORMAT_BUFFERED ? GetNumDataBytes()/2 : GetNumDataBytes();
+}
+
+
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  return (GetNumPivotBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+}
+
+SIZE_T NodeMetadata::GetNumSlotsAsBuffer() const
+{
+  return (GetNumDataBytes()-GetNumPivotBytes())/(keysize+valuesize);  // floor intended
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
@@ -28,21 +70,43 @@ SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 }
 
 
+SIZE_T NodeMetadata::GetNumOverflowBytes() const
+{
+  return GetNumDataBytes()-sizeof(SIZE_T);
+}
+
+
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+#define MAX(x,y) ((x)>(y) ? (x) : (y))
+
 ostream & NodeMetadata::Print(ostream &os) const 
 {
   os << "NodeMetaData(nodetype="<<(nodetype==BTREE_UNALLOCATED_BLOCK ? "UNALLOCATED_BLOCK" :
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" :
+				   nodetype==BTREE_OVERFLOW_NODE ? "OVERFLOW_NODE" :
+				   nodetype==BTREE_HASH_DIRECTORY_NODE ? "HASH_DIRECTORY_NODE" :
+				   nodetype==BTREE_HASH_BUCKET_NODE ? "HASH_BUCKET_NODE" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys
+     << ", format="<<FormatName(format)<<", comparator="<<KeyOrderName(comparator)
+     << ", unique="<<unique
+     << ", heapstart="<<heapstart<<", heapused="<<heapused
+     << ", nummessages="<<nummessages<<")";
   return os;
 }
 
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.format=BTREE_FORMAT_FIXED;
+  info.comparator=BTREE_COMPARE_BYTES;
+  info.unique=1;
+  info.heapstart=0;
+  info.heapused=0;
+  info.nummessages=0;
   data=0;
 }
 
@@ -56,7 +120,8 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+		     int format, int comparator)
 {
   info.nodetype=node_type;
   info.keysize=key_size;
@@ -65,6 +130,12 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.rootnode=0;
   info.freelist=0;
   info.numkeys=0;				       
+  info.format=format;
+  info.comparator=comparator;
+  info.unique=1;
+  info.heapstart=info.GetNumDataBytes();
+  info.heapused=0;
+  info.nummessages=0;
   data=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
@@ -81,6 +152,12 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
   info.numkeys=rhs.info.numkeys;				       
+  info.format=rhs.info.format;
+  info.comparator=rhs.info.comparator;
+  info.unique=rhs.info.unique;
+  info.heapstart=rhs.info.heapstart;
+  info.heapused=rhs.info.heapused;
+  info.nummessages=rhs.info.nummessages;
   data=0;
   if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
@@ -122,6 +199,12 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     return rc;
   }
 
+  return Unserialize(block);
+}
+
+
+ERROR_T  BTreeNode::Unserialize(const Block &block)
+{
   memcpy(&info,block.data,sizeof(info));
   
   if (data) { 
@@ -129,7 +212,7 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     data=0;
   }
 
-  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+  assert(block.length==(unsigned)info.blocksize);
 
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
@@ -140,17 +223,238 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 }
 
 
+bool BTreeNode::HasSplitArrays() const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+  case BTREE_LEAF_NODE:
+    return info.format==BTREE_FORMAT_SEPARATED || info.format==BTREE_FORMAT_EYTZINGER;
+  default:
+    return false;
+  }
+}
+
+
+SIZE_T BTreeNode::GetNumSlots() const
+{
+  return info.nodetype==BTREE_LEAF_NODE ? info.GetNumSlotsAsLeaf() : info.GetNumSlotsAsInterior();
+}
+
+
+// For a complete binary tree of n nodes laid out breadth first: the
+// position of each node in key order, followed by the key order rank
+// of the node at each position.  Built the first time n comes up.
+static void EytzingerWalk(SIZE_T *table, const SIZE_T n, const SIZE_T k, SIZE_T &rank)
+{
+  if (k>n) { 
+    return;
+  }
+  EytzingerWalk(table,n,2*k,rank);
+  table[rank]=k-1;
+  table[n+k-1]=rank;
+  rank++;
+  EytzingerWalk(table,n,2*k+1,rank);
+}
+
+static const SIZE_T *EytzingerTable(const SIZE_T n)
+{
+  static vector<vector<SIZE_T> > tables;
+
+  if (n>=tables.size()) { 
+    tables.resize(n+1);
+  }
+  if (tables[n].empty()) { 
+    SIZE_T rank=0;
+    tables[n].resize(2*n+1);
+    EytzingerWalk(&tables[n][0],n,1,rank);
+  }
+  return &tables[n][0];
+}
+
+
+SIZE_T BTreeNode::GetPosition(const SIZE_T offset) const
+{
+  if (info.format!=BTREE_FORMAT_EYTZINGER) { 
+    return offset;
+  }
+  assert(offset<info.numkeys);
+  return EytzingerTable(info.numkeys)[offset];
+}
+
+
+static char *KeyArray(const BTreeNode &b)
+{
+  return b.data+(b.info.nodetype==BTREE_LEAF_NODE ? sizeof(SIZE_T) : 0);
+}
+
+// Where the pointers (interior) or values (leaf) of a node with split arrays start
+static char *EntryArray(const BTreeNode &b)
+{
+  return KeyArray(b)+b.GetNumSlots()*b.info.keysize;
+}
+
+
+void BTreeNode::SetFormat(const int format)
+{
+  if (!HasSplitArrays() || format==info.format) { 
+    return;
+  }
+
+  BTreeNode old(*this);
+
+  info.format=format;
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    memcpy(ResolveKey(i),old.ResolveKey(i),info.keysize);
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      memcpy(ResolveVal(i),old.ResolveVal(i),info.valuesize);
+    } else {
+      memcpy(ResolvePtr(i),old.ResolvePtr(i),sizeof(SIZE_T));
+    }
+  }
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    memcpy(ResolvePtr(info.numkeys),old.ResolvePtr(info.numkeys),sizeof(SIZE_T));
+  }
+}
+
+
+void BTreeNode::RemapEytzinger(const SIZE_T newn, const SIZE_T keygap, const SIZE_T entrygap)
+{
+  static vector<char> scratch;
+  SIZE_T oldn=info.numkeys, slots=GetNumSlots();
+  bool leaf=info.nodetype==BTREE_LEAF_NODE;
+  SIZE_T entrysize=leaf ? info.valuesize : sizeof(SIZE_T);
+  // the larger table first, so building the other can't move it
+  const SIZE_T *wide=EytzingerTable(MAX(oldn,newn));
+  const SIZE_T *from = oldn>=newn ? wide : EytzingerTable(oldn);
+  const SIZE_T *to = newn>=oldn ? wide : EytzingerTable(newn);
+  char *keys=KeyArray(*this), *entries=EntryArray(*this);
+  // an interior node's last pointer has its home past the slots
+  char *lastptr=entries+slots*sizeof(SIZE_T);
+  char last[sizeof(SIZE_T)];
+
+  scratch.resize(slots*(info.keysize+entrysize));
+  char *newkeys=&scratch[0], *newentries=newkeys+slots*info.keysize;
+
+  // rank r of the new layout holds what rank r (before the gap) or
+  // r-1 (after it) held in the old one
+  for (SIZE_T r=0; r<newn; r++) {
+    if (r!=keygap) {
+      SIZE_T q = r<keygap ? r : r-1;
+      memcpy(newkeys+to[r]*info.keysize,keys+from[q]*info.keysize,info.keysize);
+    }
+    if (r!=entrygap) {
+      SIZE_T q = r<entrygap ? r : r-1;
+      memcpy(newentries+to[r]*entrysize,
+	     !leaf && q==oldn ? lastptr : entries+from[q]*entrysize,entrysize);
+    }
+  }
+  if (!leaf && newn!=entrygap) {
+    SIZE_T q = newn<entrygap ? newn : newn-1;
+    memcpy(last,q==oldn ? lastptr : entries+from[q]*entrysize,sizeof(SIZE_T));
+    memcpy(lastptr,last,sizeof(SIZE_T));
+  }
+  memcpy(keys,newkeys,newn*info.keysize);
+  memcpy(entries,newentries,newn*entrysize);
+  info.numkeys=newn;
+}
+
+
+bool BTreeNode::HasVarKeys() const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return info.format==BTREE_FORMAT_TRUNCATED || info.format==BTREE_FORMAT_SLOTTED;
+  case BTREE_LEAF_NODE:
+    return info.format==BTREE_FORMAT_SLOTTED;
+  default:
+    return false;
+  }
+}
+
+
+SIZE_T BTreeNode::GetSlotSize() const
+{
+  return info.nodetype==BTREE_LEAF_NODE ? sizeof(VarLeafSlot) : sizeof(VarSlot);
+}
+
+
+char * BTreeNode::ResolveSlot(const SIZE_T offset) const
+{
+  if (!HasVarKeys()) { 
+    return 0;
+  }
+  assert(offset<info.numkeys);
+  return data+sizeof(SIZE_T)+offset*GetSlotSize();
+}
+
+
+void BTreeNode::GetRecord(const SIZE_T offset, SIZE_T &start, SIZE_T &keylen, SIZE_T &vallen) const
+{
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    VarLeafSlot slot;
+    memcpy(&slot,ResolveSlot(offset),sizeof(slot));
+    start=slot.offset; keylen=slot.keylength; vallen=slot.vallength&~BTREE_OVERFLOW_FLAG;
+  } else {
+    VarSlot slot;
+    memcpy(&slot,ResolveSlot(offset),sizeof(slot));
+    start=slot.offset; keylen=slot.length; vallen=0;
+  }
+}
+
+
+void BTreeNode::SetRecord(const SIZE_T offset, const SIZE_T start, const SIZE_T keylen, const SIZE_T vallen)
+{
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    VarLeafSlot slot;
+    memcpy(&slot,ResolveSlot(offset),sizeof(slot));
+    slot.offset=start; slot.keylength=keylen; 
+    slot.vallength=vallen|(slot.vallength&BTREE_OVERFLOW_FLAG);
+    memcpy(ResolveSlot(offset),&slot,sizeof(slot));
+  } else {
+    VarSlot slot;
+    memcpy(&slot,ResolveSlot(offset),sizeof(slot));
+    slot.offset=start; slot.length=keylen;
+    memcpy(ResolveSlot(offset),&slot,sizeof(slot));
+  }
+}
+
+
+void BTreeNode::SetOverflowFlag(const SIZE_T offset, const bool overflow)
+{
+  VarLeafSlot slot;
+
+  memcpy(&slot,ResolveSlot(offset),sizeof(slot));
+  if (overflow) { 
+    slot.vallength|=BTREE_OVERFLOW_FLAG;
+  } else {
+    slot.vallength&=~BTREE_OVERFLOW_FLAG;
+  }
+  memcpy(ResolveSlot(offset),&slot,sizeof(slot));
+}
+
+
 char * BTreeNode::ResolveKey(const SIZE_T offset) const
 {
+  SIZE_T start, keylen, vallen;
+
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
-    break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    if (HasVarKeys()) { 
+      GetRecord(offset,start,keylen,vallen);
+      return data+start;
+    }
+    if (HasSplitArrays()) { 
+      return KeyArray(*this)+GetPosition(offset)*info.keysize;
+    }
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    }
+    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
     break;
   default:
     return 0;
@@ -164,9 +468,21 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
+    if (HasVarKeys()) { 
+      // the ith pointer sits at the front of the slot of key i-1
+      return offset==0 ? data : ResolveSlot(offset-1);
+    }
+    if (HasSplitArrays()) { 
+      // in EYTZINGER nodes the last pointer has a fixed home at the end
+      if (info.format==BTREE_FORMAT_EYTZINGER && offset==info.numkeys) { 
+	return EntryArray(*this)+GetNumSlots()*sizeof(SIZE_T);
+      }
+      return EntryArray(*this)+GetPosition(offset)*sizeof(SIZE_T);
+    }
     return data+offset*(sizeof(SIZE_T)+info.keysize);
     break;
   case BTREE_LEAF_NODE:
+  case BTREE_OVERFLOW_NODE:
     assert(offset==0);
     return data;
     break;
@@ -179,11 +495,24 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 
 char * BTreeNode::ResolveVal(const SIZE_T offset) const
 {
+  SIZE_T start, keylen, vallen;
+
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
+    if (HasVarKeys()) { 
+      GetRecord(offset,start,keylen,vallen);
+      return data+start+keylen;
+    }
+    if (HasSplitArrays()) { 
+      return EntryArray(*this)+GetPosition(offset)*info.valuesize;
+    }
     return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
     break;
+  case BTREE_OVERFLOW_NODE:
+    assert(offset==0);
+    return data+sizeof(SIZE_T);
+    break;
   default:
     return 0;
   }
@@ -196,6 +525,218 @@ char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
   return ResolveKey(offset);
 }
 
+
+SIZE_T BTreeNode::GetKeyLength(const SIZE_T offset) const
+{
+  SIZE_T start, keylen, vallen;
+
+  if (HasVarKeys()) { 
+    GetRecord(offset,start,keylen,vallen);
+    return keylen;
+  }
+  return info.keysize;
+}
+
+
+SIZE_T BTreeNode::GetValLength(const SIZE_T offset) const
+{
+  SIZE_T start, keylen, vallen;
+
+  if (HasVarKeys()) { 
+    GetRecord(offset,start,keylen,vallen);
+    return vallen;
+  }
+  switch (info.nodetype) { 
+  case BTREE_LEAF_NODE:
+    return info.valuesize;
+  case BTREE_OVERFLOW_NODE:
+    return info.numkeys;
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNode::GetEntrySize(const SIZE_T offset) const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    if (HasVarKeys()) { 
+      return sizeof(VarSlot)+GetKeyLength(offset);
+    }
+    return sizeof(SIZE_T)+info.keysize;
+  case BTREE_LEAF_NODE:
+    if (HasVarKeys()) { 
+      return sizeof(VarLeafSlot)+GetKeyLength(offset)+GetValLength(offset);
+    }
+    return info.keysize+info.valuesize;
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNode::GetFreeBytes() const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+  case BTREE_LEAF_NODE:
+    if (HasVarKeys()) { 
+      return info.GetNumDataBytes()-sizeof(SIZE_T)-info.numkeys*GetSlotSize()-info.heapused;
+    }
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      return info.GetNumDataBytes()-sizeof(SIZE_T)-info.numkeys*(info.keysize+info.valuesize);
+    }
+    return info.GetNumPivotBytes()-sizeof(SIZE_T)-info.numkeys*(sizeof(SIZE_T)+info.keysize);
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNode::GetMaxEntrySize() const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return (HasVarKeys() ? sizeof(VarSlot) : sizeof(SIZE_T))+info.keysize;
+  case BTREE_LEAF_NODE:
+    if (HasVarKeys()) { 
+      // larger values are replaced by a reference
+      return sizeof(VarLeafSlot)+info.keysize+
+	MIN(info.valuesize,MAX(GetMaxInlineValue(),sizeof(OverflowRef)));
+    }
+    return info.keysize+info.valuesize;
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNode::GetMaxInlineValue() const
+{
+  // Each leaf entry gets its share of the node, as BTREE_MIN_VAR_ENTRIES
+  // of them must fit for byte-based splits to work
+  SIZE_T share=(info.GetNumDataBytes()-sizeof(SIZE_T))/BTREE_MIN_VAR_ENTRIES;
+
+  if (share<sizeof(VarLeafSlot)+info.keysize) { 
+    return 0;
+  }
+  return share-sizeof(VarLeafSlot)-info.keysize;
+}
+
+
+bool BTreeNode::IsOverflowVal(const SIZE_T offset) const
+{
+  VarLeafSlot slot;
+
+  if (info.nodetype!=BTREE_LEAF_NODE || !HasVarKeys()) { 
+    return false;
+  }
+  memcpy(&slot,ResolveSlot(offset),sizeof(slot));
+  return (slot.vallength&BTREE_OVERFLOW_FLAG)!=0;
+}
+
+
+ERROR_T BTreeNode::GetOverflowVal(const SIZE_T offset, OverflowRef &ref) const
+{
+  if (!IsOverflowVal(offset)) { 
+    return ERROR_INSANE;
+  }
+  memcpy(&ref,ResolveVal(offset),sizeof(ref));
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetOverflowVal(const SIZE_T offset, const OverflowRef &ref)
+{
+  VALUE_T v(sizeof(ref));
+  
+  memcpy(v.data,&ref,sizeof(ref));
+
+  ERROR_T rc=SetVal(offset,v);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  SetOverflowFlag(offset,true);
+  return ERROR_NOERROR;
+}
+
+
+bool BTreeNode::IsFull() const
+{
+  return GetFreeBytes()<GetMaxEntrySize();
+}
+
+
+int BTreeNode::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  return GetKeyOrder(info.comparator)->compare(ResolveKey(offset),GetKeyLength(offset),
+					      (const char*)k.data,k.length);
+}
+
+
+SIZE_T BTreeNode::Search(const KEY_T &k, const bool upper) const
+{
+  // The order is looked up once per search, not once per compare
+  const KeyOrder *order=GetKeyOrder(info.comparator);
+
+  if (info.numkeys==0) { 
+    return 0;
+  }
+
+  if (info.format==BTREE_FORMAT_EYTZINGER && HasSplitArrays()) { 
+    // Walk down the implicit tree; the path taken spells out where k goes
+    const char *keys=KeyArray(*this);
+    SIZE_T n=info.numkeys;
+    SIZE_T pos=1;
+
+    while (pos<=n) { 
+      int rc=order->compare(keys+(pos-1)*info.keysize,info.keysize,(const char*)k.data,k.length);
+      pos=2*pos+(upper ? rc<=0 : rc<0);
+    }
+    // Undo the right turns taken since the last left one
+    pos>>=__builtin_ffs(~pos);
+    return pos ? EytzingerTable(n)[n+pos-1] : n;
+  }
+
+  if (!HasVarKeys() && k.length==info.keysize) { 
+    // Keys of one size at a fixed stride
+    SIZE_T stride=HasSplitArrays() ? info.keysize :
+      info.nodetype==BTREE_LEAF_NODE ? info.keysize+info.valuesize : info.keysize+sizeof(SIZE_T);
+    return order->search(ResolveKey(0),stride,info.numkeys,(const char*)k.data,k.length,upper);
+  }
+
+  SIZE_T lo=0, hi=info.numkeys;
+
+  while (lo<hi) { 
+    SIZE_T mid=(lo+hi)/2;
+    int rc=order->compare(ResolveKey(mid),GetKeyLength(mid),(const char*)k.data,k.length);
+    if (upper ? rc<=0 : rc<0) { 
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+SIZE_T BTreeNode::LowerBound(const KEY_T &k) const
+{
+  return Search(k,false);
+}
+
+
+SIZE_T BTreeNode::UpperBound(const KEY_T &k) const
+{
+  return Search(k,true);
+}
+
+
 ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
@@ -204,8 +745,10 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
-  k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  SIZE_T len=GetKeyLength(offset);
+
+  k.Resize(len,false);
+  memcpy(k.data,p,len);
   return ERROR_NOERROR;
 }
 
@@ -229,8 +772,10 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T len=GetValLength(offset);
+
+  v.Resize(len,false);
+  memcpy(v.data,p,len);
   return ERROR_NOERROR;
 }
 
@@ -255,6 +800,11 @@ ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
     return ERROR_NOMEM;
   }
 
+  if (HasVarKeys()) { 
+    return WriteRecord(offset,(const char*)k.data,k.length,
+		       ResolveVal(offset),GetValLength(offset));
+  }
+
   memcpy(p,k.data,info.keysize);
 
   return ERROR_NOERROR;
@@ -286,6 +836,24 @@ ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
     return ERROR_NOMEM;
   }
   
+  if (HasVarKeys()) { 
+    ERROR_T rc=WriteRecord(offset,ResolveKey(offset),GetKeyLength(offset),
+			   (const char*)v.data,v.length);
+    if (rc==ERROR_NOERROR) { 
+      SetOverflowFlag(offset,false);
+    }
+    return rc;
+  }
+
+  if (info.nodetype==BTREE_OVERFLOW_NODE) { 
+    if (v.length>info.GetNumOverflowBytes()) { 
+      return ERROR_SIZE;
+    }
+    memcpy(p,v.data,v.length);
+    info.numkeys=v.length;
+    return ERROR_NOERROR;
+  }
+
   memcpy(p,v.data,info.valuesize);
   
   return ERROR_NOERROR;
@@ -306,6 +874,298 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+SIZE_T BTreeNode::GetContiguousFreeBytes() const
+{
+  return info.heapstart-(sizeof(SIZE_T)+info.numkeys*GetSlotSize());
+}
+
+
+ERROR_T BTreeNode::WriteRecord(const SIZE_T offset,
+			       const char *key, const SIZE_T keylen,
+			       const char *val, const SIZE_T vallen)
+{
+  SIZE_T start, oldkeylen, oldvallen;
+  SIZE_T len=keylen+vallen;
+
+  GetRecord(offset,start,oldkeylen,oldvallen);
+
+  if (GetFreeBytes()+oldkeylen+oldvallen<len) { 
+    return ERROR_NOSPACE;
+  }
+
+  // key or val may well point into our own heap, which Compact() moves
+  char *record=new char [len];
+  if (vallen) {
+    memcpy(record+keylen,val,vallen);
+  }
+  if (keylen) { 
+    memcpy(record,key,keylen);
+  }
+
+  info.heapused-=oldkeylen+oldvallen;
+  if (len>oldkeylen+oldvallen) {
+    // Doesn't fit over the old record, so it needs fresh heap space
+    SetRecord(offset,start,0,0);
+    if (GetContiguousFreeBytes()<len) { 
+      Compact();
+    }
+    info.heapstart-=len;
+    start=info.heapstart;
+  }
+  memcpy(data+start,record,len);
+  SetRecord(offset,start,keylen,vallen);
+  info.heapused+=len;
+
+  delete [] record;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertRecord(const SIZE_T offset,
+				const KEY_T &k,
+				const char *val, const SIZE_T vallen,
+				const SIZE_T ptr)
+{
+  SIZE_T len=k.length+vallen;
+
+  if (GetFreeBytes()<GetSlotSize()+len) { 
+    return ERROR_NOSPACE;
+  }
+  if (GetContiguousFreeBytes()<GetSlotSize()+len) { 
+    Compact();
+  }
+
+  char *src=data+sizeof(SIZE_T)+offset*GetSlotSize();
+  memmove(src+GetSlotSize(),src,(info.numkeys-offset)*GetSlotSize());
+  info.numkeys++;
+
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    VarSlot slot={ptr,0,0};
+    memcpy(src,&slot,sizeof(slot));
+  } else {
+    VarLeafSlot slot={0,0,0};
+    memcpy(src,&slot,sizeof(slot));
+  }
+
+  info.heapstart-=len;
+  memcpy(data+info.heapstart,k.data,k.length);
+  if (vallen) { 
+    memcpy(data+info.heapstart+k.length,val,vallen);
+  }
+  SetRecord(offset,info.heapstart,k.length,vallen);
+  info.heapused+=len;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &ptr)
+{
+  if (info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) { 
+    return ERROR_INSANE;
+  }
+  assert(offset<=info.numkeys);
+
+  if (HasVarKeys()) { 
+    return InsertRecord(offset,k,0,0,ptr);
+  }
+
+  if (info.numkeys>=info.GetNumSlotsAsInterior()) { 
+    return ERROR_NOSPACE;
+  }
+
+  if (info.format==BTREE_FORMAT_EYTZINGER) { 
+    RemapEytzinger(info.numkeys+1,offset,offset+1);
+    SetKey(offset,k);
+    SetPtr(offset+1,ptr);
+    return ERROR_NOERROR;
+  }
+
+  if (HasSplitArrays()) { 
+    char *keys=KeyArray(*this), *ptrs=EntryArray(*this);
+    memmove(keys+(offset+1)*info.keysize,keys+offset*info.keysize,(info.numkeys-offset)*info.keysize);
+    memmove(ptrs+(offset+2)*sizeof(SIZE_T),ptrs+(offset+1)*sizeof(SIZE_T),(info.numkeys-offset)*sizeof(SIZE_T));
+    info.numkeys++;
+    SetKey(offset,k);
+    SetPtr(offset+1,ptr);
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T entrysize=info.keysize+sizeof(SIZE_T);
+  char *src=data+sizeof(SIZE_T)+offset*entrysize;
+  memmove(src+entrysize,src,(info.numkeys-offset)*entrysize);
+  info.numkeys++;
+
+  ERROR_T rc=SetKey(offset,k);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  return SetPtr(offset+1,ptr);
+}
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    return ERROR_INSANE;
+  }
+  assert(offset<=info.numkeys);
+
+  if (HasVarKeys()) { 
+    return InsertRecord(offset,k,(const char*)v.data,v.length,0);
+  }
+
+  if (info.numkeys>=info.GetNumSlotsAsLeaf()) { 
+    return ERROR_NOSPACE;
+  }
+
+  if (info.format==BTREE_FORMAT_EYTZINGER) { 
+    RemapEytzinger(info.numkeys+1,offset,offset);
+    SetKey(offset,k);
+    SetVal(offset,v);
+    return ERROR_NOERROR;
+  }
+
+  if (HasSplitArrays()) { 
+    char *keys=KeyArray(*this), *vals=EntryArray(*this);
+    memmove(keys+(offset+1)*info.keysize,keys+offset*info.keysize,(info.numkeys-offset)*info.keysize);
+    memmove(vals+(offset+1)*info.valuesize,vals+offset*info.valuesize,(info.numkeys-offset)*info.valuesize);
+    info.numkeys++;
+    SetKey(offset,k);
+    SetVal(offset,v);
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T entrysize=info.keysize+info.valuesize;
+  char *src=data+sizeof(SIZE_T)+offset*entrysize;
+  memmove(src+entrysize,src,(info.numkeys-offset)*entrysize);
+  info.numkeys++;
+
+  ERROR_T rc=SetKey(offset,k);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  return SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::Truncate(const SIZE_T offset)
+{
+  if (offset>info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  if (info.format==BTREE_FORMAT_EYTZINGER && HasSplitArrays()) { 
+    // no gaps: the first offset entries keep their ranks
+    RemapEytzinger(offset,offset+1,offset+2);
+  } else {
+    info.numkeys=offset;
+  }
+  Compact();
+  return ERROR_NOERROR;
+}
+
+
+bool BTreeNode::HasBuffer() const
+{
+  return (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) &&
+    info.format==BTREE_FORMAT_BUFFERED;
+}
+
+
+SIZE_T BTreeNode::GetBufferCapacity() const
+{
+  return HasBuffer() ? info.GetNumSlotsAsBuffer() : 0;
+}
+
+
+char * BTreeNode::ResolveMessage(const SIZE_T offset) const
+{
+  if (!HasBuffer()) { 
+    return 0;
+  }
+  assert(offset<info.nummessages);
+  return data+info.GetNumPivotBytes()+offset*(info.keysize+info.valuesize);
+}
+
+
+ERROR_T BTreeNode::GetMessage(const SIZE_T offset, KEY_T &k, VALUE_T &v) const
+{
+  char *p=ResolveMessage(offset);
+
+  if (p==0) { 
+    return ERROR_INSANE;
+  }
+  k.Resize(info.keysize,false);
+  memcpy(k.data,p,info.keysize);
+  v.Resize(info.valuesize,false);
+  memcpy(v.data,p+info.keysize,info.valuesize);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::AppendMessage(const KEY_T &k, const VALUE_T &v)
+{
+  if (!HasBuffer()) { 
+    return ERROR_INSANE;
+  }
+  if (info.nummessages>=GetBufferCapacity()) { 
+    return ERROR_NOSPACE;
+  }
+  if (k.length!=info.keysize || v.length!=info.valuesize) { 
+    return ERROR_SIZE;
+  }
+  info.nummessages++;
+
+  char *p=ResolveMessage(info.nummessages-1);
+
+  memcpy(p,k.data,info.keysize);
+  memcpy(p+info.keysize,v.data,info.valuesize);
+  return ERROR_NOERROR;
+}
+
+
+bool BTreeNode::FindMessage(const KEY_T &k, SIZE_T &offset) const
+{
+  const KeyOrder *order=GetKeyOrder(info.comparator);
+
+  // Newest first, as a later message overrides an earlier one
+  for (offset=info.nummessages;offset-->0;) { 
+    if (order->compare(ResolveMessage(offset),info.keysize,(const char*)k.data,k.length)==0) { 
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void BTreeNode::Compact()
+{
+  if (!HasVarKeys()) { 
+    return;
+  }
+
+  SIZE_T top=info.GetNumDataBytes();
+  char *heap=new char [top];
+  SIZE_T start, keylen, vallen;
+
+  // Repack the live records at the top of a scratch heap, then copy it back.
+  // The slot array never overlaps the repacked heap since it all fit before
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    GetRecord(i,start,keylen,vallen);
+    top-=keylen+vallen;
+    memcpy(heap+top,data+start,keylen+vallen);
+    SetRecord(i,top,keylen,vallen);
+  }
+  memcpy(data+top,heap+top,info.GetNumDataBytes()-top);
+  delete [] heap;
+
+  info.heapstart=top;
+  info.heapused=info.GetNumDataBytes()-top;
+}
+
+
 ostream & BTreeNode::Print(ostream &os) const 
 {
   os << "BTreeNode(info="<<info;
@@ -326,6 +1186,18 @@ ostream & BTreeNode::Print(ostream &os) const
 	os <<ptr;
       } 
       os << ")";
+      if (HasBuffer()) { 
+	VALUE_T val;
+	os << ", messages=(";
+	for (SIZE_T i=0;i<info.nummessages;i++) {
+	  if (i>0) { 
+	    os<<", ";
+	  }
+	  GetMessage(i,key,val);
+	  os<<key<<", "<<val;
+	}
+	os << ")";
+      }
 	
     }
     if (info.nodetype==BTREE_LEAF_NODE) { 
@@ -4,6 +4,7 @@
 #include <iostream>
 #include "global.h"
 #include "block.h"
+#include "keycompare.h"
 
 using namespace std;
 
@@ -13,6 +14,39 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_OVERFLOW_NODE 5
+#define BTREE_HASH_DIRECTORY_NODE 6  // see hashindex.h
+#define BTREE_HASH_BUCKET_NODE 7
+
+// Node formats
+//
+// FIXED     - every key is exactly keysize bytes, laid out as below
+// TRUNCATED - leaves are as in FIXED, but interior nodes hold
+//             variable-length separators that are only as long as
+//             needed to tell the two children apart
+// SLOTTED   - interior nodes as in TRUNCATED, and leaves hold keys and
+//             values of any length up to keysize and valuesize.  Values
+//             too large to keep in the leaf go to chains of overflow blocks
+// SEPARATED - fixed-size keys as in FIXED, but all the keys of a node are
+//             kept together, ahead of all its pointers or values
+// EYTZINGER - as SEPARATED, with the entries in the breadth-first order
+//             of a complete binary search tree rather than in key order
+// BUFFERED  - leaves as in FIXED, but interior nodes give half their
+//             space to a buffer of pending writes (see below)
+#define BTREE_FORMAT_FIXED 0
+#define BTREE_FORMAT_TRUNCATED 1
+#define BTREE_FORMAT_SLOTTED 2
+#define BTREE_FORMAT_SEPARATED 3
+#define BTREE_FORMAT_EYTZINGER 4
+#define BTREE_FORMAT_BUFFERED 5
+
+// Maps a BTREE_FORMAT_* to its name ("fixed", "truncated", ...) and back.
+// FormatFromName returns -1 for a name it does not know
+const char *FormatName(const int format);
+int         FormatFromName(const char *name);
+
+// True if interior nodes of the format hold variable-length separators
+bool        FormatHasVarSeparators(const int format);
 
 
 typedef Block Buffer;
@@ -32,10 +66,19 @@ struct NodeMetadata {
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
   SIZE_T numkeys;
+  int format;
+  int comparator; // one of BTREE_COMPARE_*, the order of the keys
+  int unique;     // nonzero if a key maps to a single value (superblock)
+  SIZE_T heapstart; //meaningful only for nodes with variable-length slots
+  SIZE_T heapused;  //meaningful only for nodes with variable-length slots
+  SIZE_T nummessages; //meaningful only for nodes with a message buffer
 
   SIZE_T GetNumDataBytes() const;
+  SIZE_T GetNumPivotBytes() const;  // of an interior node, for keys and pointers
   SIZE_T GetNumSlotsAsInterior() const;
+  SIZE_T GetNumSlotsAsBuffer() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  SIZE_T GetNumOverflowBytes() const;
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -55,8 +98,86 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *Here this pointer is the next leaf to the right (0 for the last)
+//
+// Interior node with variable-length keys (TRUNCATED and SLOTTED formats):
+//
+// PTR SLOT SLOT SLOT ... free space ... KEY KEY KEY
+//
+// Leaf with variable-length keys and values (SLOTTED format):
+//
+// PTR* SLOT SLOT SLOT ... free space ... KEY VALUE KEY VALUE KEY VALUE
+//
+// The slot array grows up from the start of the data area, and
+// the records grow down from the end of it (heapstart is the lowest
+// record byte in use, heapused the number of live record bytes).  
+// Interior slots carry the pointer to the right of their key, so the 
+// pointer order is the same as in a FIXED interior node.
+// Space freed by shrinking or dropping records is only reclaimed by Compact()
+//
+// Interior node with separate arrays (SEPARATED and EYTZINGER formats):
+//
+// KEY KEY KEY ... PTR PTR PTR ... PTR
+//
+// Leaf with separate arrays:
+//
+// PTR* KEY KEY KEY ... VALUE VALUE VALUE ...
+//
+// Each array has room for as many entries as a FIXED node of the same
+// size.  In EYTZINGER nodes, key i (and the pointer to its left, or its
+// value) sits at the position of the ith smallest node of a complete
+// binary tree of numkeys nodes laid out breadth first, so a search walks
+// down the key array the way it would down the tree.  The last pointer
+// of an interior node always sits in the final slot of the pointer array.
+//
+// Interior node with a message buffer (BUFFERED format):
+//
+// PTR KEY PTR KEY ... PTR ... | KEY VALUE KEY VALUE ...
+//
+// The first half is laid out as a FIXED interior node.  The second half
+// holds nummessages writes that have not yet been carried down to the
+// leaves, oldest first.  Each is a key and the value it is to have from
+// then on, keysize and valuesize bytes as in a FIXED leaf.  A message
+// for a key is always newer than any message for it further down.
+
+struct VarSlot {
+  SIZE_T         ptr;
+  unsigned short offset;
+  unsigned short length;
+};
+
+struct VarLeafSlot {
+  unsigned short offset;
+  unsigned short keylength;
+  unsigned short vallength;
+};
+
+// Set in VarLeafSlot::vallength when the value bytes are an OverflowRef
+#define BTREE_OVERFLOW_FLAG 0x8000
+
+//
+// Overflow block:
+//
+// PTR BYTES
+//
+// Holds the next piece of a value that was too large for its leaf.
+// PTR is the next block of the chain (0 ends it), and numkeys is the
+// number of value bytes held here.
+//
+// The leaf keeps this in place of the value:
 
+struct OverflowRef {
+  SIZE_T block;       // first block of the chain
+  SIZE_T length;      // length of the whole value
+  SIZE_T contiguous;  // nonzero if the chain is on consecutive blocks
+};
+
+// Largest block that a node with variable-length slots can address
+#define BTREE_MAX_VAR_BLOCKSIZE 65535
+
+// Nodes with variable-length slots are split by bytes, which only keeps
+// both halves below full if a node holds this many of its largest entries
+#define BTREE_MIN_VAR_ENTRIES 4
 
 struct BTreeNode {
   NodeMetadata  info;
@@ -74,17 +195,36 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+            int format=BTREE_FORMAT_FIXED, int comparator=BTREE_COMPARE_BYTES);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
+  ERROR_T Unserialize(const Block &block);
 
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  char *ResolveSlot(const SIZE_T offset) const; // Gives a pointer to the ith slot (variable-length keys only)
+
+  bool   HasVarKeys() const; // True if the keys of this node live in a slotted heap
+  SIZE_T GetKeyLength(const SIZE_T offset) const; // Length of the ith key
+  SIZE_T GetValLength(const SIZE_T offset) const; // Length of the ith value (leaf)
+  SIZE_T GetEntrySize(const SIZE_T offset) const; // Bytes taken up by the ith key and its pointer or value
+  SIZE_T GetMaxEntrySize() const; // Bytes taken up by the largest possible entry
+  SIZE_T GetFreeBytes() const; // Bytes still available, counting space Compact() would reclaim
+  bool   IsFull() const; // True if the largest possible entry might no longer fit
+  SIZE_T GetMaxInlineValue() const; // Longest value kept in the leaf itself (SLOTTED leaf)
+
+  bool    IsOverflowVal(const SIZE_T offset) const; // True if the ith value lives in overflow blocks (leaf)
+  ERROR_T GetOverflowVal(const SIZE_T offset, OverflowRef &ref) const; // Gives the reference held for the ith value
+  ERROR_T SetOverflowVal(const SIZE_T offset, const OverflowRef &ref); // Makes the ith value a reference
+  int    CompareKey(const SIZE_T offset, const KEY_T &k) const; // <0, 0, >0 as the ith key is <, ==, > k
+  SIZE_T LowerBound(const KEY_T &k) const; // Offset of the first key >= k, or numkeys if none
+  SIZE_T UpperBound(const KEY_T &k) const; // Offset of the first key > k, or numkeys if none
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
   ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
@@ -97,6 +237,55 @@ struct BTreeNode {
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // Insert a new key at offset, shifting the keys at and above it up by one.
+  // The new pointer becomes pointer offset+1 (interior), the new value 
+  // becomes value offset (leaf).  The caller must have checked for room.
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p);
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v);
+
+  // Drop every key from offset up (and, on interior nodes, the pointers
+  // to their right), leaving offset keys behind
+  ERROR_T Truncate(const SIZE_T offset);
+
+  // Squeeze the unused space out of the record heap
+  void    Compact();
+
+  // Helpers for nodes with separate key and pointer/value arrays.
+  // SetFormat moves such a node between the SEPARATED and EYTZINGER
+  // layouts
+  bool    HasSplitArrays() const;
+  SIZE_T  GetNumSlots() const;
+  SIZE_T  GetPosition(const SIZE_T offset) const;
+  SIZE_T  Search(const KEY_T &k, const bool upper) const;
+  void    SetFormat(const int format);
+  // Lays an EYTZINGER node out again for newn entries in one pass,
+  // keeping entries in key order but leaving a hole at rank keygap of
+  // the keys and entrygap of the pointers or values (a gap past newn
+  // leaves none): inserting opens the holes, truncating drops the tail
+  void    RemapEytzinger(const SIZE_T newn, const SIZE_T keygap, const SIZE_T entrygap);
+
+  // Helpers for nodes with variable-length slots
+  SIZE_T  GetSlotSize() const;
+  SIZE_T  GetContiguousFreeBytes() const;
+  void    GetRecord(const SIZE_T offset, SIZE_T &start, SIZE_T &keylen, SIZE_T &vallen) const;
+  void    SetRecord(const SIZE_T offset, const SIZE_T start, const SIZE_T keylen, const SIZE_T vallen);
+  void    SetOverflowFlag(const SIZE_T offset, const bool overflow);
+  ERROR_T WriteRecord(const SIZE_T offset,
+		      const char *key, const SIZE_T keylen,
+		      const char *val, const SIZE_T vallen);
+  ERROR_T InsertRecord(const SIZE_T offset,
+		       const KEY_T &k,
+		       const char *val, const SIZE_T vallen,
+		       const SIZE_T ptr);
+
+  // Helpers for nodes with a message buffer
+  bool    HasBuffer() const;
+  SIZE_T  GetBufferCapacity() const; // Messages the buffer can hold
+  char   *ResolveMessage(const SIZE_T offset) const; // Gives a pointer to the ith message
+  ERROR_T GetMessage(const SIZE_T offset, KEY_T &k, VALUE_T &v) const;
+  ERROR_T AppendMessage(const KEY_T &k, const VALUE_T &v); // Adds the newest message
+  bool    FindMessage(const KEY_T &k, SIZE_T &offset) const; // Finds the newest message for k
+
   ostream &Print(ostream &rhs) const;
 };
 
@@ -0,0 +1,300 @@
+#ifndef _btree_fixed
+#define _btree_fixed
+
+#include <stdint.h>
+#include <string.h>
+
+#include "btree.h"
+
+//
+// BTreeIndexT is a BTreeIndex whose key and value sizes are known at
+// compile time.  It works on the same on-disk FIXED format as the
+// generic class, but Lookup, Update and Insert read the node blocks in
+// place, with constant entry offsets and fixed-size copies and compares
+// the compiler can inline.  Anything that changes the shape of the tree
+// (an insert that fills a leaf, the first insert into an empty root) is
+// handed to the generic code, so both produce the same tree, as are all
+// writes while there are snapshots.  The index is always a unique one.
+//
+// Compare orders two keys of KeySize bytes.  Its comparator member names
+// the BTREE_COMPARE_* order it implements, which the index is built with.
+//
+
+template <SIZE_T KeySize>
+struct BytewiseKeyCompare {
+  static const int comparator=BTREE_COMPARE_BYTES;
+  int operator()(const BYTE_T *lhs, const BYTE_T *rhs) const {
+    return memcmp(lhs,rhs,KeySize);
+  }
+};
+
+// The bytewise order of 8 byte keys, as a single 64-bit compare
+struct BigEndianU64KeyCompare {
+  static const int comparator=BTREE_COMPARE_BYTES;
+  int operator()(const BYTE_T *lhs, const BYTE_T *rhs) const {
+    uint64_t l, r;
+    memcpy(&l,lhs,sizeof(l));
+    memcpy(&r,rhs,sizeof(r));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    l=__builtin_bswap64(l);
+    r=__builtin_bswap64(r);
+#endif
+    return (l>r)-(l<r);
+  }
+};
+
+// Keys that are integers in the byte order of the machine
+template <typename T, int Comparator>
+struct IntegerKeyCompare {
+  static const int comparator=Comparator;
+  int operator()(const BYTE_T *lhs, const BYTE_T *rhs) const {
+    T l, r;
+    memcpy(&l,lhs,sizeof(l));
+    memcpy(&r,rhs,sizeof(r));
+    return (l>r)-(l<r);
+  }
+};
+
+typedef IntegerKeyCompare<uint32_t,BTREE_COMPARE_U32> U32KeyCompare;
+typedef IntegerKeyCompare<uint64_t,BTREE_COMPARE_U64> U64KeyCompare;
+typedef IntegerKeyCompare<int64_t,BTREE_COMPARE_I64>  I64KeyCompare;
+
+
+template <SIZE_T KeySize, SIZE_T ValueSize, class Compare=BytewiseKeyCompare<KeySize> >
+class BTreeIndexT : public BTreeIndex {
+ protected:
+  // Offsets within a node block, which is the NodeMetadata and then the data
+  static constexpr SIZE_T DataStart=sizeof(NodeMetadata);
+  static constexpr SIZE_T InteriorEntry=sizeof(SIZE_T)+KeySize;
+  static constexpr SIZE_T LeafEntry=KeySize+ValueSize;
+
+  static constexpr SIZE_T InteriorPtr(const SIZE_T i) { return DataStart+i*InteriorEntry; }
+  static constexpr SIZE_T InteriorKey(const SIZE_T i) { return InteriorPtr(i)+sizeof(SIZE_T); }
+  static constexpr SIZE_T LeafKey(const SIZE_T i) { return DataStart+sizeof(SIZE_T)+i*LeafEntry; }
+  static constexpr SIZE_T LeafVal(const SIZE_T i) { return LeafKey(i)+KeySize; }
+
+  Block block;  // the node being worked on
+
+  // Offset of the first of n keys, stride bytes apart, that is >= key
+  static SIZE_T LowerBound(const BYTE_T *first, const SIZE_T stride, const SIZE_T n,
+			   const BYTE_T *key)
+  {
+    Compare cmp;
+    SIZE_T lo=0, hi=n;
+    while (lo<hi) {
+      SIZE_T mid=(lo+hi)/2;
+      if (cmp(first+mid*stride,key)<0) {
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    return lo;
+  }
+
+  // Reads the leaf that key belongs in into block, and gives its number
+  // and metadata.  ERROR_NONEXISTENT means the tree is still empty.
+  // Interior nodes in the pinned levels are routed through in memory,
+  // following swizzled slots from one to the next
+  ERROR_T FindLeaf(const BYTE_T *key, SIZE_T &node, NodeMetadata &info)
+  {
+    PinnedNode *parent=0, *pin;
+    SIZE_T depth, slot=0;
+    const BYTE_T *entries;  // the node after its metadata
+    ERROR_T rc;
+
+    node=superblock.info.rootnode;
+    for (;;) {
+      if ((pin=FindPinned(node,parent,slot,depth))) {
+	info=pin->node.info;
+	entries=(const BYTE_T *)pin->node.data;
+      } else {
+	if ((rc=buffercache->ReadBlock(node,block))) {
+	  return rc;
+	}
+	memcpy(&info,block.data,sizeof(info));
+	entries=block.data+DataStart;
+	if (depth<pinlevels && info.nodetype!=BTREE_LEAF_NODE) {
+	  BTreeNode b;
+	  b.Unserialize(block);
+	  pin=Pin(node,b,depth,parent,slot);
+	  entries=(const BYTE_T *)pin->node.data;
+	}
+      }
+      switch (info.nodetype) {
+      case BTREE_LEAF_NODE:
+	return ERROR_NOERROR;
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (info.numkeys==0) {
+	  return ERROR_NONEXISTENT;
+	}
+	slot=LowerBound(entries+(InteriorKey(0)-DataStart),InteriorEntry,info.numkeys,key);
+	memcpy(&node,entries+(InteriorPtr(slot)-DataStart),sizeof(SIZE_T));
+	parent=pin;
+	break;
+      default:
+	return ERROR_INSANE;
+      }
+    }
+  }
+
+  // True if key is in the leaf in block.  Either way, offset is
+  // where it is or would go
+  bool FindInLeaf(const BYTE_T *key, const NodeMetadata &info, SIZE_T &offset) const
+  {
+    offset=LowerBound(block.data+LeafKey(0),LeafEntry,info.numkeys,key);
+    return offset<info.numkeys && Compare()(block.data+LeafKey(offset),key)==0;
+  }
+
+ public:
+  BTreeIndexT(BufferCache *cache) :
+    BTreeIndex(KeySize,ValueSize,cache,true,BTREE_FORMAT_FIXED,Compare::comparator)
+  {}
+
+  ERROR_T Attach(const SIZE_T initblock, const bool create=false)
+  {
+    ERROR_T rc=BTreeIndex::Attach(initblock,create);
+
+    if (rc) {
+      return rc;
+    }
+    if (superblock.info.keysize!=KeySize || superblock.info.valuesize!=ValueSize ||
+	superblock.info.format!=BTREE_FORMAT_FIXED ||
+	superblock.info.comparator!=Compare::comparator || !superblock.info.unique) {
+      return ERROR_NOTANINDEX;
+    }
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T Lookup(const BYTE_T *key, BYTE_T *value)
+  {
+    SIZE_T node, offset;
+    NodeMetadata info;
+    ERROR_T rc;
+
+    if (FilterRulesOut(key,KeySize)) {
+      return ERROR_NONEXISTENT;
+    }
+    if ((rc=FindLeaf(key,node,info))) {
+      return rc;
+    }
+    if (!FindInLeaf(key,info,offset)) {
+      FilterMissed();
+      return ERROR_NONEXISTENT;
+    }
+    memcpy(value,block.data+LeafVal(offset),ValueSize);
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T Update(const BYTE_T *key, const BYTE_T *value)
+  {
+    SIZE_T node, offset;
+    NodeMetadata info;
+    ERROR_T rc;
+
+    // A leaf a snapshot reads must be copied before it is changed
+    if (HasSnapshots()) {
+      return UpdateGeneric(key,value);
+    }
+    if (FilterRulesOut(key,KeySize)) {
+      return ERROR_NONEXISTENT;
+    }
+    if ((rc=FindLeaf(key,node,info))) {
+      return rc;
+    }
+    if (!FindInLeaf(key,info,offset)) {
+      FilterMissed();
+      return ERROR_NONEXISTENT;
+    }
+    memcpy(block.data+LeafVal(offset),value,ValueSize);
+    return buffercache->WriteBlock(node,block);
+  }
+
+  ERROR_T Insert(const BYTE_T *key, const BYTE_T *value)
+  {
+    SIZE_T node, offset;
+    NodeMetadata info;
+
+    if (HasSnapshots()) {
+      return InsertGeneric(key,value);
+    }
+
+    ERROR_T rc=FindLeaf(key,node,info);
+
+    if (rc==ERROR_NONEXISTENT) {
+      return InsertGeneric(key,value);
+    }
+    if (rc) {
+      return rc;
+    }
+    if (FindInLeaf(key,info,offset)) {
+      return ERROR_CONFLICT;
+    }
+    // A leaf left full must be split, which is the generic code's business
+    if (info.numkeys+1>=info.GetNumSlotsAsLeaf()) {
+      return InsertGeneric(key,value);
+    }
+
+    memmove(block.data+LeafKey(offset+1),block.data+LeafKey(offset),
+	    (info.numkeys-offset)*LeafEntry);
+    memcpy(block.data+LeafKey(offset),key,KeySize);
+    memcpy(block.data+LeafVal(offset),value,ValueSize);
+    info.numkeys++;
+    memcpy(block.data,&info,sizeof(info));
+    if ((rc=buffercache->WriteBlock(node,block))) {
+      return rc;
+    }
+    return FilterAdd(key,KeySize);
+  }
+
+  // The generic interface, which takes the fast path for keys and
+  // values of the right size
+  virtual ERROR_T Lookup(const KEY_T &key, VALUE_T &value)
+  {
+    if (key.length!=KeySize) {
+      return BTreeIndex::Lookup(key,value);
+    }
+    value.Resize(ValueSize,false);
+    return Lookup(key.data,value.data);
+  }
+
+  virtual ERROR_T Update(const KEY_T &key, const VALUE_T &value)
+  {
+    if (key.length!=KeySize || value.length!=ValueSize) {
+      return BTreeIndex::Update(key,value);
+    }
+    return Update(key.data,value.data);
+  }
+
+  virtual ERROR_T Insert(const KEY_T &key, const VALUE_T &value)
+  {
+    if (key.length!=KeySize || value.length!=ValueSize) {
+      return BTreeIndex::Insert(key,value);
+    }
+    return Insert(key.data,value.data);
+  }
+
+ protected:
+  ERROR_T InsertGeneric(const BYTE_T *key, const BYTE_T *value)
+  {
+    KEY_T k(KeySize);
+    VALUE_T v(ValueSize);
+
+    memcpy(k.data,key,KeySize);
+    memcpy(v.data,value,ValueSize);
+    return BTreeIndex::Insert(k,v);
+  }
+
+  ERROR_T UpdateGeneric(const BYTE_T *key, const BYTE_T *value)
+  {
+    KEY_T k(KeySize);
+    VALUE_T v(ValueSize);
+
+    memcpy(k.data,key,KeySize);
+    memcpy(v.data,value,ValueSize);
+    return BTreeIndex::Update(k,v);
+  }
+};
+
+#endif
@@ -1,10 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "btree.h"
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [format] [comparator] [duplicates]\n";
 }
 
 
@@ -13,8 +14,11 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  int format=BTREE_FORMAT_FIXED;
+  int comparator=BTREE_COMPARE_BYTES;
+  bool unique=true;
 
-  if (argc!=5) { 
+  if (argc<5 || argc>8) { 
     usage();
     return -1;
   }
@@ -23,10 +27,22 @@ int main(int argc, char **argv)
   cachesize=atoi(argv[2]);
   keysize=atoi(argv[3]);
   valuesize=atoi(argv[4]);
+  for (int i=5;i<argc;i++) { 
+    if (!strcmp(argv[i],"duplicates")) { 
+      unique=false;
+    } else if (FormatFromName(argv[i])>=0) { 
+      format=FormatFromName(argv[i]);
+    } else if (KeyOrderFromName(argv[i])>=0) { 
+      comparator=KeyOrderFromName(argv[i]);
+    } else {
+      usage();
+      return -1;
+    }
+  }
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,unique,format,comparator);
   
   ERROR_T rc;
 
@@ -56,6 +72,11 @@ int main(int argc, char **argv)
     cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
     cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
     cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << "numhits         = "<<cache.GetNumHits()<<endl;
+    cerr << "nummisses       = "<<cache.GetNumMisses()<<endl;
+    cerr << "numevictions    = "<<cache.GetNumEvictions()<<endl;
+    cerr << "numwritebacks   = "<<cache.GetNumWritebacks()<<endl;
+    cerr << "numsplits       = "<<btree.GetNumSplits()<<endl;
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
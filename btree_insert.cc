@@ -1,9 +1,17 @@
 #include <stdlib.h>
 #include "btree.h"
+#include "session.h"
 
 void usage() 
 {
-  cerr << "usage: btree_insert filestem cachesize key value\n";
+  cerr << "usage: btree_insert filestem cachesize [key value]\n";
+  cerr << "  with no key and value, inserts each \"key value\" line of stdin\n";
+}
+
+
+static ERROR_T Insert(BTreeIndex &b, const KEY_T &k, const VALUE_T &v, VALUE_T &)
+{
+  return b.Insert(k,v);
 }
 
 
@@ -14,15 +22,15 @@ int main(int argc, char **argv)
   SIZE_T superblocknum;
   char *key, *value;
 
-  if (argc!=5) { 
+  if (argc!=5 && argc!=3) { 
     usage();
     return -1;
   }
 
   filestem=argv[1];
   cachesize=atoi(argv[2]);
-  key=argv[3];
-  value=argv[4];
+  key=argc==5 ? argv[3] : 0;
+  value=argc==5 ? argv[4] : 0;
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
@@ -40,10 +48,14 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    if ((rc=btree.Insert(KEY_T(key),VALUE_T(value)))!=ERROR_NOERROR) { 
-      cerr <<"Can't insert into index due to error "<<rc<<endl;
+    if (key) {
+      if ((rc=btree.Insert(KEY_T(key),VALUE_T(value)))!=ERROR_NOERROR) { 
+        cerr <<"Can't insert into index due to error "<<rc<<endl;
+      } else {
+        cerr <<"Insert succeeded\n";
+      }
     } else {
-      cerr <<"Insert succeeded\n";
+      RunKeyLines(stdin,cout,btree,Insert,false,"inserts");
     }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
@@ -61,6 +73,11 @@ int main(int argc, char **argv)
     cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
     cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
     cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << "numhits         = "<<cache.GetNumHits()<<endl;
+    cerr << "nummisses       = "<<cache.GetNumMisses()<<endl;
+    cerr << "numevictions    = "<<cache.GetNumEvictions()<<endl;
+    cerr << "numwritebacks   = "<<cache.GetNumWritebacks()<<endl;
+    cerr << "numsplits       = "<<btree.GetNumSplits()<<endl;
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
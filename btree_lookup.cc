@@ -1,9 +1,17 @@
 #include <stdlib.h>
 #include "btree.h"
+#include "session.h"
 
 void usage() 
 {
-  cerr << "usage: btree_lookup filestem cachesize key\n";
+  cerr << "usage: btree_lookup filestem cachesize [key]\n";
+  cerr << "  with no key, looks up the key on each line of stdin\n";
+}
+
+
+static ERROR_T Lookup(BTreeIndex &b, const KEY_T &k, const VALUE_T &, VALUE_T &result)
+{
+  return b.Lookup(k,result);
 }
 
 
@@ -14,14 +22,14 @@ int main(int argc, char **argv)
   SIZE_T superblocknum;
   char *key;
 
-  if (argc!=4) { 
+  if (argc!=4 && argc!=3) { 
     usage();
     return -1;
   }
 
   filestem=argv[1];
   cachesize=atoi(argv[2]);
-  key=argv[3];
+  key=argc==4 ? argv[3] : 0;
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
@@ -41,11 +49,15 @@ int main(int argc, char **argv)
   } else {
     cerr << "Index attached!"<<endl;
     VALUE_T val;
-    if ((rc=btree.Lookup(KEY_T(key),val))!=ERROR_NOERROR) { 
-      cerr <<"Lookup failed: error "<<rc<<endl;
+    if (key) {
+      if ((rc=btree.Lookup(KEY_T(key),val))!=ERROR_NOERROR) { 
+        cerr <<"Lookup failed: error "<<rc<<endl;
+      } else {
+        cerr <<"Lookup succeeded\n";
+        cout << val;
+      }
     } else {
-      cerr <<"Lookup succeeded\n";
-      cout << val;
+      RunKeyLines(stdin,cout,btree,Lookup,true,"lookups");
     }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
@@ -63,6 +75,11 @@ int main(int argc, char **argv)
     cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
     cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
     cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << "numhits         = "<<cache.GetNumHits()<<endl;
+    cerr << "nummisses       = "<<cache.GetNumMisses()<<endl;
+    cerr << "numevictions    = "<<cache.GetNumEvictions()<<endl;
+    cerr << "numwritebacks   = "<<cache.GetNumWritebacks()<<endl;
+    cerr << "numsplits       = "<<btree.GetNumSplits()<<endl;
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
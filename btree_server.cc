@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <map>
+
+#include "session.h"
+
+using namespace std;
+
+//
+// Serves one index to any number of local clients over a Unix domain
+// socket, in the text protocol of sim.  The disk, the buffer cache and
+// the index stay attached for as long as the server runs, so a client
+// pays nothing to attach, and finds the cache as the clients before it
+// left it.
+//
+// A single thread runs an epoll loop over the connections, since the
+// index and the cache are not safe to share between threads.  A client
+// may send many requests without waiting (pipelining): each read runs
+// every whole line that has arrived, in order, and their replies go
+// back in one write, or as much of one as the socket takes.  A
+// connection gets one read per turn of the loop, so a client that keeps
+// sending does not starve the others, and is not read from while more
+// than MAX_PENDING bytes of its replies wait for it to read them.
+//
+// The first INIT sets up the index; INIT fails while there is one.
+// DEINIT only ends the client's connection, after an "OK".  The index is
+// detached, and the disk written back, when the server is told to stop
+// with SIGINT or SIGTERM.
+//
+
+// Longest request line a client may send
+#define MAX_LINE (1<<20)
+// Most reply bytes a connection may leave unread before we stop reading it
+#define MAX_PENDING (1<<20)
+
+struct Connection {
+  string in;      // what has arrived past the last whole line
+  string out;     // replies not yet written
+  bool   closing; // close once out is written
+};
+
+static volatile sig_atomic_t stop=0;
+
+static void Stop(int)
+{
+  stop=1;
+}
+
+
+void usage()
+{
+  cerr << "usage: btree_server filestem cachesize socketpath\n";
+}
+
+
+static void Watch(const int epfd, const int op, const int fd, const bool reading,
+		  const bool writing)
+{
+  struct epoll_event ev;
+
+  memset(&ev,0,sizeof(ev));
+  ev.events=(reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0);
+  ev.data.fd=fd;
+  epoll_ctl(epfd,op,fd,&ev);
+}
+
+
+// Writes what the socket takes; false if the connection is broken
+static bool Drain(const int fd, Connection &c)
+{
+  while (!c.out.empty()) {
+    ssize_t n=write(fd,c.out.data(),c.out.size());
+    if (n<0) {
+      return errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR;
+    }
+    c.out.erase(0,n);
+  }
+  return true;
+}
+
+
+// Runs the whole lines that have arrived, collecting their replies
+static void RunLines(Session &s, Connection &c)
+{
+  ostringstream replies;
+  string::size_type start=0, end;
+
+  while (!c.closing && (end=c.in.find('\n',start))!=string::npos) {
+    string line=c.in.substr(start,end-start);
+    const char *p=line.c_str();
+    string action=NextWord(p);
+    start=end+1;
+    if (action=="DEINIT") {
+      replies << "OK\n";
+      c.closing=true;
+    } else if (action=="INIT" && s.GetIndex()) {
+      replies << "FAIL\n";
+      cerr << "The index is already set up\n";
+    } else {
+      s.Execute(line.c_str(),replies);
+    }
+  }
+  c.in.erase(0,start);
+  c.out+=replies.str();
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc!=4) {
+    usage();
+    return 1;
+  }
+
+  char *filestem=argv[1];
+  SIZE_T cachesize=atoi(argv[2]);
+  char *path=argv[3];
+  map<int,Connection> conns;
+  struct sockaddr_un addr;
+  struct epoll_event events[64];
+  char buf[65536];
+  int listenfd, epfd;
+  ERROR_T rc;
+
+  if (strlen(path)>=sizeof(addr.sun_path)) {
+    cerr << "Socket path is too long\n";
+    return 1;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  Session s(&cache);
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach cache due to error "<<rc<<"\n";
+    return -1;
+  }
+
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path,path);
+  unlink(path);
+  if ((listenfd=socket(AF_UNIX,SOCK_STREAM | SOCK_NONBLOCK,0))<0 ||
+      bind(listenfd,(struct sockaddr *)&addr,sizeof(addr))<0 ||
+      listen(listenfd,SOMAXCONN)<0 ||
+      (epfd=epoll_create1(0))<0) {
+    cerr << "Can't listen on "<<path<<": "<<strerror(errno)<<"\n";
+    return -1;
+  }
+
+  signal(SIGINT,Stop);
+  signal(SIGTERM,Stop);
+  signal(SIGPIPE,SIG_IGN);
+  Watch(epfd,EPOLL_CTL_ADD,listenfd,true,false);
+
+  while (!stop) {
+    int n=epoll_wait(epfd,events,sizeof(events)/sizeof(events[0]),-1);
+    if (n<0) {
+      if (errno==EINTR) {
+	continue;
+      }
+      cerr << "epoll_wait failed: "<<strerror(errno)<<"\n";
+      break;
+    }
+    for (int i=0;i<n;i++) {
+      int fd=events[i].data.fd;
+
+      if (fd==listenfd) {
+	int c;
+	while ((c=accept4(listenfd,0,0,SOCK_NONBLOCK))>=0) {
+	  conns[c].closing=false;
+	  Watch(epfd,EPOLL_CTL_ADD,c,true,false);
+	}
+	continue;
+      }
+
+      Connection &c=conns[fd];
+      if (!c.closing && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+	// One buffer at a time; epoll reports the rest next time around
+	ssize_t got=read(fd,buf,sizeof(buf));
+	if (got>0) {
+	  c.in.append(buf,got);
+	}
+	// At the end the client is done sending, but may still read its replies
+	bool eof = got==0 || (got<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR);
+	RunLines(s,c);
+	c.closing = c.closing || eof;
+	// What is left is the partial line
+	if (c.in.size()>MAX_LINE) {
+	  cerr << "Request line too long, closing connection\n";
+	  c.closing=true;
+	}
+      }
+      if (!Drain(fd,c) || (c.closing && c.out.empty())) {
+	epoll_ctl(epfd,EPOLL_CTL_DEL,fd,0);
+	close(fd);
+	conns.erase(fd);
+      } else {
+	// Wait for the socket to take the rest of the replies, and hold off
+	// on new requests while too many of them are waiting
+	Watch(epfd,EPOLL_CTL_MOD,fd,!c.closing && c.out.size()<MAX_PENDING,
+	      !c.out.empty());
+      }
+    }
+  }
+
+  for (map<int,Connection>::iterator i=conns.begin();i!=conns.end();++i) {
+    close(i->first);
+  }
+  close(listenfd);
+  close(epfd);
+  unlink(path);
+
+  if (s.GetIndex() && !s.Deinit()) {
+    return -1;
+  }
+  return 0;
+}
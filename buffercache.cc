@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "buffercache.h"
 
 ERROR_T BufferCache::CheckDeleteOldest()
@@ -33,11 +35,13 @@ ERROR_T BufferCache::CheckDeleteOldest()
 			 reqtime);
       curtime+=reqtime;
       diskwrites++;
+      writebacks++;
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
     blockmap.erase(oldestptr);
+    evictions++;
   }
   return ERROR_NOERROR;
 }
@@ -46,7 +50,8 @@ BufferCache::BufferCache(DiskSystem *d,
 			 SIZE_T cs) : 
    disk(d), cachesize(cs), curtime(0),
    allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
+   diskreads(0), diskwrites(0),
+   hits(0), misses(0), evictions(0), writebacks(0)
 {}
 
 
@@ -67,24 +72,43 @@ ERROR_T BufferCache::Attach()
 ERROR_T BufferCache::Detach()
 {
   // write out all of our data and then throw it away
+  ERROR_T rc=Flush();
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  blockmap.clear();
+  // and the allocations made while we were attached
+  return disk->FlushBitMap();
+}
+
+
+ERROR_T BufferCache::Flush()
+{
+  vector<pair<double,SIZE_T> > dirty;
+  ERROR_T rc=ERROR_NOERROR, qrc;
+  double reqtime;
 
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
-    if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
+    if ((*i).second.dirty) {
+      dirty.push_back(make_pair((*i).second.lastaccessed,(*i).first));
+    }
+  }
+  // They reach the disk in the order they were last written
+  sort(dirty.begin(),dirty.end());
+  for (SIZE_T i=0;i<dirty.size() && rc==ERROR_NOERROR;i++) {
+    Block &b=blockmap[dirty[i].second];
+    if ((rc=disk->QueueWrite(dirty[i].second,b))==ERROR_NOERROR) {
+      b.dirty=false;
       diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
-	return rc;
-      }
     }
   }
-  blockmap.clear();
-  return ERROR_NOERROR;
+  // What was queued is served even if the rest could not be
+  qrc=disk->ServeQueue(reqtime);
+  curtime+=reqtime;
+  return rc!=ERROR_NOERROR ? rc : qrc;
 }
 
 
@@ -121,6 +145,11 @@ ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
 
+ERROR_T BufferCache::FindFreeRun(const SIZE_T hint, const SIZE_T n, SIZE_T &start) const
+{
+  return disk->FindFreeRun(hint,n,start);
+}
+
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
@@ -139,6 +168,7 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
     outblock=(*b).second;
     (*b).second.lastaccessed=curtime;
     reads++;
+    hits++;
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
@@ -155,6 +185,7 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
 			reqtime);
     curtime+=reqtime;
     diskreads++;
+    misses++;
     if (rc!=ERROR_NOERROR) { 
       return rc;
     } else {
@@ -166,6 +197,60 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
     }
   }
 } 
+
+ERROR_T BufferCache::ReadBlocks(const SIZE_T inblocknum, const SIZE_T numblocks, vector<Block> &outblocks)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  vector<Block> diskblocks;
+  vector<bool> cached(numblocks,false);
+  bool allcached=true;
+  SIZE_T first=outblocks.size();
+  SIZE_T i;
+
+  // Copy out what we have before making room, since making room could 
+  // write back and drop blocks of this very range
+  for (i=0;i<numblocks;i++) { 
+    b = blockmap.find(inblocknum+i);
+    if (b!=blockmap.end()) { 
+      outblocks.push_back((*b).second);
+      (*b).second.lastaccessed=curtime;
+      cached[i]=true;
+      hits++;
+    } else {
+      outblocks.push_back(Block());
+      allcached=false;
+      misses++;
+    }
+    reads++;
+  }
+
+  if (allcached) { 
+    return ERROR_NOERROR;
+  }
+
+  double reqtime;
+  int rc = disk->Read(inblocknum,
+		      numblocks,
+		      diskblocks,
+		      reqtime);
+  curtime+=reqtime;
+  diskreads++;
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  for (i=0;i<numblocks;i++) { 
+    if (!cached[i]) { 
+      CheckDeleteOldest();
+      diskblocks[i].lastaccessed=curtime;
+      diskblocks[i].dirty=false;
+      blockmap[inblocknum+i]=diskblocks[i];
+      outblocks[first+i]=diskblocks[i];
+    }
+  }
+  return ERROR_NOERROR;
+}
+
  
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
@@ -229,6 +314,46 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
   }
 }
   
+SIZE_T BufferCache::GetNumDirty() const
+{
+  SIZE_T n=0;
+  for (map<SIZE_T, Block, cache_compare_lessthan>::const_iterator b=blockmap.begin();
+       b!=blockmap.end();
+       ++b) {
+    n+=(*b).second.dirty;
+  }
+  return n;
+}
+
+
+void BufferCache::ExportMetrics(Metrics &m) const
+{
+  SIZE_T dirty=GetNumDirty();
+
+  m.AddGauge("btree_cache_blocks","Blocks the cache can hold",cachesize);
+  m.AddGauge("btree_cache_blocks_cached","Blocks the cache holds",blockmap.size());
+  m.AddGauge("btree_cache_blocks_dirty","Blocks the cache holds that are not written back",dirty);
+  m.AddCounter("btree_cache_reads_total","Block reads",reads);
+  m.AddCounter("btree_cache_writes_total","Block writes",writes);
+  m.AddCounter("btree_cache_hits_total","Block reads served from the cache",hits);
+  m.AddCounter("btree_cache_misses_total","Block reads that went to the disk",misses);
+  m.AddCounter("btree_cache_evictions_total","Blocks dropped to make room",evictions);
+  m.AddCounter("btree_cache_writebacks_total","Dropped blocks that were dirty and written back",writebacks);
+  m.AddCounter("btree_cache_disk_reads_total","Disk read requests",diskreads);
+  m.AddCounter("btree_cache_disk_writes_total","Disk write requests",diskwrites);
+  m.AddCounter("btree_cache_allocs_total","Blocks allocated",allocs);
+  m.AddCounter("btree_cache_deallocs_total","Blocks deallocated",deallocs);
+  m.AddGauge("btree_cache_hit_ratio","Fraction of block reads served from the cache",
+	     Ratio(hits,hits+misses));
+  m.AddGauge("btree_cache_eviction_ratio","Evictions per block read or written",
+	     Ratio(evictions,reads+writes));
+  m.AddGauge("btree_cache_dirty_ratio","Fraction of the cached blocks that are dirty",
+	     Ratio(dirty,blockmap.size()));
+  m.AddCounter("btree_cache_time_milliseconds_total","Simulated time so far",curtime);
+  disk->ExportMetrics(m);
+}
+
+
 ostream & BufferCache::Print(ostream &os) const
 {
   os << "BufferCache(cachesize="<<cachesize
@@ -240,6 +365,10 @@ ostream & BufferCache::Print(ostream &os) const
      << ", writes="<<writes
      << ", diskreads="<<diskreads
      << ", diskwrites="<<diskwrites
+     << ", hits="<<hits
+     << ", misses="<<misses
+     << ", evictions="<<evictions
+     << ", writebacks="<<writebacks
      << ", blocks = {";
 
   
@@ -29,6 +29,7 @@ class BufferCache {
   map<SIZE_T, Block, cache_compare_lessthan> blockmap;
   double curtime;
   SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  SIZE_T hits, misses, evictions, writebacks;
  protected:
   ERROR_T CheckDeleteOldest();
  public:
@@ -45,6 +46,11 @@ class BufferCache {
   ERROR_T Attach();
   ERROR_T Detach();
 
+  // Writes back every dirty block, leaving it cached and clean.  The
+  // writes are queued at the disk together, so its scheduler orders
+  // them (see DiskSystem::ServeQueue); Detach flushes this way too
+  ERROR_T Flush();
+
   // Number of blocks in the cache
   SIZE_T GetCacheSize() const;
   // Number of bytes per block
@@ -59,12 +65,20 @@ class BufferCache {
   ERROR_T NotifyAllocateBlock(const SIZE_T outblocknum);
   // inblocknum is the block that we just deallocated
   ERROR_T NotifyDeallocateBlock(const SIZE_T inblocknum);
+  // n free blocks in a row near hint, as DiskSystem::FindFreeRun
+  ERROR_T FindFreeRun(const SIZE_T hint, const SIZE_T n, SIZE_T &start) const;
   // check to see if we think the block was allocated
   bool  IsBlockAllocated(const SIZE_T inblocknum);
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
   ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock);
+
+  // Reads numblocks consecutive blocks starting at inblocknum.
+  // Whatever is not already cached is fetched with a single disk request
+  // returns one of ERROR_NOERROR  (zero)
+  // ERROR_NOSUCHBLOCK or other nonzero error codes
+  ERROR_T ReadBlocks(const SIZE_T inblocknum, const SIZE_T numblocks, vector<Block> &outblocks);
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK
@@ -88,6 +102,19 @@ class BufferCache {
   SIZE_T GetNumWrites() const { return writes;}
   SIZE_T GetNumDiskReads() const { return diskreads;}
   SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  // Blocks read from the cache and from the disk, blocks pushed out
+  // to make room, and those of them that were dirty and written back
+  SIZE_T GetNumHits() const { return hits;}
+  SIZE_T GetNumMisses() const { return misses;}
+  SIZE_T GetNumEvictions() const { return evictions;}
+  SIZE_T GetNumWritebacks() const { return writebacks;}
+  // Blocks held now, and those of them not yet written back
+  SIZE_T GetNumCached() const { return blockmap.size();}
+  SIZE_T GetNumDirty() const;
+
+  // Adds the counts above, the hit, eviction and dirty ratios and the
+  // simulated time, then the metrics of the disk
+  void ExportMetrics(Metrics &m) const;
 
   ostream & Print(ostream &os) const;
   
@@ -1,15 +1,78 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <math.h>
+#include <algorithm>
 
 #include "disksystem.h"
 
 
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
+
+static const char *schedulernames[] = { "fifo", "sstf", "scan", "clook" };
+
+#define NUM_SCHEDULERS (sizeof(schedulernames)/sizeof(schedulernames[0]))
+
+const char *SchedulerName(const int scheduler)
+{
+  if (scheduler<0 || (SIZE_T)scheduler>=NUM_SCHEDULERS) {
+    return "unknown";
+  }
+  return schedulernames[scheduler];
+}
+
+int SchedulerFromName(const char *name)
+{
+  for (SIZE_T i=0;i<NUM_SCHEDULERS;i++) {
+    if (!strcmp(name,schedulernames[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+static const char *devicenames[] = { "disk", "ssd", "raid0" };
+
+#define NUM_DEVICES (sizeof(devicenames)/sizeof(devicenames[0]))
+
+const char *DeviceName(const int device)
+{
+  if (device<0 || (SIZE_T)device>=NUM_DEVICES) {
+    return "unknown";
+  }
+  return devicenames[device];
+}
+
+int DeviceFromName(const char *name)
+{
+  for (SIZE_T i=0;i<NUM_DEVICES;i++) {
+    if (!strcmp(name,devicenames[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+// The histogram bucket of n: 0 for 0, 1 for 1, 2 for 2-3, 3 for 4-7, ...
+static SIZE_T BitLength(const SIZE_T n)
+{
+  SIZE_T bits=0;
+  while (bits<32 && (n>>bits)) {
+    bits++;
+  }
+  return bits;
+}
+
+
 static SIZE_T mywrite(FILE *f, const SIZE_T off, const BYTE_T *buf, const int len)
 {
   SIZE_T left=len;
@@ -81,8 +144,12 @@ DiskSystem::DiskSystem(const string &filestem,
 		       const SIZE_T tracks,
 		       const double avgseek,
 		       const double trackseek,
-		       const double rotlat) :
+		       const double rotlat,
+		       const DeviceModel &dev) :
   bitmap(0),
+  bitmapbytes(0),
+  bitmapmapped(false),
+  numallocated(0),
   datafilefd(0),
   configfilefd(0),
   bitmapfilefd(0),
@@ -95,10 +162,36 @@ DiskSystem::DiskSystem(const string &filestem,
   numtracks(tracks),
   last_track(0),
   last_sector(0),
+  device(dev),
+  lastblock(0),
+  scheduler(DISK_SCHED_CLOOK),
+  scanup(true),
+  clock(0),
   averageseeklatency(avgseek),
   trackseeklatency(trackseek),
-  rotationallatency(rotlat)
+  rotationallatency(rotlat),
+  numreads(0),
+  numwrites(0),
+  blocksmoved(0),
+  seektime(0),
+  rotationtime(0),
+  transfertime(0),
+  seektracks(0),
+  numqueued(0),
+  queuewait(0),
+  queuedepthsum(0),
+  flashprograms(0),
+  flasherases(0)
 {
+  const char *sched = getenv("BTREE_DISK_SCHEDULER");
+
+  memset(seekdistances,0,sizeof(seekdistances));
+  memset(queuedepths,0,sizeof(queuedepths));
+  if (sched && SchedulerFromName(sched)>=0) {
+    scheduler=SchedulerFromName(sched);
+  } else if (sched) {
+    cerr << "Unknown disk scheduler "<<sched<<", using "<<SchedulerName(scheduler)<<"\n";
+  }
   if (create) { 
     // Only in this case are the parameters used:
     InitFromInMemoryConfig();
@@ -107,23 +200,46 @@ DiskSystem::DiskSystem(const string &filestem,
   }
 }
 
+// The config is written when the disk is made, and never changes, so
+// only the bitmap may need writing back
 DiskSystem::~DiskSystem()
 {
-  WriteConfig();
-  WriteBitMap();
+  FlushBitMap();
   fclose(configfilefd);
   fclose(bitmapfilefd);
   fclose(datafilefd);
-  delete [] bitmap;
+  if (bitmapmapped) {
+    munmap(bitmap,bitmapbytes);
+  } else {
+    delete [] bitmap;
+  }
 }
 
 ERROR_T DiskSystem::SanityCheckConfig()
 {
-  if (averageseeklatency<=0 || trackseeklatency<=0 || rotationallatency<=0) { 
+  // A RAID0's geometry is that of each of its disks
+  SIZE_T disks = device.type==DISK_DEVICE_RAID0 ? device.disks : 1;
+
+  if (device.type!=DISK_DEVICE_SSD &&
+      (averageseeklatency<=0 || trackseeklatency<=0 || rotationallatency<=0)) { 
+    cerr << "Impossible performance.\n";
+    return ERROR_BADCONFIG;
+  }
+  if (device.type==DISK_DEVICE_SSD &&
+      (device.channels==0 || device.pagereadlatency<=0 || device.pageprogramlatency<=0 ||
+       device.eraselatency<0 || device.pagesperblock==0 || device.writeamplification<1)) {
     cerr << "Impossible performance.\n";
     return ERROR_BADCONFIG;
   }
-  if (numblocks != (numheads*blockspertrack*numtracks)) {
+  if (device.type==DISK_DEVICE_RAID0 && (device.disks==0 || device.stripeblocks==0)) {
+    cerr << "A RAID0 needs disks and a stripe unit.\n";
+    return ERROR_BADCONFIG;
+  }
+  if (device.type<0 || (SIZE_T)device.type>=NUM_DEVICES) {
+    cerr << "Unknown device.\n";
+    return ERROR_BADCONFIG;
+  }
+  if (numblocks != (disks*numheads*blockspertrack*numtracks)) {
     cerr << "Geometry mismatch.\n";
     return ERROR_BADCONFIG;
   }
@@ -157,6 +273,27 @@ ERROR_T DiskSystem::WriteConfig()
   fprintf(configfilefd,"%lf\n",trackseeklatency);
   fprintf(configfilefd,"# rotationalatency\n");
   fprintf(configfilefd,"%lf\n",rotationallatency);
+  fprintf(configfilefd,"# device\n");
+  fprintf(configfilefd,"%s\n",DeviceName(device.type));
+  if (device.type==DISK_DEVICE_SSD) {
+    fprintf(configfilefd,"# channels\n");
+    fprintf(configfilefd,"%u\n",device.channels);
+    fprintf(configfilefd,"# pagereadlatency\n");
+    fprintf(configfilefd,"%lf\n",device.pagereadlatency);
+    fprintf(configfilefd,"# pageprogramlatency\n");
+    fprintf(configfilefd,"%lf\n",device.pageprogramlatency);
+    fprintf(configfilefd,"# eraselatency\n");
+    fprintf(configfilefd,"%lf\n",device.eraselatency);
+    fprintf(configfilefd,"# pagesperblock\n");
+    fprintf(configfilefd,"%u\n",device.pagesperblock);
+    fprintf(configfilefd,"# writeamplification\n");
+    fprintf(configfilefd,"%lf\n",device.writeamplification);
+  } else if (device.type==DISK_DEVICE_RAID0) {
+    fprintf(configfilefd,"# disks\n");
+    fprintf(configfilefd,"%u\n",device.disks);
+    fprintf(configfilefd,"# stripeblocks\n");
+    fprintf(configfilefd,"%u\n",device.stripeblocks);
+  }
   fflush(configfilefd);
 
   return ERROR_NOERROR;
@@ -197,6 +334,38 @@ ERROR_T DiskSystem::ReadConfig()
   GETNEXTVAL;
   PARSEDOUBLE(&rotationallatency);
 
+  // Configs from before there were device models end here, and are disks
+  device = DeviceModel();
+  char *more;
+  do { more=fgets(buf,80,configfilefd); } while (more && buf[0]=='#');
+  if (!more) {
+    return ERROR_NOERROR;
+  }
+  buf[strcspn(buf,"\r\n")]=0;
+  if ((device.type=DeviceFromName(buf))<0) {
+    cerr << "Unknown device "<<buf<<"\n";
+    return ERROR_BADCONFIG;
+  }
+  if (device.type==DISK_DEVICE_SSD) {
+    GETNEXTVAL;
+    PARSEUNSIGNED(&device.channels);
+    GETNEXTVAL;
+    PARSEDOUBLE(&device.pagereadlatency);
+    GETNEXTVAL;
+    PARSEDOUBLE(&device.pageprogramlatency);
+    GETNEXTVAL;
+    PARSEDOUBLE(&device.eraselatency);
+    GETNEXTVAL;
+    PARSEUNSIGNED(&device.pagesperblock);
+    GETNEXTVAL;
+    PARSEDOUBLE(&device.writeamplification);
+  } else if (device.type==DISK_DEVICE_RAID0) {
+    GETNEXTVAL;
+    PARSEUNSIGNED(&device.disks);
+    GETNEXTVAL;
+    PARSEUNSIGNED(&device.stripeblocks);
+  }
+
   return ERROR_NOERROR;
 }
 
@@ -211,6 +380,52 @@ ERROR_T DiskSystem::WriteBitMap()
     cerr << "Can't write bitmap file\n";
     return ERROR_IMPLBUG;
   }
+  fflush(bitmapfilefd);
+  dirtychunk.assign(dirtychunk.size(),false);
+  dirtychunks.clear();
+  return ERROR_NOERROR;
+}
+
+
+void DiskSystem::MarkBitMapDirty(const SIZE_T block)
+{
+  SIZE_T chunk=block/8/DISKSYSTEM_BITMAP_CHUNK;
+
+  if (!dirtychunk[chunk]) {
+    dirtychunk[chunk]=true;
+    dirtychunks.push_back(chunk);
+  }
+}
+
+
+ERROR_T DiskSystem::FlushBitMap()
+{
+  SIZE_T start, end;
+
+  if (dirtychunks.empty()) {
+    return ERROR_NOERROR;
+  }
+  // A mapped bitmap is already in the file
+  if (!bitmapmapped) {
+    sort(dirtychunks.begin(),dirtychunks.end());
+    // Each run of adjacent chunks is written in one piece
+    for (SIZE_T i=0;i<dirtychunks.size();i=end) {
+      for (end=i+1;end<dirtychunks.size() && dirtychunks[end]==dirtychunks[end-1]+1;end++) {
+      }
+      start=dirtychunks[i]*DISKSYSTEM_BITMAP_CHUNK;
+      SIZE_T len=MIN(dirtychunks[end-1]*DISKSYSTEM_BITMAP_CHUNK+DISKSYSTEM_BITMAP_CHUNK,
+		     bitmapbytes)-start;
+      if (mywrite(bitmapfilefd,start,bitmap+start,len)!=len) {
+	cerr << "Can't write bitmap file\n";
+	return ERROR_IMPLBUG;
+      }
+    }
+    fflush(bitmapfilefd);
+  }
+  for (SIZE_T i=0;i<dirtychunks.size();i++) {
+    dirtychunk[dirtychunks[i]]=false;
+  }
+  dirtychunks.clear();
   return ERROR_NOERROR;
 }
 
@@ -232,6 +447,26 @@ ERROR_T DiskSystem::ReadBitMap()
 }
 
 
+// Maps the bitmap file in place of reading it; ERROR_NOFILE if it can't
+// be, for the caller to read it instead
+ERROR_T DiskSystem::MapBitMap()
+{
+  struct stat s;
+  void *m;
+
+  if (fstat(fileno(bitmapfilefd),&s)<0 || (SIZE_T)s.st_size<bitmapbytes) {
+    return ERROR_NOFILE;
+  }
+  m=mmap(0,bitmapbytes,PROT_READ | PROT_WRITE,MAP_SHARED,fileno(bitmapfilefd),0);
+  if (m==MAP_FAILED) {
+    return ERROR_NOFILE;
+  }
+  bitmap=(BYTE_T *)m;
+  bitmapmapped=true;
+  return ERROR_NOERROR;
+}
+
+
 
 ERROR_T DiskSystem::InitFromConfigFile()
 {
@@ -256,6 +491,9 @@ ERROR_T DiskSystem::InitFromConfigFile()
   if (rc) { 
     return rc;
   }
+  membertracks.assign(device.disks,0);
+  membersectors.assign(device.disks,0);
+  channelfree.assign(device.channels,0);
 
   if (datafilefd) { fclose(datafilefd);}
 
@@ -270,12 +508,20 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return ERROR_NOFILE;
   }
   
-  rc = ReadBitMap();
+  bitmapbytes = numblocks / 8 + (numblocks%8 != 0);
+  dirtychunk.assign(bitmapbytes/DISKSYSTEM_BITMAP_CHUNK+1,false);
+
+  const char *map = getenv("BTREE_BITMAP_MMAP");
+  if (!map || !strcmp(map,"0") || MapBitMap()!=ERROR_NOERROR) {
+    rc = ReadBitMap();
+  }
 
   if (rc) { 
     return rc;
   }
 
+  BuildSummary();
+
   return ERROR_NOERROR;
 }
 
@@ -291,6 +537,9 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
   if (rc) { 
     return rc;
   }
+  membertracks.assign(device.disks,0);
+  membersectors.assign(device.disks,0);
+  channelfree.assign(device.channels,0);
 
   // it should be the case that none of the files exist
   // except for the data file, since we may be using a chunk of it
@@ -327,8 +576,11 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
   SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
   
   bitmap = new BYTE_T [numbitmapbytes];
+  bitmapbytes = numbitmapbytes;
+  dirtychunk.assign(bitmapbytes/DISKSYSTEM_BITMAP_CHUNK+1,false);
 
   memset(bitmap,0,numbitmapbytes);
+  BuildSummary();
 
   // create the bitmap file and write out the bitmap
 
@@ -373,7 +625,24 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
 // Note, this assumes disk is kept continously busy
 // or that time does not advance except during a disk op
 //
-double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock) 
+double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock, const bool write)
+{
+  double t;
+
+  if (device.type==DISK_DEVICE_SSD) {
+    t=ModelSSDAccess(offblock,numblock,write);
+  } else if (device.type==DISK_DEVICE_RAID0) {
+    t=ModelRAIDAccess(offblock,numblock);
+  } else {
+    t=ModelDiskAccess(last_track,last_sector,offblock,numblock);
+  }
+  lastblock=offblock+numblock-1;
+  return t;
+}
+
+
+double DiskSystem::ModelDiskAccess(SIZE_T &headtrack, SIZE_T &headsector,
+				   const SIZE_T offblock, const SIZE_T numblock)
 {
 
   SIZE_T req_trackstart = (offblock) / (numheads*blockspertrack);
@@ -382,7 +651,7 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   SIZE_T req_trackend = (offblock+numblock-1) / (numheads*blockspertrack);
   SIZE_T req_sectorend=  (offblock+numblock-1) % (numheads*blockspertrack);
 
-  SIZE_T trackhop = (SIZE_T) fabs((double)req_trackstart-(double)last_track);
+  SIZE_T trackhop = (SIZE_T) fabs((double)req_trackstart-(double)headtrack);
   double trackhopfrac = (double)trackhop/(double)numtracks;
 
   // This is a simplistic model.  
@@ -393,7 +662,7 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   // Now we are on the first track and we need to wait for the first
   // sector to show up
 
-  SIZE_T sectorhop = (req_sectorstart >= last_sector) ? (req_sectorstart-last_sector) : (blockspertrack - (last_sector - req_sectorstart));
+  SIZE_T sectorhop = (req_sectorstart >= headsector) ? (req_sectorstart-headsector) : (blockspertrack - (headsector - req_sectorstart));
   double sectorhopfrac = (double)sectorhop/(double)blockspertrack;
   double timeinrotation=rotationallatency*sectorhopfrac;
 
@@ -406,13 +675,76 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   // The total number of sectors read
   double timeinreadsectors = rotationallatency*((double)numblock/(double)blockspertrack);
 
-  last_track=req_trackend;
-  last_sector=req_sectorend;
+  headtrack=req_trackend;
+  headsector=req_sectorend;
+
+  seekdistances[BitLength(trackhop)]++;
+  seektracks+=trackhop;
+  seektime+=timeinseek;
+  rotationtime+=timeinrotation;
+  transfertime+=timeintrackbytrackhops+timeinreadsectors;
+  blocksmoved+=numblock;
 
   return timeinseek+timeinrotation+timeintrackbytrackhops+timeinreadsectors;
 }
 
 
+// Pages go to the channels in turn.  A channel works on one page at a
+// time, starting when it is free, so the request is done when the
+// last of its channels is, and requests on other channels overlap it
+double DiskSystem::ModelSSDAccess(const SIZE_T offblock, const SIZE_T numblock, const bool write)
+{
+  double pagetime, finish=clock, service=0;
+
+  if (write) {
+    pagetime = device.writeamplification*
+      (device.pageprogramlatency+device.eraselatency/device.pagesperblock);
+    flashprograms += numblock*device.writeamplification;
+    flasherases += numblock*device.writeamplification/device.pagesperblock;
+  } else {
+    pagetime = device.pagereadlatency;
+  }
+  for (SIZE_T i=0; i<device.channels && i<numblock; i++) {
+    SIZE_T c=(offblock+i)%device.channels;
+    SIZE_T pages=(numblock-i+device.channels-1)/device.channels;
+    double start = channelfree[c]>clock ? channelfree[c] : clock;
+    channelfree[c] = start+pages*pagetime;
+    finish = channelfree[c]>finish ? channelfree[c] : finish;
+    service = pages*pagetime>service ? pages*pagetime : service;
+  }
+  transfertime += service;
+  blocksmoved += numblock;
+  return finish-clock;
+}
+
+
+// The blocks of a request that fall on one disk are next to each
+// other there, so each disk gets one request, and they run in parallel
+double DiskSystem::ModelRAIDAccess(const SIZE_T offblock, const SIZE_T numblock)
+{
+  vector<SIZE_T> start(device.disks,0), count(device.disks,0);
+  SIZE_T b, len;
+  double t=0;
+
+  for (b=offblock; b<offblock+numblock; b+=len) {
+    SIZE_T unit=b/device.stripeblocks;
+    SIZE_T disk=unit%device.disks;
+    len=MIN(device.stripeblocks-b%device.stripeblocks,offblock+numblock-b);
+    if (count[disk]==0) {
+      start[disk]=(unit/device.disks)*device.stripeblocks+b%device.stripeblocks;
+    }
+    count[disk]+=len;
+  }
+  for (SIZE_T d=0; d<device.disks; d++) {
+    if (count[d]) {
+      double dt=ModelDiskAccess(membertracks[d],membersectors[d],start[d],count[d]);
+      t = dt>t ? dt : t;
+    }
+  }
+  return t;
+}
+
+
 ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
 			 const SIZE_T   numblock,
 			 vector<Block> &blocks,
@@ -425,7 +757,9 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
     return ERROR_NOSPACE;
   }
 
-  reqtime=ModelAccess(inoffblock,numblock);
+  reqtime=ModelAccess(inoffblock,numblock,false);
+  clock+=reqtime;
+  numreads++;
 
   for (SIZE_T i=0;i<numblock;i++) { 
     Block b(blocksize);
@@ -456,7 +790,9 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
     return ERROR_NOSPACE;
   }
 
-  reqtime=ModelAccess(inoffblock,numblock);
+  reqtime=ModelAccess(inoffblock,numblock,true);
+  clock+=reqtime;
+  numwrites++;
 
   for (SIZE_T i=0;i<numblock;i++) { 
     if (!IsBlockAllocated(inoffblock+i)) { 
@@ -505,6 +841,162 @@ ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &
 }
 
 
+ERROR_T DiskSystem::QueueRead(const SIZE_T inoffblock, Block &block)
+{
+  Block b(blocksize);
+  DiskRequest r = { inoffblock, 1, false, clock };
+
+  if (inoffblock >= numblocks) {
+    cerr << "DiskSystem::QueueRead: Attempt to read block "<<inoffblock<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+  if (!IsBlockAllocated(inoffblock)) {
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+      cerr <<"DiskSystem::QueueRead: reading unallocated block "<<inoffblock<<endl;
+    }
+  }
+  if (myread(datafilefd,offset+inoffblock*blocksize,b.data,blocksize,true)!=blocksize) {
+    cerr << "DiskSystem::QueueRead: myread has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+  block = b;
+  queue.push_back(r);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T DiskSystem::QueueWrite(const SIZE_T inoffblock, const Block &block)
+{
+  DiskRequest r = { inoffblock, 1, true, clock };
+
+  if (inoffblock >= numblocks) {
+    cerr << "DiskSystem::QueueWrite: Attempt to write block "<<inoffblock<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+  if (!IsBlockAllocated(inoffblock)) {
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+      cerr <<"DiskSystem::QueueWrite: writing unallocated block "<<inoffblock<<endl;
+    }
+  }
+  if (mywrite(datafilefd,offset+inoffblock*blocksize,block.data,blocksize)!=blocksize) {
+    cerr << "DiskSystem::QueueWrite: mywrite has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+  queue.push_back(r);
+  return ERROR_NOERROR;
+}
+
+
+static bool BlockBefore(const DiskRequest &a, const DiskRequest &b)
+{
+  return a.block<b.block;
+}
+
+static bool BlockAfter(const DiskRequest &a, const DiskRequest &b)
+{
+  return a.block>b.block;
+}
+
+
+// Every request is queued before ServeQueue starts, so but for SSTF the
+// scheduler's order is a sort by block, walked from the head.  Blocks
+// order requests by track, as the seek does, and within a track by
+// sector.  Ties go to the earliest queued
+void DiskSystem::OrderQueue()
+{
+  SIZE_T head=lastblock, split=0;
+
+  if (scheduler==DISK_SCHED_FIFO || scheduler==DISK_SCHED_SSTF) {
+    return;
+  }
+  stable_sort(queue.begin(),queue.end(),BlockBefore);
+  if (scheduler==DISK_SCHED_CLOOK) {
+    // Up from the head, then up from the lowest block
+    while (split<queue.size() && queue[split].block<head) {
+      split++;
+    }
+    rotate(queue.begin(),queue.begin()+split,queue.end());
+  } else if (scanup) {
+    // Up from the head, then turning back down
+    while (split<queue.size() && queue[split].block<head) {
+      split++;
+    }
+    stable_sort(queue.begin(),queue.begin()+split,BlockAfter);
+    rotate(queue.begin(),queue.begin()+split,queue.end());
+    scanup = split==0;
+  } else {
+    // Down from the head, then turning back up
+    while (split<queue.size() && queue[split].block<=head) {
+      split++;
+    }
+    stable_sort(queue.begin(),queue.begin()+split,BlockAfter);
+    scanup = split<queue.size();
+  }
+}
+
+
+// SSTF: the queued request nearest the head, the earliest queued of
+// those as near
+SIZE_T DiskSystem::PickRequest()
+{
+  SIZE_T head=lastblock;
+  SIZE_T best=0, bestdist=0;
+
+  for (SIZE_T i=0; i<queue.size(); i++) {
+    SIZE_T b=queue[i].block;
+    SIZE_T dist = b>head ? b-head : head-b;
+    if (i==0 || dist<bestdist) {
+      best=i;
+      bestdist=dist;
+    }
+  }
+  return best;
+}
+
+
+ERROR_T DiskSystem::ServeQueue(double &reqtime)
+{
+  double start=clock, end=clock;
+  SIZE_T next=0;
+
+  OrderQueue();
+  while (next<queue.size()) {
+    DiskRequest r;
+
+    queuedepths[BitLength(queue.size()-next)]++;
+    queuedepthsum+=queue.size()-next;
+    if (scheduler==DISK_SCHED_SSTF) {
+      // Each pick depends on where the last one left the head
+      SIZE_T i=PickRequest();
+      r=queue[i];
+      queue.erase(queue.begin()+i);
+    } else {
+      r=queue[next++];
+    }
+    queuewait+=clock-r.queued;
+    numqueued++;
+
+    double t=ModelAccess(r.block,r.num,r.write);
+    if (device.type==DISK_DEVICE_SSD) {
+      // An SSD takes the whole queue at once, and its channels overlap it
+      end = clock+t>end ? clock+t : end;
+    } else {
+      clock+=t;
+      end=clock;
+    }
+    if (r.write) {
+      numwrites++;
+    } else {
+      numreads++;
+    }
+  }
+  queue.clear();
+  clock=end;
+  reqtime=end-start;
+  return ERROR_NOERROR;
+}
+
+
 SIZE_T DiskSystem::GetBlockSize() const
 {
   return blocksize;
@@ -518,36 +1010,108 @@ SIZE_T DiskSystem::GetNumBlocks() const
 
 
 #define GETBIT(x) ((bitmap[(x)/8] >> (7-((x)%8))) & 0x1)
-#define SETBIT(x) do { bitmap[(x)/8] |= 0x1 << (7-((x)%8)); } while (0)
-#define CLEARBIT(x) do { bitmap[(x)/8] &= ~(0x1 << (7-((x)%8))); } while (0)
 
 
-bool DiskSystem::IsBlockAllocated(const SIZE_T block)
+// Words of the bitmap, and words of the summary
+#define NUMWORDS(bits) (((bits)+63)/64)
+// cnt bits from bit pos of a word, counting from the top
+#define RUNMASK(pos,cnt) ((cnt)==64 ? ~0ULL : (((1ULL<<(cnt))-1) << (64-(pos)-(cnt))))
+
+
+uint64_t DiskSystem::GetWord(const SIZE_T w) const
 {
-  return GETBIT(block);
+  uint64_t v=0;
+
+  for (SIZE_T i=w*8; i<w*8+8; i++) {
+    v = v<<8 | (i<bitmapbytes ? bitmap[i] : 0xff);
+  }
+  if (w==numblocks/64 && numblocks%64) {
+    v |= ~0ULL >> (numblocks%64);
+  }
+  return v;
 }
 
 
-ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innumblocks)
+void DiskSystem::BuildSummary()
 {
-  if (offset+innumblocks > numblocks) { 
-    cerr << "Disksystem: NotifyAllocateBlocks: Attempt to allocate"<<offset<<" to "<<(offset+innumblocks-1)<<" but maximum block is "<<(numblocks-1)<<endl;
-    return ERROR_NOSUCHBLOCK;
+  SIZE_T words=NUMWORDS(numblocks);
+
+  fullwords.assign(NUMWORDS(words),0);
+  numallocated=0;
+  for (SIZE_T w=0; w<words; w++) {
+    uint64_t v=GetWord(w);
+    numallocated+=__builtin_popcountll(v);
+    if (v==~0ULL) {
+      fullwords[w/64] |= 1ULL << (w%64);
+    }
   }
+  // the bits past the end read as allocated
+  numallocated-=words*64-numblocks;
+}
 
 
-  for (SIZE_T i=offset; i<(offset+innumblocks); i++) { 
-    if (IsBlockAllocated(i)) {
-      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
-	cerr << "Disksystem: NotifyAllocateBlocks: Block "<<i<<" is being allocated, but it's already allocated!"<<endl;
-      }
+void DiskSystem::FlipBits(const SIZE_T w, const uint64_t change)
+{
+  uint64_t v=GetWord(w)^change;
+
+  for (SIZE_T i=0; i<8; i++) {
+    BYTE_T b=change >> (56-8*i);
+    if (b) {
+      bitmap[w*8+i]^=b;
+      MarkBitMapDirty(w*64+i*8);
     }
-    SETBIT(i);
   }
+  if (v==~0ULL) {
+    fullwords[w/64] |= 1ULL << (w%64);
+  } else {
+    fullwords[w/64] &= ~(1ULL << (w%64));
+  }
+}
 
+
+// Allocates or frees the blocks a word at a time
+ERROR_T DiskSystem::NotifyBlocks(const SIZE_T offset, const SIZE_T innumblocks,
+				 const bool allocate)
+{
+  SIZE_T i, cnt;
+
+  for (i=offset; i<offset+innumblocks; i+=cnt) {
+    SIZE_T w=i/64;
+    cnt=MIN(64-i%64,offset+innumblocks-i);
+    uint64_t mask=RUNMASK(i%64,cnt);
+    uint64_t v=GetWord(w);
+    // the blocks that are changing state
+    uint64_t change=(allocate ? ~v : v) & mask;
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS && change!=mask) {
+      for (SIZE_T j=i; j<i+cnt; j++) {
+	if (!((change >> (63-j%64)) & 0x1)) {
+	  cerr << "Disksystem: Notify"<<(allocate ? "Allocate" : "Deallocate")<<"Blocks: Block "<<j<<" is being "<<(allocate ? "allocated" : "deallocated")<<", but it's already "<<(allocate ? "allocated" : "deallocated")<<"!"<<endl;
+	}
+      }
+    }
+    if (change) {
+      FlipBits(w,change);
+      if (allocate) {
+	numallocated+=__builtin_popcountll(change);
+      } else {
+	numallocated-=__builtin_popcountll(change);
+      }
+    }
+  }
   return ERROR_NOERROR;
 }
 
+
+ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innumblocks)
+{
+  if (offset+innumblocks > numblocks) { 
+    cerr << "Disksystem: NotifyAllocateBlocks: Attempt to allocate"<<offset<<" to "<<(offset+innumblocks-1)<<" but maximum block is "<<(numblocks-1)<<endl;
+    return ERROR_NOSUCHBLOCK;
+  }
+
+  return NotifyBlocks(offset,innumblocks,true);
+}
+
 ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innumblocks)
 {
   if (offset+innumblocks > numblocks) { 
@@ -555,17 +1119,74 @@ ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innu
     return ERROR_NOSUCHBLOCK;
   }
 
+  return NotifyBlocks(offset,innumblocks,false);
+}
 
-  for (SIZE_T i=offset; i<(offset+innumblocks); i++) { 
-    if (!IsBlockAllocated(i)) {
-      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
-	cerr << "Disksystem: NotifyDeallocateBlocks: Block "<<i<<" is being deallocated, but it's already deallocated!"<<endl;
+
+// Looks for n free blocks in a row within blocks from to to-1
+bool DiskSystem::FindFreeRunIn(const SIZE_T from, const SIZE_T to, const SIZE_T n,
+			       SIZE_T &start) const
+{
+  SIZE_T run=0, runstart=0;
+
+  for (SIZE_T w=from/64; w<NUMWORDS(to); w++) {
+    if (fullwords[w/64]==~0ULL && w%64==0) {
+      // 64 words with no free block
+      run=0;
+      w+=63;
+      continue;
+    }
+    if ((fullwords[w/64] >> (w%64)) & 0x1) {
+      run=0;
+      continue;
+    }
+    uint64_t v=GetWord(w);
+    // what is outside the range counts as allocated
+    if (w==from/64 && from%64) {
+      v |= ~0ULL << (64-from%64);
+    }
+    if (w==to/64 && to%64) {
+      v |= ~0ULL >> (to%64);
+    }
+    for (SIZE_T pos=0; pos<64;) {
+      uint64_t x=v<<pos;
+      // free blocks from pos, then allocated ones
+      SIZE_T freebits=MIN(x ? (SIZE_T)__builtin_clzll(x) : 64,64-pos);
+      if (freebits) {
+	if (run==0) {
+	  runstart=w*64+pos;
+	}
+	run+=freebits;
+	if (run>=n) {
+	  start=runstart;
+	  return true;
+	}
+	pos+=freebits;
+      }
+      if (pos<64) {
+	// allocated blocks up to the next free one, or to the end of the word
+	uint64_t y=~(v<<pos);
+	run=0;
+	pos+=y ? (SIZE_T)__builtin_clzll(y) : 64-pos;
       }
     }
-    CLEARBIT(i);
   }
+  return false;
+}
 
-  return ERROR_NOERROR;
+
+ERROR_T DiskSystem::FindFreeRun(const SIZE_T hint, const SIZE_T n, SIZE_T &start) const
+{
+  SIZE_T from = hint<numblocks ? hint : 0;
+
+  if (n==0 || n>numblocks) {
+    return ERROR_NOSPACE;
+  }
+  if (FindFreeRunIn(from,numblocks,n,start) ||
+      (from>0 && FindFreeRunIn(0,MIN(from+n-1,numblocks),n,start))) {
+    return ERROR_NOERROR;
+  }
+  return ERROR_NOSPACE;
 }
 
 
@@ -583,8 +1204,26 @@ ostream & DiskSystem::Print(ostream &os) const
      << ", averageseeklatency="<<averageseeklatency
      << ", trackseeklatency="<<trackseeklatency
      << ", rotationallatency="<<rotationallatency
+     << ", device="<<DeviceName(device.type);
+  if (device.type==DISK_DEVICE_SSD) {
+    os << ", channels="<<device.channels
+       << ", pagereadlatency="<<device.pagereadlatency
+       << ", pageprogramlatency="<<device.pageprogramlatency
+       << ", eraselatency="<<device.eraselatency
+       << ", pagesperblock="<<device.pagesperblock
+       << ", writeamplification="<<device.writeamplification;
+  } else if (device.type==DISK_DEVICE_RAID0) {
+    os << ", disks="<<device.disks
+       << ", stripeblocks="<<device.stripeblocks;
+  }
+  os << ", scheduler="<<SchedulerName(scheduler)
      << ", bitmap=";
 
+  // A bitmap of a large disk is too long to read; say how full it is
+  if (numblocks>PRINT_DISKSYSTEM_BITMAP_BLOCKS) {
+    os << GetNumAllocated() << " of " << numblocks << " blocks allocated)";
+    return os;
+  }
   for (SIZE_T i=0;i<numblocks;i++) { 
     if (GETBIT(i)) { 
       os <<"*";
@@ -597,6 +1236,57 @@ ostream & DiskSystem::Print(ostream &os) const
   return os;
 }
 
+
+void DiskSystem::ExportMetrics(Metrics &m) const
+{
+  vector<double> bounds;
+  vector<SIZE_T> counts;
+  SIZE_T last=0;
+
+  m.AddGauge("btree_disk_blocks","Blocks on the disk",numblocks);
+  m.AddGauge("btree_disk_blocks_allocated","Blocks marked allocated in the bitmap",GetNumAllocated());
+  m.AddCounter("btree_disk_reads_total","Read requests",numreads);
+  m.AddCounter("btree_disk_writes_total","Write requests",numwrites);
+  m.AddCounter("btree_disk_blocks_transferred_total","Blocks read or written",blocksmoved);
+  m.AddCounter("btree_disk_seek_milliseconds_total","Simulated time spent seeking",seektime);
+  m.AddCounter("btree_disk_rotation_milliseconds_total","Simulated time spent waiting for the first sector",rotationtime);
+  m.AddCounter("btree_disk_transfer_milliseconds_total","Simulated time spent transferring blocks",transfertime);
+
+  // Buckets of 0, 1, 2-3, 4-7, ... tracks, up to the longest seek made
+  for (SIZE_T b=0;b<33;b++) {
+    if (seekdistances[b]) {
+      last=b;
+    }
+  }
+  for (SIZE_T b=0;b<=last;b++) {
+    bounds.push_back(b ? (double)((1ULL<<b)-1) : 0);
+    counts.push_back(seekdistances[b]);
+  }
+  m.AddHistogram("btree_disk_seek_distance_tracks","Tracks crossed by each request's seek",
+		 bounds,counts,seektracks);
+
+  if (device.type==DISK_DEVICE_SSD) {
+    m.AddCounter("btree_disk_flash_programs_total","Flash pages programmed, counting garbage collection",flashprograms);
+    m.AddCounter("btree_disk_flash_erases_total","Flash erase blocks erased",flasherases);
+  }
+  m.AddCounter("btree_disk_queued_requests_total","Requests served from the queue",numqueued);
+  m.AddCounter("btree_disk_queue_wait_milliseconds_total","Simulated time queued requests waited to be served",queuewait);
+  bounds.clear();
+  counts.clear();
+  last=0;
+  for (SIZE_T b=0;b<33;b++) {
+    if (queuedepths[b]) {
+      last=b;
+    }
+  }
+  for (SIZE_T b=0;b<=last;b++) {
+    bounds.push_back(b ? (double)((1ULL<<b)-1) : 0);
+    counts.push_back(queuedepths[b]);
+  }
+  m.AddHistogram("btree_disk_queue_depth","Requests waiting when each queued request was served",
+		 bounds,counts,queuedepthsum);
+}
+
   
 
 
@@ -4,12 +4,78 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <stdint.h>
 
 #include "global.h"
 #include "block.h"
+#include "metrics.h"
 
 using namespace std;
 
+// How DiskSystem::ServeQueue orders the requests waiting for the disk
+//
+// FIFO   - in the order they were queued
+// SSTF   - the one nearest the head first (shortest seek time first)
+// SCAN   - the nearest in the direction the head is moving, turning
+//          back when there are no more that way (the elevator)
+// CLOOK  - the nearest at or past the head, going back to the lowest
+//          when there are no more past it
+#define DISK_SCHED_FIFO 0
+#define DISK_SCHED_SSTF 1
+#define DISK_SCHED_SCAN 2
+#define DISK_SCHED_CLOOK 3
+
+// Maps a DISK_SCHED_* to its name ("fifo", "sstf", ...) and back.
+// SchedulerFromName returns -1 for a name it does not know
+const char *SchedulerName(const int scheduler);
+int         SchedulerFromName(const char *name);
+
+// What kind of device DiskSystem models, as its config says
+//
+// DISK   - a rotating disk: a seek to the track, a wait for the first
+//          sector to come around, and the transfer
+// SSD    - flash: each block is a page, and the pages are spread over
+//          channels that work in parallel.  A read costs the page read
+//          latency; a write costs the program latency times the write
+//          amplification of garbage collection, plus its share of the
+//          erases that collection makes
+// RAID0  - blocks striped over several rotating disks, a stripe unit
+//          of blocks on each in turn; a request costs as much as the
+//          slowest of the disks it touches, each with its own head
+#define DISK_DEVICE_DISK 0
+#define DISK_DEVICE_SSD 1
+#define DISK_DEVICE_RAID0 2
+
+// Maps a DISK_DEVICE_* to its name ("disk", "ssd", "raid0") and back.
+// DeviceFromName returns -1 for a name it does not know
+const char *DeviceName(const int device);
+int         DeviceFromName(const char *name);
+
+struct DeviceModel {
+  int    type;                   // DISK_DEVICE_*
+  // SSD: latencies in milliseconds
+  SIZE_T channels;
+  double pagereadlatency;
+  double pageprogramlatency;
+  double eraselatency;
+  SIZE_T pagesperblock;          // pages per erase block
+  double writeamplification;     // pages programmed per page written
+  // RAID0: the geometry of the config is that of each disk
+  SIZE_T disks;
+  SIZE_T stripeblocks;           // blocks per stripe unit
+
+  DeviceModel() :
+    type(DISK_DEVICE_DISK), channels(1), pagereadlatency(0), pageprogramlatency(0),
+    eraselatency(0), pagesperblock(1), writeamplification(1), disks(1), stripeblocks(1) {}
+};
+
+// A request waiting for the disk; its data has already moved
+struct DiskRequest {
+  SIZE_T block, num;
+  bool   write;
+  double queued;         // the disk's clock when it was queued
+};
+
 // Models a single disk with a single outstanding request
 //
 // Includes storage allocator and free space bitmap to 
@@ -18,6 +84,17 @@ using namespace std;
 class DiskSystem {
  private:
   BYTE_T *bitmap;
+  SIZE_T bitmapbytes;
+  bool   bitmapmapped;   // bitmap is the bitmap file, mapped shared
+  // Chunks of DISKSYSTEM_BITMAP_CHUNK bytes of the bitmap changed since
+  // it was last read or written, as flags and as a list
+  vector<bool>   dirtychunk;
+  vector<SIZE_T> dirtychunks;
+  // Summary of the bitmap taken 64 blocks (a word) at a time: bit w%64
+  // of fullwords[w/64] is set when all of word w is allocated.  Along
+  // with the count of allocated blocks, it is kept by the Notify calls
+  vector<uint64_t> fullwords;
+  SIZE_T numallocated;
   FILE*  datafilefd;
   FILE*  configfilefd;
   FILE*  bitmapfilefd;
@@ -35,14 +112,46 @@ class DiskSystem {
   SIZE_T numtracks;
   SIZE_T last_track;
   SIZE_T last_sector;
+  DeviceModel device;
+  // Where the head of each disk of a RAID0 is
+  vector<SIZE_T> membertracks, membersectors;
+  // When each channel of an SSD is done with the pages it has been given
+  vector<double> channelfree;
+  SIZE_T lastblock;      // the last block of the last request
     
 
+  // Requests queued and not yet served, and how they are ordered
+  vector<DiskRequest> queue;
+  int    scheduler;
+  bool   scanup;         // SCAN is moving the head toward higher blocks
+  // Time the disk has been busy, which is all the time there is
+  double clock;
+
   double averageseeklatency;
   double trackseeklatency;
   double rotationallatency;
 
+  // What the requests so far have cost, as ModelAccess worked it out
+  SIZE_T numreads, numwrites, blocksmoved;
+  double seektime, rotationtime, transfertime;
+  double seektracks;
+  SIZE_T seekdistances[33];  // by the bit length of the seek in tracks
+  // Requests served from the queue, how long they waited in it, and
+  // how many were waiting when each was picked
+  SIZE_T numqueued;
+  double queuewait;
+  double queuedepthsum;
+  SIZE_T queuedepths[33];    // by the bit length of the depth
+  // What writes have cost an SSD
+  double flashprograms, flasherases;
+
  protected:
-  virtual double ModelAccess(const SIZE_T off, const SIZE_T num);
+  virtual double ModelAccess(const SIZE_T off, const SIZE_T num, const bool write);
+  // The rotating disk model, for a disk whose head is at track, sector
+  double  ModelDiskAccess(SIZE_T &track, SIZE_T &sector, const SIZE_T off,
+			  const SIZE_T num);
+  double  ModelSSDAccess(const SIZE_T off, const SIZE_T num, const bool write);
+  double  ModelRAIDAccess(const SIZE_T off, const SIZE_T num);
 
   ERROR_T SanityCheckConfig();
   ERROR_T InitFromConfigFile();
@@ -50,7 +159,22 @@ class DiskSystem {
   ERROR_T ReadConfig();
   ERROR_T WriteConfig();
   ERROR_T ReadBitMap();
+  ERROR_T MapBitMap();
   ERROR_T WriteBitMap();
+  void    MarkBitMapDirty(const SIZE_T block);
+  // Puts the queue in the order the scheduler serves it, or, for SSTF,
+  // gives the queued request it serves next
+  void    OrderQueue();
+  SIZE_T  PickRequest();
+  void    BuildSummary();
+  // Blocks 64w to 64w+63, the first in the top bit; blocks past the
+  // end of the disk read as allocated
+  uint64_t GetWord(const SIZE_T w) const;
+  // Flips the bits of word w set in change, and keeps the summary
+  void    FlipBits(const SIZE_T w, const uint64_t change);
+  ERROR_T NotifyBlocks(const SIZE_T offset, const SIZE_T innumblocks, const bool allocate);
+  bool    FindFreeRunIn(const SIZE_T from, const SIZE_T to, const SIZE_T n,
+			SIZE_T &start) const;
   
    
  public:
@@ -67,7 +191,8 @@ class DiskSystem {
 	     const SIZE_T tracks=0,
 	     const double avgseek=0,
 	     const double trackseek=0,
-	     const double rotlat=0);
+	     const double rotlat=0,
+	     const DeviceModel &device=DeviceModel());
   DiskSystem() { throw GenericException(); } 
   DiskSystem(const DiskSystem &rhs) { throw GenericException();}
   DiskSystem & operator=(const DiskSystem &rhs) { throw GenericException(); return *this;}
@@ -94,6 +219,21 @@ class DiskSystem {
 		const Block &blocks,
 		double &reqtime);
 
+  // Queued requests move their data at once, but the time they take is
+  // only worked out by ServeQueue, which serves every queued request in
+  // the order the scheduler picks and returns the time it took them
+  // all.  The synchronous calls above go straight to the disk, so
+  // serve the queue before making one that depends on a queued write
+  ERROR_T QueueRead(const SIZE_T inoffblock, Block &block);
+  ERROR_T QueueWrite(const SIZE_T inoffblock, const Block &block);
+  ERROR_T ServeQueue(double &reqtime);
+  SIZE_T  GetQueueDepth() const { return queue.size(); }
+
+  // The scheduler starts as BTREE_DISK_SCHEDULER in the environment
+  // names it, or C-LOOK
+  void    SetScheduler(const int s) { scheduler=s; }
+  int     GetScheduler() const { return scheduler; }
+
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
 
@@ -107,7 +247,29 @@ class DiskSystem {
   ERROR_T NotifyDeallocateBlocks(const SIZE_T offset,
 				 const SIZE_T innumblocks);
 
-  bool    IsBlockAllocated(const SIZE_T offset);
+  bool    IsBlockAllocated(const SIZE_T offset) const {
+    return (bitmap[offset/8] >> (7-offset%8)) & 0x1;
+  }
+  SIZE_T  GetNumAllocated() const { return numallocated; }
+
+  // Finds n free blocks in a row, the first of them at or after hint if
+  // there are such, else the first from the start of the disk, and puts
+  // it in start; ERROR_NOSPACE if there are none.  Whole words of
+  // allocated blocks, and 64 of them at a time where the summary says
+  // so, are skipped, so the search costs about a word per 64 blocks
+  ERROR_T FindFreeRun(const SIZE_T hint, const SIZE_T n, SIZE_T &start) const;
+
+  // Writes back the chunks of the bitmap that allocations have changed,
+  // so it costs as much as the changes, not the size of the disk; the
+  // destructor does too.  With BTREE_BITMAP_MMAP=1 in the environment,
+  // an existing disk's bitmap file is mapped rather than read, and the
+  // changes go straight to it
+  ERROR_T FlushBitMap();
+
+  // Adds the request counts, the time spent seeking, waiting for the
+  // platter and transferring, the seek distances in tracks, and the
+  // depth of the queue and the time spent in it
+  void    ExportMetrics(Metrics &m) const;
 
 
   ostream & Print(ostream &os) const;
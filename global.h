@@ -37,4 +37,12 @@ struct GenericException {};
 #define PRINT_DISKSYSTEM_ALLOCATION_ERRORS 0
 #define PRINT_BUFFERCACHE_ALLOCATION_ERRORS 0
 
+// DiskSystem::Print shows the allocation bitmap block by block for disks
+// of up to this many blocks, and only how many are allocated for larger
+#define PRINT_DISKSYSTEM_BITMAP_BLOCKS 4096
+
+// DiskSystem writes back the allocation bitmap in chunks of this many
+// bytes, only those an allocation has changed
+#define DISKSYSTEM_BITMAP_CHUNK 64
+
 #endif
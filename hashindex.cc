@@ -0,0 +1,525 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include "hashindex.h"
+
+
+HashIndex::HashIndex(SIZE_T keysize,
+                     SIZE_T valuesize,
+                     BufferCache *cache,
+                     int comparator) :
+    BTreeIndex(keysize, valuesize, cache, true, BTREE_FORMAT_FIXED, comparator),
+    depth(0)
+{
+    // A lookup already reads a single bucket, so there is nothing to
+    // filter or pin
+    filterbits = 0;
+    pinlevels = 0;
+}
+
+
+/*
+ * GetBucketCapacity
+ *
+ * Number of entries a bucket block holds
+ */
+SIZE_T HashIndex::GetBucketCapacity() const
+{
+    SIZE_T bytes = buffercache->GetBlockSize() - sizeof(NodeMetadata) - sizeof(SIZE_T);
+    return bytes / (superblock.info.keysize + superblock.info.valuesize);
+}
+
+
+/*
+ * GetDirectoryCapacity
+ *
+ * Number of directory entries a directory block holds
+ */
+SIZE_T HashIndex::GetDirectoryCapacity() const
+{
+    return (buffercache->GetBlockSize() - sizeof(NodeMetadata)) / sizeof(SIZE_T) - 1;
+}
+
+
+/*
+ * Slot
+ *
+ * The directory entry for key: the low depth bits of its hash
+ */
+SIZE_T HashIndex::Slot(const KEY_T &key) const
+{
+    return (SIZE_T) (KeyHash(key.data, key.length) & ((1ULL << depth) - 1));
+}
+
+
+bool HashIndex::KeysEqual(const char *lhs, const char *rhs) const
+{
+    const KeyOrder *order = GetKeyOrder(superblock.info.comparator);
+    return order->compare(lhs, superblock.info.keysize, rhs, superblock.info.keysize) == 0;
+}
+
+
+char *HashIndex::ResolveEntry(const BTreeNode &bucket, const SIZE_T offset) const
+{
+    return bucket.data + sizeof(SIZE_T) +
+        offset * (superblock.info.keysize + superblock.info.valuesize);
+}
+
+
+SIZE_T HashIndex::GetLocalDepth(const BTreeNode &bucket) const
+{
+    SIZE_T localdepth;
+    memcpy(&localdepth, bucket.data, sizeof(SIZE_T));
+    return localdepth;
+}
+
+
+void HashIndex::SetLocalDepth(BTreeNode &bucket, const SIZE_T localdepth) const
+{
+    memcpy(bucket.data, &localdepth, sizeof(SIZE_T));
+}
+
+
+/*
+ * Name:    Attach
+ * Purpose: open a hash index for use, creating it first if asked to
+ * Params:  const SIZE_T initblock
+ *          const bool create
+ */
+ERROR_T HashIndex::Attach(const SIZE_T initblock, const bool create)
+{
+    ERROR_T rc;
+
+    if (!create) {
+        superblock_index = initblock;
+        if ((rc = superblock.Unserialize(buffercache, initblock)))
+            return rc;
+        return ReadDirectory();
+    }
+
+    if (GetBucketCapacity() < 2)
+        return ERROR_SIZE;
+    // Lays out the superblock, an empty root and the free list
+    if ((rc = BTreeIndex::Attach(initblock, true)))
+        return rc;
+
+    // The block the tree would have used as its root becomes the first
+    // directory block, holding the single entry of a depth 0 directory
+    SIZE_T bucket;
+    if ((rc = AllocateNode(bucket)))
+        return rc;
+    BTreeNode b(BTREE_HASH_BUCKET_NODE,
+                superblock.info.keysize,
+                superblock.info.valuesize,
+                buffercache->GetBlockSize(),
+                superblock.info.format,
+                superblock.info.comparator);
+    SetLocalDepth(b, 0);
+    if ((rc = b.Serialize(buffercache, bucket)))
+        return rc;
+
+    depth = 0;
+    directory.assign(1, bucket);
+    dirblocks.assign(1, superblock.info.rootnode);
+    return WriteDirectory(0, 1);
+}
+
+
+/*
+ * ReadDirectory
+ *
+ * Loads the directory from its chain of blocks
+ */
+ERROR_T HashIndex::ReadDirectory()
+{
+    BTreeNode d;
+    SIZE_T n = superblock.info.rootnode;
+    ERROR_T rc;
+
+    directory.clear();
+    dirblocks.clear();
+    while (n) {
+        if ((rc = d.Unserialize(buffercache, n)))
+            return rc;
+        if (d.info.nodetype != BTREE_HASH_DIRECTORY_NODE)
+            return ERROR_NOTANINDEX;
+        dirblocks.push_back(n);
+        SIZE_T at = directory.size();
+        directory.resize(at + d.info.numkeys);
+        memcpy(&directory[at], d.data + sizeof(SIZE_T), d.info.numkeys * sizeof(SIZE_T));
+        memcpy(&n, d.data, sizeof(SIZE_T));
+    }
+
+    for (depth = 0; (1U << depth) < directory.size(); depth++) ;
+    return directory.size() == (1U << depth) ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+/*
+ * WriteDirectory
+ *
+ * Writes the directory blocks holding entries first to last-1, adding
+ * blocks to the chain if the directory has outgrown it
+ */
+ERROR_T HashIndex::WriteDirectory(SIZE_T first, const SIZE_T last)
+{
+    SIZE_T cap = GetDirectoryCapacity();
+    ERROR_T rc;
+
+    if (dirblocks.size() * cap < directory.size()) {
+        // The old last block gets a next pointer
+        first = std::min(first, (SIZE_T) (dirblocks.size() - 1) * cap);
+        while (dirblocks.size() * cap < directory.size()) {
+            SIZE_T n;
+            if ((rc = AllocateNode(n)))
+                return rc;
+            dirblocks.push_back(n);
+        }
+    }
+
+    for (SIZE_T blk = first / cap; blk * cap < last; blk++) {
+        BTreeNode d(BTREE_HASH_DIRECTORY_NODE,
+                    superblock.info.keysize,
+                    superblock.info.valuesize,
+                    buffercache->GetBlockSize(),
+                    superblock.info.format,
+                    superblock.info.comparator);
+        SIZE_T next = blk + 1 < dirblocks.size() ? dirblocks[blk + 1] : 0;
+        d.info.numkeys = std::min(cap, (SIZE_T) directory.size() - blk * cap);
+        memcpy(d.data, &next, sizeof(SIZE_T));
+        memcpy(d.data + sizeof(SIZE_T), &directory[blk * cap], d.info.numkeys * sizeof(SIZE_T));
+        if ((rc = d.Serialize(buffercache, dirblocks[blk])))
+            return rc;
+    }
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * GrowDirectory
+ *
+ * Doubles the directory; each new entry shares the bucket of the entry
+ * that agrees with it in the old low bits
+ */
+ERROR_T HashIndex::GrowDirectory()
+{
+    SIZE_T size = directory.size();
+
+    if (depth == HASH_MAX_DEPTH)
+        return ERROR_NOSPACE;
+    for (SIZE_T i = 0; i < size; i++)
+        directory.push_back(directory[i]);
+    depth++;
+    return WriteDirectory(size, 2 * size);
+}
+
+
+/*
+ * SplitBucket
+ *
+ * Splits the bucket of a directory entry on the next bit of the hash
+ */
+ERROR_T HashIndex::SplitBucket(const SIZE_T slot)
+{
+    BTreeNode old;
+    SIZE_T node = directory[slot], newNode;
+    SIZE_T entrysize = superblock.info.keysize + superblock.info.valuesize;
+    ERROR_T rc;
+
+    if ((rc = old.Unserialize(buffercache, node)))
+        return rc;
+    SIZE_T localdepth = GetLocalDepth(old);
+    if (localdepth == depth && (rc = GrowDirectory()))
+        return rc;
+    if ((rc = AllocateNode(newNode)))
+        return rc;
+    splits++;
+
+    BTreeNode b(BTREE_HASH_BUCKET_NODE,
+                superblock.info.keysize,
+                superblock.info.valuesize,
+                buffercache->GetBlockSize(),
+                superblock.info.format,
+                superblock.info.comparator);
+    SIZE_T keep = 0;
+    for (SIZE_T i = 0; i < old.info.numkeys; i++) {
+        char *e = ResolveEntry(old, i);
+        if ((KeyHash((BYTE_T *) e, superblock.info.keysize) >> localdepth) & 1) {
+            memcpy(ResolveEntry(b, b.info.numkeys++), e, entrysize);
+        } else {
+            memmove(ResolveEntry(old, keep++), e, entrysize);
+        }
+    }
+    old.info.numkeys = keep;
+    SetLocalDepth(old, localdepth + 1);
+    SetLocalDepth(b, localdepth + 1);
+    if ((rc = b.Serialize(buffercache, newNode)) || (rc = old.Serialize(buffercache, node)))
+        return rc;
+
+    // Half of the entries that shared the bucket, those with the new
+    // bit set, now lead to the new one
+    SIZE_T step = 1U << (localdepth + 1);
+    SIZE_T first = (slot & ((1U << localdepth) - 1)) | (1U << localdepth);
+    SIZE_T i;
+    for (i = first; i < directory.size(); i += step)
+        directory[i] = newNode;
+    return WriteDirectory(first, i - step + 1);
+}
+
+
+/*
+ * FindInBucket
+ *
+ * Reads the bucket key belongs in.  If key is there, offset is where
+ */
+ERROR_T HashIndex::FindInBucket(const KEY_T &key, BTreeNode &bucket, SIZE_T &node, SIZE_T &offset)
+{
+    ERROR_T rc;
+
+    node = directory[Slot(key)];
+    if ((rc = bucket.Unserialize(buffercache, node)))
+        return rc;
+    if (bucket.info.nodetype != BTREE_HASH_BUCKET_NODE)
+        return ERROR_INSANE;
+    for (offset = 0; offset < bucket.info.numkeys; offset++)
+        if (KeysEqual(ResolveEntry(bucket, offset), (const char *) key.data))
+            return ERROR_NOERROR;
+    return ERROR_NONEXISTENT;
+}
+
+
+/*
+ * Name:    Insert
+ * Purpose: insert the key/value pair
+ */
+ERROR_T HashIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+    BTreeNode b;
+    SIZE_T node, offset;
+    ERROR_T rc;
+
+    if (WrongSize(key.length, superblock.info.keysize) ||
+        WrongSize(value.length, superblock.info.valuesize))
+        return ERROR_SIZE;
+
+    for (;;) {
+        rc = FindInBucket(key, b, node, offset);
+        if (rc == ERROR_NOERROR)
+            return ERROR_CONFLICT;
+        if (rc != ERROR_NONEXISTENT)
+            return rc;
+        if (b.info.numkeys < GetBucketCapacity())
+            break;
+        if ((rc = SplitBucket(Slot(key))))
+            return rc;
+    }
+
+    char *e = ResolveEntry(b, b.info.numkeys++);
+    memcpy(e, key.data, superblock.info.keysize);
+    memcpy(e + superblock.info.keysize, value.data, superblock.info.valuesize);
+    return b.Serialize(buffercache, node);
+}
+
+
+/*
+ * Name:    Update
+ * Purpose: change the value associated with an existing key
+ */
+ERROR_T HashIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+    BTreeNode b;
+    SIZE_T node, offset;
+    ERROR_T rc;
+
+    if (WrongSize(key.length, superblock.info.keysize) ||
+        WrongSize(value.length, superblock.info.valuesize))
+        return ERROR_SIZE;
+    if ((rc = FindInBucket(key, b, node, offset)))
+        return rc;
+    memcpy(ResolveEntry(b, offset) + superblock.info.keysize, value.data, superblock.info.valuesize);
+    return b.Serialize(buffercache, node);
+}
+
+
+/*
+ * Name:    Delete
+ * Purpose: remove a key and its value
+ */
+ERROR_T HashIndex::Delete(const KEY_T &key)
+{
+    BTreeNode b;
+    SIZE_T node, offset;
+    ERROR_T rc;
+
+    if (WrongSize(key.length, superblock.info.keysize))
+        return ERROR_SIZE;
+    if ((rc = FindInBucket(key, b, node, offset)))
+        return rc;
+    // Buckets are unordered, so the last entry fills the hole
+    b.info.numkeys--;
+    if (offset != b.info.numkeys)
+        memcpy(ResolveEntry(b, offset), ResolveEntry(b, b.info.numkeys),
+               superblock.info.keysize + superblock.info.valuesize);
+    return b.Serialize(buffercache, node);
+}
+
+
+/*
+ * Name:    Lookup
+ * Purpose: return the value associated with the key
+ */
+ERROR_T HashIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+    BTreeNode b;
+    SIZE_T node, offset;
+    ERROR_T rc;
+
+    if (key.length != superblock.info.keysize)
+        return ERROR_SIZE;
+    if ((rc = FindInBucket(key, b, node, offset)))
+        return rc;
+    if ((rc = value.Resize(superblock.info.valuesize, false)))
+        return rc;
+    memcpy(value.data, ResolveEntry(b, offset) + superblock.info.keysize, superblock.info.valuesize);
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    LookupBatch
+ * Purpose: look up each of the keys in turn
+ */
+ERROR_T HashIndex::LookupBatch(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+                               vector<ERROR_T> &results)
+{
+    ERROR_T rc = ERROR_NOERROR;
+
+    values.resize(keys.size());
+    results.resize(keys.size());
+    for (SIZE_T i = 0; i < keys.size(); i++) {
+        results[i] = Lookup(keys[i], values[i]);
+        if (!rc && results[i] != ERROR_NONEXISTENT)
+            rc = results[i];
+    }
+    return rc;
+}
+
+
+ERROR_T HashIndex::LookupFirst(const KEY_T &key, BTreeCursor &cursor, VALUE_T &value)
+{
+    cursor.key = key;
+    return Lookup(key, value);
+}
+
+
+ERROR_T HashIndex::LookupNext(BTreeCursor &cursor, VALUE_T &value)
+{
+    return ERROR_NONEXISTENT;
+}
+
+
+// Orders entries, kept one after another in a buffer, by key
+struct HashEntryLess {
+    const KeyOrder *order;
+    const char *entries;
+    SIZE_T keysize;
+
+    bool operator()(const SIZE_T lhs, const SIZE_T rhs) const {
+        return order->compare(entries + lhs, keysize, entries + rhs, keysize) < 0;
+    }
+};
+
+
+static void PrintBytes(ostream &o, const char *p, const SIZE_T len)
+{
+    for (SIZE_T i = 0; i < len; i++)
+        o << p[i];
+}
+
+
+/*
+ * Name:    GetShape
+ * Purpose: measure the directory and the buckets
+ *
+ * The directory blocks count as the interior nodes, and the buckets as
+ * the leaves, one level below them
+ */
+ERROR_T HashIndex::GetShape(BTreeShape &shape) const
+{
+    BTreeNode b;
+    ERROR_T rc;
+
+    memset(&shape, 0, sizeof(shape));
+    shape.interiornodes = dirblocks.size();
+    if (!dirblocks.empty())
+        shape.interiorfill = (double) directory.size() / (dirblocks.size() * GetDirectoryCapacity());
+    for (SIZE_T i = 0; i < directory.size(); i++) {
+        if ((rc = b.Unserialize(buffercache, directory[i])))
+            return rc;
+        // Each bucket once, from the lowest entry that leads to it
+        if (i >= (1U << GetLocalDepth(b)))
+            continue;
+        shape.leafnodes++;
+        shape.keys += b.info.numkeys;
+    }
+    shape.height = shape.leafnodes ? 2 : 0;
+    if (shape.leafnodes)
+        shape.leaffill = (double) shape.keys / (shape.leafnodes * GetBucketCapacity());
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    Display
+ * Purpose: print the contents of the index
+ */
+ERROR_T HashIndex::Display(ostream &o, BTreeDisplayType display_type) const
+{
+    SIZE_T ks = superblock.info.keysize, vs = superblock.info.valuesize;
+    vector<char> entries;    // every entry, for BTREE_SORTED_KEYVAL
+    vector<SIZE_T> order;    // and where each one starts
+    BTreeNode b;
+    ERROR_T rc;
+
+    if (display_type != BTREE_SORTED_KEYVAL)
+        o << "Directory: depth " << depth << ", " << directory.size() << " entries\n";
+
+    for (SIZE_T i = 0; i < directory.size(); i++) {
+        if ((rc = b.Unserialize(buffercache, directory[i])))
+            return rc;
+        // Each bucket once, from the lowest entry that leads to it
+        SIZE_T localdepth = GetLocalDepth(b);
+        if (i >= (1U << localdepth))
+            continue;
+        if (display_type == BTREE_SORTED_KEYVAL) {
+            for (SIZE_T j = 0; j < b.info.numkeys; j++)
+                order.push_back(entries.size() + j * (ks + vs));
+            entries.insert(entries.end(), ResolveEntry(b, 0), ResolveEntry(b, b.info.numkeys));
+            continue;
+        }
+        o << "Bucket " << directory[i] << " (depth " << localdepth << "): ";
+        for (SIZE_T j = 0; j < b.info.numkeys; j++) {
+            PrintBytes(o, ResolveEntry(b, j), ks);
+            o << " ";
+            PrintBytes(o, ResolveEntry(b, j) + ks, vs);
+            o << " ";
+        }
+        o << "\n";
+    }
+
+    if (display_type == BTREE_SORTED_KEYVAL) {
+        HashEntryLess less;
+        less.order = GetKeyOrder(superblock.info.comparator);
+        less.entries = entries.empty() ? 0 : &entries[0];
+        less.keysize = ks;
+        sort(order.begin(), order.end(), less);
+        for (SIZE_T i = 0; i < order.size(); i++) {
+            o << "(";
+            PrintBytes(o, &entries[order[i]], ks);
+            o << ",";
+            PrintBytes(o, &entries[order[i]] + ks, vs);
+            o << ")\n";
+        }
+    }
+    return ERROR_NOERROR;
+}
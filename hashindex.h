@@ -0,0 +1,94 @@
+#ifndef _hashindex
+#define _hashindex
+
+#include <vector>
+
+#include "btree.h"
+
+//
+// HashIndex is an extendible hash index for workloads of point lookups,
+// which have no use for key order.  It keeps the on-disk conventions of
+// BTreeIndex, and borrows its superblock, free list and buffer cache
+// handling, but in place of the tree it has a directory and buckets.
+//
+// Directory block:
+//
+// PTR SIZE_T SIZE_T SIZE_T ...
+//
+// PTR is the next directory block (0 for the last) and numkeys is the
+// number of entries held here.  Together the chain holds 2^depth entries,
+// where depth is the global depth, each the block number of a bucket.
+// The index keeps the whole directory in memory, so a lookup reads only
+// its bucket.  The superblock's rootnode is the first directory block.
+//
+// Bucket block:
+//
+// DEPTH KEY VALUE KEY VALUE ...
+//
+// DEPTH is the local depth: all the keys of the bucket agree in that many
+// low bits of their hash.  Keys and values are exactly keysize and
+// valuesize bytes, as in the FIXED format, and numkeys counts them.
+//
+// A full bucket is split on the next bit of the hash, doubling the
+// directory first if the bucket was already at the global depth.  Delete
+// leaves buckets as they are; they are not merged.  The index is always
+// a unique one.
+//
+
+// Deepest the directory may get, which bounds it at 2^this entries
+#define HASH_MAX_DEPTH 24
+
+class HashIndex : public BTreeIndex {
+ protected:
+  vector<SIZE_T> directory;   // bucket block for each hash suffix
+  vector<SIZE_T> dirblocks;   // the chain of directory blocks
+  SIZE_T         depth;       // global depth
+
+  SIZE_T  GetBucketCapacity() const;
+  SIZE_T  GetDirectoryCapacity() const;  // entries per directory block
+  SIZE_T  Slot(const KEY_T &key) const;
+  bool    KeysEqual(const char *lhs, const char *rhs) const;
+
+  ERROR_T ReadDirectory();
+  ERROR_T WriteDirectory(const SIZE_T first, const SIZE_T last);
+  ERROR_T GrowDirectory();
+  ERROR_T SplitBucket(const SIZE_T slot);
+  ERROR_T FindInBucket(const KEY_T &key, BTreeNode &bucket, SIZE_T &node, SIZE_T &offset);
+
+  char   *ResolveEntry(const BTreeNode &bucket, const SIZE_T offset) const;
+  SIZE_T  GetLocalDepth(const BTreeNode &bucket) const;
+  void    SetLocalDepth(BTreeNode &bucket, const SIZE_T localdepth) const;
+
+ public:
+  HashIndex(SIZE_T keysize,
+	    SIZE_T valuesize,
+	    BufferCache *cache,
+	    int comparator=BTREE_COMPARE_BYTES);  // decides which keys are equal
+
+  // Attach and Detach work as for a BTreeIndex
+  virtual ERROR_T Attach(const SIZE_T initblock, const bool create=false);
+
+  virtual ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Delete(const KEY_T &key);
+  virtual ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+  // Each key is a bucket read of its own, so a batch is just the Lookups
+  virtual ERROR_T LookupBatch(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+			      vector<ERROR_T> &results);
+
+  // Buckets are changed in place; there are no snapshots
+  virtual ERROR_T CreateSnapshot(SIZE_T &snapshot) { return ERROR_UNIMPL; }
+
+  // With a single value per key, a walk is just the Lookup
+  virtual ERROR_T LookupFirst(const KEY_T &key, BTreeCursor &cursor, VALUE_T &value);
+  virtual ERROR_T LookupNext(BTreeCursor &cursor, VALUE_T &value);
+
+  // The directory blocks are the interior nodes, the buckets the leaves
+  virtual ERROR_T GetShape(BTreeShape &shape) const;
+
+  // BTREE_SORTED_KEYVAL sorts the keys first, in the order of the
+  // comparator; the other types print the directory and each bucket
+  virtual ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH_DOT) const;
+};
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEYCOMPARE_X86 1
+#else
+#define KEYCOMPARE_X86 0
+#endif
+
+#include "keycompare.h"
+
+
+// Orders the first differing word of lhs and rhs.  Words are loaded
+// big-endian so that comparing them as integers orders them like bytes.
+static inline uint64_t LoadBigEndian64(const BYTE_T *p)
+{
+  uint64_t x;
+  memcpy(&x,p,sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  x=__builtin_bswap64(x);
+#endif
+  return x;
+}
+
+static inline uint32_t LoadBigEndian32(const BYTE_T *p)
+{
+  uint32_t x;
+  memcpy(&x,p,sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  x=__builtin_bswap32(x);
+#endif
+  return x;
+}
+
+static inline int CompareWords(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len)
+{
+  SIZE_T i=0;
+
+  for (;i+8<=len;i+=8) {
+    uint64_t l=LoadBigEndian64(lhs+i), r=LoadBigEndian64(rhs+i);
+    if (l!=r) {
+      return l<r ? -1 : 1;
+    }
+  }
+  if (i+4<=len) {
+    uint32_t l=LoadBigEndian32(lhs+i), r=LoadBigEndian32(rhs+i);
+    if (l!=r) {
+      return l<r ? -1 : 1;
+    }
+    i+=4;
+  }
+  for (;i<len;i++) {
+    if (lhs[i]!=rhs[i]) {
+      return (int)lhs[i]-(int)rhs[i];
+    }
+  }
+  return 0;
+}
+
+
+int CompareKeyBytesScalar(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len)
+{
+  // Past a few words the library memcmp has its own vector code
+  return len<=32 ? CompareWords(lhs,rhs,len) : memcmp(lhs,rhs,len);
+}
+
+
+#if KEYCOMPARE_X86
+
+int CompareKeyBytesSSE2(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len)
+{
+  SIZE_T i=0;
+
+  for (;i+16<=len;i+=16) {
+    __m128i l=_mm_loadu_si128((const __m128i *)(lhs+i));
+    __m128i r=_mm_loadu_si128((const __m128i *)(rhs+i));
+    unsigned diff=0xffff & ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(l,r));
+    if (diff) {
+      SIZE_T at=i+__builtin_ctz(diff);
+      return (int)lhs[at]-(int)rhs[at];
+    }
+  }
+  return CompareWords(lhs+i,rhs+i,len-i);
+}
+
+
+__attribute__((target("avx2")))
+int CompareKeyBytesAVX2(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len)
+{
+  SIZE_T i=0;
+
+  for (;i+32<=len;i+=32) {
+    __m256i l=_mm256_loadu_si256((const __m256i *)(lhs+i));
+    __m256i r=_mm256_loadu_si256((const __m256i *)(rhs+i));
+    unsigned diff=~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(l,r));
+    if (diff) {
+      SIZE_T at=i+__builtin_ctz(diff);
+      return (int)lhs[at]-(int)rhs[at];
+    }
+  }
+  if (i+16<=len) {
+    __m128i l=_mm_loadu_si128((const __m128i *)(lhs+i));
+    __m128i r=_mm_loadu_si128((const __m128i *)(rhs+i));
+    unsigned diff=0xffff & ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(l,r));
+    if (diff) {
+      SIZE_T at=i+__builtin_ctz(diff);
+      return (int)lhs[at]-(int)rhs[at];
+    }
+    i+=16;
+  }
+  return CompareWords(lhs+i,rhs+i,len-i);
+}
+
+#endif
+
+
+// Whether the auto kernel uses AVX2 between KEYCOMPARE_SHORT and
+// KEYCOMPARE_LONG bytes, set when the kernel is picked
+static bool autoavx2=false;
+
+int CompareKeyBytesAuto(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len)
+{
+  if (len<=KEYCOMPARE_SHORT) {
+    return CompareWords(lhs,rhs,len);
+  }
+  if (len<=KEYCOMPARE_LONG && autoavx2) {
+    return CompareKeyBytesAVX2(lhs,rhs,len);
+  }
+  return memcmp(lhs,rhs,len);
+}
+
+
+#if !KEYCOMPARE_X86
+
+int CompareKeyBytesSSE2(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len)
+{
+  return CompareKeyBytesScalar(lhs,rhs,len);
+}
+
+int CompareKeyBytesAVX2(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len)
+{
+  return CompareKeyBytesScalar(lhs,rhs,len);
+}
+
+#endif
+
+
+const KeyCompareKernel *KeyCompareKernels()
+{
+#if KEYCOMPARE_X86
+  // Static initializers may run before libgcc has probed the cpu
+  __builtin_cpu_init();
+#endif
+  static const KeyCompareKernel kernels[] = {
+    { "scalar", CompareKeyBytesScalar, true },
+#if KEYCOMPARE_X86
+    { "sse2", CompareKeyBytesSSE2, (bool)__builtin_cpu_supports("sse2") },
+    { "avx2", CompareKeyBytesAVX2, (bool)__builtin_cpu_supports("avx2") },
+#else
+    { "sse2", CompareKeyBytesSSE2, false },
+    { "avx2", CompareKeyBytesAVX2, false },
+#endif
+    { "auto", CompareKeyBytesAuto, true },
+    { 0, 0, false }
+  };
+
+  return kernels;
+}
+
+
+static const KeyCompareKernel *PickKeyCompareKernel()
+{
+  const KeyCompareKernel *k=KeyCompareKernels();
+  const KeyCompareKernel *pick=0;
+  const char *want=getenv("BTREE_KEYCOMPARE");
+
+  for (;k->name;k++) {
+    if (!k->supported) {
+      continue;
+    }
+    // SSE2 loses to the scalar kernel past a few words, so only AVX2
+    // is worth it in the middle
+    if (!strcmp(k->name,"avx2")) {
+      autoavx2=KEYCOMPARE_X86;
+    }
+    if (!strcmp(k->name,want ? want : "auto")) {
+      pick=k;
+    }
+  }
+  if (!pick) {
+    // an unknown or unsupported kernel: fall back to the default
+    for (k=KeyCompareKernels();strcmp(k->name,"auto");k++) {
+    }
+    pick=k;
+  }
+  return pick;
+}
+
+
+static const KeyCompareKernel *chosen=PickKeyCompareKernel();
+
+KeyCompareFn CompareKeyBytes=chosen->fn;
+
+const char *KeyCompareKernelName()
+{
+  return chosen->name;
+}
+
+
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
+int CompareBytes(const char *lhs, const SIZE_T lhslen,
+                 const char *rhs, const SIZE_T rhslen)
+{
+  int rc=CompareKeyBytes((const BYTE_T*)lhs,(const BYTE_T*)rhs,MIN(lhslen,rhslen));
+
+  if (rc) { 
+    return rc;
+  }
+  return lhslen<rhslen ? -1 : lhslen>rhslen ? 1 : 0;
+}
+
+
+template <typename T>
+static inline int CompareInts(const char *lhs, const char *rhs)
+{
+  T l, r;
+  memcpy(&l,lhs,sizeof(T));
+  memcpy(&r,rhs,sizeof(T));
+  return (l>r)-(l<r);
+}
+
+static int CompareU32(const char *lhs, const SIZE_T lhslen, const char *rhs, const SIZE_T rhslen)
+{
+  return CompareInts<uint32_t>(lhs,rhs);
+}
+
+static int CompareU64(const char *lhs, const SIZE_T lhslen, const char *rhs, const SIZE_T rhslen)
+{
+  return CompareInts<uint64_t>(lhs,rhs);
+}
+
+static int CompareI64(const char *lhs, const SIZE_T lhslen, const char *rhs, const SIZE_T rhslen)
+{
+  return CompareInts<int64_t>(lhs,rhs);
+}
+
+static int CompareString(const char *lhs, const SIZE_T lhslen, const char *rhs, const SIZE_T rhslen)
+{
+  return CompareBytes(lhs,strnlen(lhs,lhslen),rhs,strnlen(rhs,rhslen));
+}
+
+
+// Instantiated once per order, so each search loop calls its compare directly
+template <KeyOrderFn Compare>
+static SIZE_T SearchKeys(const char *first, const SIZE_T stride, const SIZE_T n,
+			 const char *key, const SIZE_T keylen, const bool upper)
+{
+  SIZE_T lo=0, hi=n;
+
+  while (lo<hi) {
+    SIZE_T mid=(lo+hi)/2;
+    int rc=Compare(first+mid*stride,keylen,key,keylen);
+    if (upper ? rc<=0 : rc<0) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+static const KeyOrder keyorders[] = {
+  { "bytes", 0, true, CompareBytes, SearchKeys<CompareBytes> },
+  { "u32", sizeof(uint32_t), false, CompareU32, SearchKeys<CompareU32> },
+  { "u64", sizeof(uint64_t), false, CompareU64, SearchKeys<CompareU64> },
+  { "i64", sizeof(int64_t), false, CompareI64, SearchKeys<CompareI64> },
+  { "string", 0, true, CompareString, SearchKeys<CompareString> },
+};
+
+#define NUM_KEYORDERS (sizeof(keyorders)/sizeof(keyorders[0]))
+
+const KeyOrder *GetKeyOrder(const int comparator)
+{
+  if (comparator<0 || (SIZE_T)comparator>=NUM_KEYORDERS) {
+    return 0;
+  }
+  return &keyorders[comparator];
+}
+
+const char *KeyOrderName(const int comparator)
+{
+  const KeyOrder *order=GetKeyOrder(comparator);
+  return order ? order->name : "unknown";
+}
+
+int KeyOrderFromName(const char *name)
+{
+  for (SIZE_T i=0;i<NUM_KEYORDERS;i++) {
+    if (!strcmp(name,keyorders[i].name)) {
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,91 @@
+#ifndef _keycompare
+#define _keycompare
+
+#include "global.h"
+
+//
+// Byte comparison kernels used for key search.
+//
+// Each kernel orders its two inputs like memcmp over len bytes, but
+// only the sign of the result is meaningful.  The scalar kernel works a
+// 64-bit word at a time on short keys; the vector kernels find the first differing
+// byte a whole register at a time.  None reads past len bytes of either
+// input.
+//
+// CompareKeyBytes points at the auto kernel, which goes by the length
+// of the compare: the scalar word compare up to KEYCOMPARE_SHORT bytes,
+// where the vector kernels cost more to set up than they save, AVX2 if
+// the cpu has it up to KEYCOMPARE_LONG, and the library memcmp past
+// that.  Setting BTREE_KEYCOMPARE to the name of a kernel in the
+// environment forces that one instead.  keycompare_bench shows where
+// the crossovers are on a given machine.
+//
+
+#define KEYCOMPARE_SHORT 24
+#define KEYCOMPARE_LONG 128
+
+typedef int (*KeyCompareFn)(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len);
+
+struct KeyCompareKernel {
+  const char   *name;
+  KeyCompareFn  fn;
+  bool          supported;
+};
+
+int CompareKeyBytesScalar(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len);
+int CompareKeyBytesSSE2(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len);
+int CompareKeyBytesAVX2(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len);
+int CompareKeyBytesAuto(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len);
+
+// The kernels built into this binary, scalar first and auto last, ending
+// with a null name
+const KeyCompareKernel *KeyCompareKernels();
+
+extern KeyCompareFn CompareKeyBytes;
+
+// Name of the kernel CompareKeyBytes points at
+const char *KeyCompareKernelName();
+
+
+// Lexicographic comparison of two byte strings, where a proper
+// prefix sorts before any string that extends it
+int CompareBytes(const char *lhs, const SIZE_T lhslen,
+                 const char *rhs, const SIZE_T rhslen);
+
+
+//
+// Key orders an index can be built with.  The one in use is kept in
+// NodeMetadata::comparator.  Integer keys are stored in the byte order
+// of the machine.
+//
+#define BTREE_COMPARE_BYTES 0   // bytewise, a proper prefix first
+#define BTREE_COMPARE_U32 1     // unsigned 32-bit integers
+#define BTREE_COMPARE_U64 2     // unsigned 64-bit integers
+#define BTREE_COMPARE_I64 3     // signed 64-bit integers
+#define BTREE_COMPARE_STRING 4  // NUL-padded strings, compared up to their ends
+
+typedef int (*KeyOrderFn)(const char *lhs, const SIZE_T lhslen,
+			  const char *rhs, const SIZE_T rhslen);
+
+// Offset of the first of n keys, stride bytes apart, that is > key (upper)
+// or >= key (!upper).  The keys must all be keylen bytes long
+typedef SIZE_T (*KeySearchFn)(const char *first, const SIZE_T stride, const SIZE_T n,
+			      const char *key, const SIZE_T keylen, const bool upper);
+
+struct KeyOrder {
+  const char  *name;
+  SIZE_T       width;     // the key size the order needs, or 0 for any
+  bool         prefixes;  // true if a prefix of a key can stand in for it as a separator
+  KeyOrderFn   compare;
+  KeySearchFn  search;    // compare inlined into the search loop
+};
+
+// Gives the order for a BTREE_COMPARE_*, or 0 if there is no such order
+const KeyOrder *GetKeyOrder(const int comparator);
+
+// Maps a BTREE_COMPARE_* to its name ("bytes", "u64", ...) and back.
+// KeyOrderFromName returns -1 for a name it does not know
+const char *KeyOrderName(const int comparator);
+int         KeyOrderFromName(const char *name);
+
+#endif
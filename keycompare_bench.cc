@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include "keycompare.h"
+
+using namespace std;
+
+//
+// Times a linear node search, the way Lookup scans a fixed-format node,
+// with each key compare kernel and with the memcmp call the tree used
+// before.  Keys in a node share a prefix of half their length, so every
+// compare has to look past the start of the key.
+//
+
+void usage()
+{
+  cerr << "usage: keycompare_bench [blocksize [rounds]]\n";
+}
+
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+static int CompareMemcmp(const BYTE_T *lhs, const BYTE_T *rhs, const SIZE_T len)
+{
+  return memcmp(lhs,rhs,len);
+}
+
+
+// Index of the first key in the node greater than probe
+static SIZE_T Search(KeyCompareFn cmp, const BYTE_T *node, SIZE_T stride, SIZE_T n,
+		     const BYTE_T *probe, SIZE_T keysize)
+{
+  SIZE_T i;
+  for (i=0;i<n;i++) {
+    if (cmp(node+i*stride,probe,keysize)>0) {
+      break;
+    }
+  }
+  return i;
+}
+
+
+static double Time(KeyCompareFn cmp, const vector<BYTE_T> &node, SIZE_T stride, SIZE_T n,
+		   const vector<BYTE_T> &probes, SIZE_T keysize, SIZE_T rounds, SIZE_T &check)
+{
+  SIZE_T numprobes=probes.size()/keysize;
+  double start=Now();
+
+  check=0;
+  for (SIZE_T r=0;r<rounds;r++) {
+    for (SIZE_T p=0;p<numprobes;p++) {
+      check+=Search(cmp,&node[0],stride,n,&probes[p*keysize],keysize);
+    }
+  }
+  return Now()-start;
+}
+
+
+static void Fill(BYTE_T *key, SIZE_T keysize, SIZE_T i)
+{
+  // Common prefix, then a big-endian counter so the keys come out sorted
+  memset(key,'k',keysize);
+  for (SIZE_T b=keysize/2;b<keysize && b<keysize/2+sizeof(SIZE_T);b++) {
+    key[b]=(BYTE_T)(i>>(8*(sizeof(SIZE_T)-1-(b-keysize/2))));
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  SIZE_T blocksize=4096;
+  SIZE_T rounds=2000;
+  const SIZE_T keysizes[]={4,8,16,24,32,48,64,128,256};
+  const SIZE_T numprobes=64;
+
+  if (argc>3) {
+    usage();
+    return -1;
+  }
+  if (argc>1) { blocksize=atoi(argv[1]); }
+  if (argc>2) { rounds=atoi(argv[2]); }
+
+  const KeyCompareKernel *kernels=KeyCompareKernels();
+
+  cout << "blocksize "<<blocksize<<", "<<rounds<<" rounds of "<<numprobes
+       << " probes, default kernel "<<KeyCompareKernelName()<<endl;
+  cout << "ns per key compare" <<endl;
+  cout << setw(8) << "keysize" << setw(8) << "keys" << setw(10) << "memcmp";
+  for (const KeyCompareKernel *k=kernels;k->name;k++) {
+    cout << setw(10) << k->name;
+  }
+  cout << endl;
+
+  for (SIZE_T ks=0;ks<sizeof(keysizes)/sizeof(keysizes[0]);ks++) {
+    SIZE_T keysize=keysizes[ks];
+    // Laid out like a fixed-format leaf: key, then a pointer sized value
+    SIZE_T stride=keysize+sizeof(SIZE_T);
+    SIZE_T n=blocksize/stride;
+    vector<BYTE_T> node(n*stride);
+    vector<BYTE_T> probes(numprobes*keysize);
+    SIZE_T expect, check;
+
+    if (n==0) {
+      continue;
+    }
+    for (SIZE_T i=0;i<n;i++) {
+      Fill(&node[i*stride],keysize,2*i);
+    }
+    srand(keysize);
+    for (SIZE_T p=0;p<numprobes;p++) {
+      Fill(&probes[p*keysize],keysize,rand()%(2*n));
+    }
+
+    double base=Time(CompareMemcmp,node,stride,n,probes,keysize,rounds,expect);
+    // Each probe scans to its slot, so about half the node on average
+    double compares=(double)expect+(double)numprobes*rounds;
+
+    cout << setw(8) << keysize << setw(8) << n
+	 << setw(10) << fixed << setprecision(2) << base*1e9/compares;
+    for (const KeyCompareKernel *k=kernels;k->name;k++) {
+      if (!k->supported) {
+	cout << setw(10) << "-";
+	continue;
+      }
+      double t=Time(k->fn,node,stride,n,probes,keysize,rounds,check);
+      if (check!=expect) {
+	cout << setw(10) << "WRONG";
+      } else {
+	cout << setw(10) << fixed << setprecision(2) << t*1e9/compares;
+      }
+    }
+    cout << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,212 @@
+#include <math.h>
+#include <time.h>
+#include <iomanip>
+
+#include "latency.h"
+
+#define SUB_BITS 7
+#define SUB_BUCKETS (1<<SUB_BITS)
+#define HALF_BUCKETS (SUB_BUCKETS/2)
+
+
+// Values below SUB_BUCKETS units get a bucket each.  Above that, a value
+// whose top bit is bit b goes in one of the HALF_BUCKETS buckets of its
+// power of two, by its next SUB_BITS-1 bits
+static SIZE_T Bucket(const uint64_t units)
+{
+  if (units<SUB_BUCKETS) {
+    return units;
+  }
+  SIZE_T shift=63-__builtin_clzll(units)-(SUB_BITS-1);
+  return SUB_BUCKETS+(shift-1)*HALF_BUCKETS+((units>>shift)-HALF_BUCKETS);
+}
+
+
+// The greatest value, in units, that goes in the bucket
+static uint64_t Highest(const SIZE_T bucket)
+{
+  if (bucket<SUB_BUCKETS) {
+    return bucket;
+  }
+  SIZE_T shift=(bucket-SUB_BUCKETS)/HALF_BUCKETS+1;
+  uint64_t top=(bucket-SUB_BUCKETS)%HALF_BUCKETS+HALF_BUCKETS;
+  return ((top+1)<<shift)-1;
+}
+
+
+LatencyHistogram::LatencyHistogram(const double res) :
+  resolution(res), count(0), sum(0), min(0), max(0)
+{}
+
+
+void LatencyHistogram::Record(const double value)
+{
+  double v=value>0 ? value : 0;
+  double units=v/resolution;
+  SIZE_T b=Bucket(units<1.8e19 ? (uint64_t)units : ~(uint64_t)0);
+
+  if (b>=counts.size()) {
+    counts.resize(b+1,0);
+  }
+  counts[b]++;
+  if (count==0 || v<min) {
+    min=v;
+  }
+  if (count==0 || v>max) {
+    max=v;
+  }
+  count++;
+  sum+=v;
+}
+
+
+void LatencyHistogram::Reset()
+{
+  counts.clear();
+  count=0;
+  sum=min=max=0;
+}
+
+
+double LatencyHistogram::Percentile(const double percent) const
+{
+  SIZE_T rank=(SIZE_T)ceil(percent/100*count);
+  SIZE_T seen=0;
+
+  if (rank==0) {
+    return min;
+  }
+  for (SIZE_T b=0;b<counts.size();b++) {
+    seen+=counts[b];
+    if (seen>=rank) {
+      double v=Highest(b)*resolution;
+      return v<max ? (v>min ? v : min) : max;
+    }
+  }
+  return max;
+}
+
+
+static double Now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+
+OpStats::OpStats(const BufferCache *c, const char *const *n) :
+  cache(c), index(0), startwall(0), startdisk(0)
+{
+  for (;*n;n++) {
+    names.push_back(*n);
+  }
+  // Wall clock time to 10ns, disk time to 1us
+  wall.assign(names.size(),LatencyHistogram(0.01));
+  disk.assign(names.size(),LatencyHistogram(0.001));
+  Reset();
+}
+
+
+void OpStats::Snapshot(OpCounts &c) const
+{
+  c.hits=cache->GetNumHits();
+  c.misses=cache->GetNumMisses();
+  c.evictions=cache->GetNumEvictions();
+  c.writebacks=cache->GetNumWritebacks();
+  c.splits=index ? index->GetNumSplits() : 0;
+}
+
+
+void OpStats::Begin()
+{
+  Snapshot(start);
+  startdisk=cache->GetCurrentTime();
+  startwall=Now();
+}
+
+
+void OpStats::End(const SIZE_T op, const bool ok)
+{
+  double now=Now();
+  OpCounts end;
+  OpCounts &c=counts[op];
+
+  Snapshot(end);
+  wall[op].Record((now-startwall)*1e6);
+  disk[op].Record(cache->GetCurrentTime()-startdisk);
+  c.count++;
+  if (!ok) {
+    c.fails++;
+  }
+  c.hits+=end.hits-start.hits;
+  c.misses+=end.misses-start.misses;
+  c.evictions+=end.evictions-start.evictions;
+  c.writebacks+=end.writebacks-start.writebacks;
+  // The index may have been replaced in between
+  if (end.splits>=start.splits) {
+    c.splits+=end.splits-start.splits;
+  }
+}
+
+
+void OpStats::Reset()
+{
+  OpCounts zero={0,0,0,0,0,0,0};
+
+  counts.assign(names.size(),zero);
+  for (SIZE_T i=0;i<names.size();i++) {
+    wall[i].Reset();
+    disk[i].Reset();
+  }
+}
+
+
+static void PrintLatencies(ostream &os, const LatencyHistogram &h, const char *unit)
+{
+  os << setw(9) << unit << fixed << setprecision(3)
+     << setw(11) << h.GetMean()
+     << setw(11) << h.Percentile(50)
+     << setw(11) << h.Percentile(90)
+     << setw(11) << h.Percentile(95)
+     << setw(11) << h.Percentile(99)
+     << setw(11) << h.Percentile(99.9)
+     << setw(11) << h.GetMax() << "\n";
+}
+
+
+ostream & OpStats::Print(ostream &os) const
+{
+  ios::fmtflags flags=os.flags();
+  streamsize precision=os.precision();
+
+  os << left << setw(8) << "op" << right << setw(9) << "count" << setw(7) << "fails"
+     << setw(9) << "time" << setw(11) << "mean" << setw(11) << "p50"
+     << setw(11) << "p90" << setw(11) << "p95" << setw(11) << "p99" << setw(11) << "p99.9"
+     << setw(11) << "max" << "\n";
+  for (SIZE_T i=0;i<names.size();i++) {
+    if (counts[i].count==0) {
+      continue;
+    }
+    os << left << setw(8) << names[i] << right << setw(9) << counts[i].count
+       << setw(7) << counts[i].fails;
+    PrintLatencies(os,wall[i],"wall us");
+    os << setw(24) << "";
+    PrintLatencies(os,disk[i],"disk ms");
+  }
+
+  os << left << setw(8) << "op" << right << setw(11) << "hits" << setw(11) << "misses"
+     << setw(11) << "evictions" << setw(11) << "writebacks" << setw(11) << "splits" << "\n";
+  for (SIZE_T i=0;i<names.size();i++) {
+    const OpCounts &c=counts[i];
+    if (c.count==0) {
+      continue;
+    }
+    os << left << setw(8) << names[i] << right << setw(11) << c.hits
+       << setw(11) << c.misses << setw(11) << c.evictions
+       << setw(11) << c.writebacks << setw(11) << c.splits << "\n";
+  }
+  os.flags(flags);
+  os.precision(precision);
+  return os;
+}
@@ -0,0 +1,97 @@
+#ifndef _latency
+#define _latency
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "global.h"
+#include "buffercache.h"
+#include "btree.h"
+
+using namespace std;
+
+//
+// A histogram of latencies in the manner of HdrHistogram.  Values are
+// counted in units of resolution, in buckets whose width doubles with
+// each power of two, split into 64 sub-buckets, so any value is kept to
+// within 1/64 of itself however large it is.  Buckets are added as
+// larger values arrive; a histogram of values below 128 units has 128
+// counts.  The least and greatest values are kept exactly.
+//
+
+class LatencyHistogram {
+ protected:
+  vector<SIZE_T> counts;
+  double resolution;
+  SIZE_T count;
+  double sum, min, max;
+
+ public:
+  LatencyHistogram(const double resolution=0.001);
+
+  void   Record(const double value);
+  void   Reset();
+
+  SIZE_T GetCount() const { return count; }
+  double GetMin() const { return min; }
+  double GetMax() const { return max; }
+  double GetMean() const { return count ? sum/count : 0; }
+  // The least value that percent percent of the values are at or below,
+  // to the precision of the buckets
+  double Percentile(const double percent) const;
+};
+
+
+//
+// Latencies and cache and tree activity by kind of operation.  Begin
+// notes the time and the counters of the cache and the index before an
+// operation, and End charges what changed since to the operation, with
+// wall clock time in microseconds and simulated disk time in
+// milliseconds.  Operations are numbered as in the array of names the
+// stats are built with, which ends with a 0.
+//
+
+struct OpCounts {
+  SIZE_T count, fails;
+  SIZE_T hits, misses, evictions, writebacks, splits;
+};
+
+class OpStats {
+ protected:
+  const BufferCache  *cache;
+  const BTreeIndex   *index;
+  vector<string>      names;
+  vector<LatencyHistogram> wall, disk;
+  vector<OpCounts>    counts;
+
+  // As of the last Begin
+  double startwall, startdisk;
+  OpCounts start;
+
+  void Snapshot(OpCounts &c) const;
+
+ public:
+  OpStats(const BufferCache *cache, const char *const *names);
+
+  // The index whose splits are counted, which may change between Begins
+  void SetIndex(const BTreeIndex *i) { index=i; }
+
+  void Begin();
+  void End(const SIZE_T op, const bool ok=true);
+  void Reset();
+
+  SIZE_T GetNumOps() const { return names.size(); }
+  const OpCounts &GetCounts(const SIZE_T op) const { return counts[op]; }
+  const LatencyHistogram &GetWallTime(const SIZE_T op) const { return wall[op]; }
+  const LatencyHistogram &GetDiskTime(const SIZE_T op) const { return disk[op]; }
+
+  // A table of the operations that ran, with the percentiles of their
+  // latencies and what they did in the cache and the tree
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const OpStats &s) { return s.Print(os); }
+
+#endif
@@ -0,0 +1,376 @@
+#include <string.h>
+#include "lsmindex.h"
+
+
+static MemtableLess MakeLess(const int comparator)
+{
+    MemtableLess less;
+    less.order = GetKeyOrder(comparator);
+    return less;
+}
+
+
+LSMIndex::LSMIndex(SIZE_T keysize,
+                   SIZE_T valuesize,
+                   BufferCache *cache,
+                   int format,
+                   int comparator,
+                   SIZE_T cap) :
+    BTreeIndex(keysize, valuesize, cache, true, format, comparator),
+    memtable(MakeLess(comparator)),
+    capacity(cap ? cap : 1),
+    merges(0)
+{
+}
+
+
+/*
+ * Name:    Attach
+ * Purpose: open the tree under the memtable, creating it first if asked to
+ * Params:  const SIZE_T initblock
+ *          const bool create
+ */
+ERROR_T LSMIndex::Attach(const SIZE_T initblock, const bool create)
+{
+    ERROR_T rc;
+
+    // A BUFFERED tree already holds writes back, above its leaves
+    if (create && (!superblock.info.unique || superblock.info.format == BTREE_FORMAT_BUFFERED))
+        return ERROR_BADCONFIG;
+    if ((rc = BTreeIndex::Attach(initblock, create)))
+        return rc;
+    // The tree may have been built with another comparator
+    memtable = Memtable(MakeLess(superblock.info.comparator));
+    if (!superblock.info.unique || superblock.info.format == BTREE_FORMAT_BUFFERED)
+        return ERROR_BADCONFIG;
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    Detach
+ * Purpose: merge what is left in the memtable, then close the tree
+ * Params:  SIZE_T &initblock
+ */
+ERROR_T LSMIndex::Detach(SIZE_T &initblock)
+{
+    ERROR_T rc;
+
+    if ((rc = Merge()))
+        return rc;
+    return BTreeIndex::Detach(initblock);
+}
+
+
+/*
+ * Name:    Merge
+ * Purpose: move the memtable into the tree, in key order
+ *
+ * Consecutive keys mostly land in the same leaf, which is still in the
+ * buffer cache, so the tree is written out about a leaf at a time.  An
+ * entry leaves the memtable as soon as the tree has it, so a merge that
+ * fails part way can be run again
+ */
+ERROR_T LSMIndex::Merge()
+{
+    KEY_T key;
+    VALUE_T value;
+    ERROR_T rc;
+
+    if (memtable.empty())
+        return ERROR_NOERROR;
+    merges++;
+    while (!memtable.empty()) {
+        Memtable::iterator e = memtable.begin();
+        key.Resize(e->first.size(), false);
+        memcpy(key.data, e->first.data(), e->first.size());
+        value.Resize(e->second.value.size(), false);
+        memcpy(value.data, e->second.value.data(), e->second.value.size());
+        if (e->second.intree)
+            rc = BTreeIndex::Update(key, value);
+        else
+            rc = BTreeIndex::Insert(key, value);
+        if (rc)
+            return rc;
+        memtable.erase(e);
+    }
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    Insert
+ * Purpose: add the pair to the memtable, merging it if that fills it
+ * Params:  const KEY_T &key,
+ *          const VALUE_T &value
+ */
+ERROR_T LSMIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+    string k((const char *) key.data, key.length);
+    VALUE_T old;
+    ERROR_T rc;
+
+    if (WrongSize(key.length, superblock.info.keysize) ||
+        WrongSize(value.length, superblock.info.valuesize))
+        return ERROR_SIZE;
+    if (memtable.find(k) != memtable.end())
+        return ERROR_CONFLICT;
+    // The Bloom filter, if there is one, usually answers this without a read
+    rc = BTreeIndex::Lookup(key, old);
+    if (rc == ERROR_NOERROR)
+        return ERROR_CONFLICT;
+    if (rc != ERROR_NONEXISTENT)
+        return rc;
+
+    MemtableEntry &e = memtable[k];
+    e.value.assign((const char *) value.data, value.length);
+    e.intree = false;
+    return memtable.size() >= capacity ? Merge() : ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    Update
+ * Purpose: give an existing key a new value in the memtable
+ * Params:  const KEY_T &key
+ *          const VALUE_T &value
+ */
+ERROR_T LSMIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+    string k((const char *) key.data, key.length);
+    VALUE_T old;
+    ERROR_T rc;
+
+    if (WrongSize(key.length, superblock.info.keysize) ||
+        WrongSize(value.length, superblock.info.valuesize))
+        return ERROR_SIZE;
+
+    Memtable::iterator i = memtable.find(k);
+    if (i != memtable.end()) {
+        i->second.value.assign((const char *) value.data, value.length);
+        return ERROR_NOERROR;
+    }
+    if ((rc = BTreeIndex::Lookup(key, old)))
+        return rc;
+
+    MemtableEntry &e = memtable[k];
+    e.value.assign((const char *) value.data, value.length);
+    e.intree = true;
+    return memtable.size() >= capacity ? Merge() : ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    Lookup
+ * Purpose: return the value of the key, from the memtable if it is there
+ * Params:  const KEY_T &key,
+ *          VALUE_T &value
+ */
+ERROR_T LSMIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+    Memtable::const_iterator i = memtable.find(string((const char *) key.data, key.length));
+    ERROR_T rc;
+
+    if (i == memtable.end())
+        return BTreeIndex::Lookup(key, value);
+    if ((rc = value.Resize(i->second.value.size(), false)))
+        return rc;
+    memcpy(value.data, i->second.value.data(), i->second.value.size());
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    LookupBatch
+ * Purpose: look up many keys, in the memtable and then, together, the tree
+ * Params:  const vector<KEY_T> &keys
+ *          vector<VALUE_T> &values
+ *          vector<ERROR_T> &results
+ */
+ERROR_T LSMIndex::LookupBatch(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+                              vector<ERROR_T> &results)
+{
+    vector<KEY_T> misses;
+    vector<SIZE_T> where;
+    vector<VALUE_T> treevalues;
+    vector<ERROR_T> treeresults;
+
+    values.resize(keys.size());
+    results.assign(keys.size(), ERROR_NOERROR);
+    for (SIZE_T i = 0; i < keys.size(); i++) {
+        Memtable::const_iterator m = memtable.find(string((const char *) keys[i].data,
+                                                          keys[i].length));
+        if (m == memtable.end()) {
+            misses.push_back(keys[i]);
+            where.push_back(i);
+        } else if ((results[i] = values[i].Resize(m->second.value.size(), false)) == ERROR_NOERROR) {
+            memcpy(values[i].data, m->second.value.data(), m->second.value.size());
+        }
+    }
+    if (!misses.empty()) {
+        BTreeIndex::LookupBatch(misses, treevalues, treeresults);
+        for (SIZE_T j = 0; j < where.size(); j++) {
+            values[where[j]] = treevalues[j];
+            results[where[j]] = treeresults[j];
+        }
+    }
+    for (SIZE_T i = 0; i < keys.size(); i++)
+        if (results[i] != ERROR_NOERROR && results[i] != ERROR_NONEXISTENT)
+            return results[i];
+    return ERROR_NOERROR;
+}
+
+
+/*
+ * Name:    CreateSnapshot
+ * Purpose: take a snapshot, of the tree once the memtable is merged in
+ * Params:  SIZE_T &snapshot
+ */
+ERROR_T LSMIndex::CreateSnapshot(SIZE_T &snapshot)
+{
+    ERROR_T rc;
+
+    if ((rc = Merge()))
+        return rc;
+    return BTreeIndex::CreateSnapshot(snapshot);
+}
+
+
+/*
+ * Name:    ExportMetrics
+ * Purpose: add the measurements of the memtable and the tree to m
+ * Params:  Metrics &m
+ */
+ERROR_T LSMIndex::ExportMetrics(Metrics &m) const
+{
+    m.AddGauge("btree_lsm_memtable_entries", "Entries in the memtable", memtable.size());
+    m.AddGauge("btree_lsm_memtable_capacity", "Entries the memtable holds before a merge", capacity);
+    m.AddCounter("btree_lsm_merges_total", "Merges of the memtable into the tree", merges);
+    return BTreeIndex::ExportMetrics(m);
+}
+
+
+ERROR_T LSMIndex::LookupFirst(const KEY_T &key, BTreeCursor &cursor, VALUE_T &value)
+{
+    cursor.key = key;
+    cursor.node = 0;
+    return Lookup(key, value);
+}
+
+
+static void PrintBytes(ostream &o, const char *p, const SIZE_T len)
+{
+    for (SIZE_T i = 0; i < len; i++)
+        o << p[i];
+}
+
+static void PrintPair(ostream &o, const char *k, const SIZE_T klen,
+                      const char *v, const SIZE_T vlen)
+{
+    o << "(";
+    PrintBytes(o, k, klen);
+    o << ",";
+    PrintBytes(o, v, vlen);
+    o << ")\n";
+}
+
+
+/*
+ * DisplayMerged
+ *
+ * Prints the pairs under node in key order, and in among them the
+ * memtable's entries from m on that come before the last of them.
+ * The walk goes down the tree rather than along the chain of leaves,
+ * which copies for snapshots leave pointing at old leaves
+ */
+ERROR_T LSMIndex::DisplayMerged(const SIZE_T node, Memtable::const_iterator &m,
+                                ostream &o) const
+{
+    const KeyOrder *order = GetKeyOrder(superblock.info.comparator);
+    BTreeNode b;
+    SIZE_T offset, ptr;
+    KEY_T key;
+    VALUE_T value;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    switch (b.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (b.info.numkeys == 0)
+                return ERROR_NOERROR;
+            for (offset = 0; offset <= b.info.numkeys; offset++) {
+                if ((rc = b.GetPtr(offset, ptr)))
+                    return rc;
+                if ((rc = DisplayMerged(ptr, m, o)))
+                    return rc;
+            }
+            return ERROR_NOERROR;
+        case BTREE_LEAF_NODE:
+            for (offset = 0; offset < b.info.numkeys; offset++) {
+                if ((rc = b.GetKey(offset, key)))
+                    return rc;
+                int cmp = -1;
+                for (; m != memtable.end(); m++) {
+                    cmp = order->compare(m->first.data(), m->first.size(),
+                                         (const char *) key.data, key.length);
+                    if (cmp >= 0)
+                        break;
+                    PrintPair(o, m->first.data(), m->first.size(),
+                              m->second.value.data(), m->second.value.size());
+                }
+                if (m != memtable.end() && cmp == 0) {
+                    // The memtable holds the newer value
+                    PrintPair(o, m->first.data(), m->first.size(),
+                              m->second.value.data(), m->second.value.size());
+                    m++;
+                    continue;
+                }
+                if (b.IsOverflowVal(offset)) {
+                    OverflowRef ref;
+                    b.GetOverflowVal(offset, ref);
+                    rc = ReadOverflow(buffercache, ref, value);
+                } else {
+                    rc = b.GetVal(offset, value);
+                }
+                if (rc)
+                    return rc;
+                PrintPair(o, (const char *) key.data, key.length,
+                          (const char *) value.data, value.length);
+            }
+            return ERROR_NOERROR;
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+/*
+ * Name:    Display
+ * Purpose: print the contents of the index
+ */
+ERROR_T LSMIndex::Display(ostream &o, BTreeDisplayType display_type) const
+{
+    Memtable::const_iterator m = memtable.begin();
+    ERROR_T rc;
+
+    if (display_type != BTREE_SORTED_KEYVAL) {
+        if ((rc = BTreeIndex::Display(o, display_type)))
+            return rc;
+        if (display_type == BTREE_DEPTH) {
+            o << "Memtable: " << memtable.size() << " entries\n";
+            for (; m != memtable.end(); m++)
+                PrintPair(o, m->first.data(), m->first.size(),
+                          m->second.value.data(), m->second.value.size());
+        }
+        return ERROR_NOERROR;
+    }
+
+    if ((rc = DisplayMerged(superblock.info.rootnode, m, o)))
+        return rc;
+    for (; m != memtable.end(); m++)
+        PrintPair(o, m->first.data(), m->first.size(),
+                  m->second.value.data(), m->second.value.size());
+    return ERROR_NOERROR;
+}
@@ -0,0 +1,93 @@
+#ifndef _lsmindex
+#define _lsmindex
+
+#include <map>
+#include <string>
+
+#include "btree.h"
+
+//
+// LSMIndex puts an in-memory memtable in front of a BTreeIndex, for
+// workloads that write a lot before they read.  Inserts and updates go
+// to the memtable, which keeps them sorted by key.  Once it holds as many
+// entries as it was sized for, it is frozen and merged into the tree in
+// a single pass in key order, so the leaves are visited left to right
+// and each is written back once per merge rather than once per insert.
+//
+// A lookup checks the memtable, then the tree.  The memtable is not
+// stored; Detach merges it, so nothing is lost between attaches.
+//
+// The tree under it may have any node format but BUFFERED, which holds
+// writes back itself, and the index is always a unique one.  An entry
+// records whether its key was already in the tree, which tells the
+// merge whether to update or insert it.
+//
+
+// Entries the memtable holds unless told otherwise
+#define LSM_DEFAULT_MEMTABLE 4096
+
+struct MemtableEntry {
+  string value;
+  bool   intree;    // the key is in the tree, under an older value
+};
+
+// Orders memtable keys as the tree orders its keys
+struct MemtableLess {
+  const KeyOrder *order;
+
+  bool operator()(const string &lhs, const string &rhs) const {
+    return order->compare(lhs.data(), lhs.size(), rhs.data(), rhs.size()) < 0;
+  }
+};
+
+typedef map<string, MemtableEntry, MemtableLess> Memtable;
+
+class LSMIndex : public BTreeIndex {
+ protected:
+  Memtable memtable;
+  SIZE_T   capacity;   // entries the memtable holds before a merge
+  SIZE_T   merges;
+
+  ERROR_T DisplayMerged(const SIZE_T node, Memtable::const_iterator &m, ostream &o) const;
+
+ public:
+  LSMIndex(SIZE_T keysize,
+	   SIZE_T valuesize,
+	   BufferCache *cache,
+	   int format=BTREE_FORMAT_FIXED,         // of the tree
+	   int comparator=BTREE_COMPARE_BYTES,
+	   SIZE_T capacity=LSM_DEFAULT_MEMTABLE);
+
+  virtual ERROR_T Attach(const SIZE_T initblock, const bool create=false);
+  // Merges the memtable before writing out the superblock
+  virtual ERROR_T Detach(SIZE_T &initblock);
+
+  // Moves everything in the memtable into the tree, leaving it empty
+  ERROR_T Merge();
+
+  SIZE_T GetNumMerges() const { return merges; }
+  SIZE_T GetMemtableSize() const { return memtable.size(); }
+
+  virtual ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  virtual ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+  // The keys the memtable does not have go to the tree as one batch
+  virtual ERROR_T LookupBatch(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+			      vector<ERROR_T> &results);
+
+  // The memtable is merged first, so the snapshot is of the tree alone
+  virtual ERROR_T CreateSnapshot(SIZE_T &snapshot);
+
+  // Adds the memtable's size and merges to those of the tree
+  virtual ERROR_T ExportMetrics(Metrics &m) const;
+
+  // With a single value per key, a walk is just the Lookup
+  virtual ERROR_T LookupFirst(const KEY_T &key, BTreeCursor &cursor, VALUE_T &value);
+
+  // BTREE_SORTED_KEYVAL merges the memtable into the tree's pairs as
+  // they are printed; the other types print the tree, and BTREE_DEPTH
+  // then the memtable
+  virtual ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH_DOT) const;
+};
+
+#endif
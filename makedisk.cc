@@ -6,16 +6,42 @@
 
 void usage() 
 {
-  cerr << "usage: makedisk filestem blocks blocksize heads blockspertrack tracks avgseek trackseek rotlat\n";
+  cerr << "usage: makedisk filestem blocks blocksize heads blockspertrack tracks avgseek trackseek rotlat\n"
+       << "         [ssd channels pagereadlat pageprogramlat eraselat pagesperblock writeamp]\n"
+       << "         [raid0 disks stripeblocks]\n";
 }
 
 int main(int argc, char *argv[])
 {
+  DeviceModel device;
+
   if (argc<10) { 
     usage();
     exit(-1);
   }
 
+  // The device is a rotating disk unless it says otherwise
+  if (argc>10) {
+    device.type=DeviceFromName(argv[10]);
+    if (!((device.type==DISK_DEVICE_SSD && argc==17) ||
+	  (device.type==DISK_DEVICE_RAID0 && argc==13) ||
+	  (device.type==DISK_DEVICE_DISK && argc==11))) {
+      usage();
+      exit(-1);
+    }
+    if (device.type==DISK_DEVICE_SSD) {
+      device.channels=atoi(argv[11]);
+      device.pagereadlatency=atof(argv[12]);
+      device.pageprogramlatency=atof(argv[13]);
+      device.eraselatency=atof(argv[14]);
+      device.pagesperblock=atoi(argv[15]);
+      device.writeamplification=atof(argv[16]);
+    } else if (device.type==DISK_DEVICE_RAID0) {
+      device.disks=atoi(argv[11]);
+      device.stripeblocks=atoi(argv[12]);
+    }
+  }
+
   DiskSystem disk(argv[1],
 		  true,
 		  0,
@@ -26,7 +52,8 @@ int main(int argc, char *argv[])
 		  atoi(argv[6]),
 		  atof(argv[7]),
 		  atof(argv[8]),
-		  atof(argv[9]));
+		  atof(argv[9]),
+		  device);
   
   
   cerr << "Disk is as follows.\n" << disk << "\n";
@@ -0,0 +1,112 @@
+#include <iomanip>
+#include <sstream>
+
+#include "metrics.h"
+
+
+void Metrics::Add(const string &name, const string &help, const char *type, const double value)
+{
+  Metric m;
+  m.name=name;
+  m.help=help;
+  m.type=type;
+  m.value=value;
+  metrics.push_back(m);
+}
+
+
+void Metrics::AddCounter(const string &name, const string &help, const double value)
+{
+  Add(name,help,"counter",value);
+}
+
+
+void Metrics::AddGauge(const string &name, const string &help, const double value)
+{
+  Add(name,help,"gauge",value);
+}
+
+
+void Metrics::AddHistogram(const string &name, const string &help,
+			   const vector<double> &bounds, const vector<SIZE_T> &counts,
+			   const double sum)
+{
+  SIZE_T total=0;
+
+  Add(name,help,"histogram",sum);
+  Metric &m=metrics.back();
+  m.bounds=bounds;
+  for (SIZE_T i=0;i<=bounds.size();i++) {
+    total+=i<counts.size() ? counts[i] : 0;
+    m.counts.push_back(total);
+  }
+}
+
+
+// Enough digits to tell doubles apart, without trailing noise for the
+// counts and simple fractions most metrics are
+static string Number(const double v)
+{
+  ostringstream s;
+  s << setprecision(12) << v;
+  return s.str();
+}
+
+
+static string Quote(const string &s)
+{
+  string q="\"";
+  for (SIZE_T i=0;i<s.size();i++) {
+    if (s[i]=='"' || s[i]=='\\') {
+      q+='\\';
+    }
+    q+=s[i];
+  }
+  return q+"\"";
+}
+
+
+ostream & Metrics::PrintJSON(ostream &os) const
+{
+  os << "{";
+  for (SIZE_T i=0;i<metrics.size();i++) {
+    const Metric &m=metrics[i];
+    os << (i ? ",\n " : "\n ") << Quote(m.name) << ": ";
+    if (m.type!="histogram") {
+      os << Number(m.value);
+      continue;
+    }
+    os << "{\"count\": " << m.counts.back() << ", \"sum\": " << Number(m.value)
+       << ", \"buckets\": [";
+    for (SIZE_T b=0;b<m.counts.size();b++) {
+      os << (b ? ", " : "") << "{\"le\": "
+	 << (b<m.bounds.size() ? Number(m.bounds[b]) : string("\"+Inf\""))
+	 << ", \"count\": " << m.counts[b] << "}";
+    }
+    os << "]}";
+  }
+  os << "\n}\n";
+  return os;
+}
+
+
+ostream & Metrics::PrintPrometheus(ostream &os) const
+{
+  for (SIZE_T i=0;i<metrics.size();i++) {
+    const Metric &m=metrics[i];
+    os << "# HELP " << m.name << " " << m.help << "\n"
+       << "# TYPE " << m.name << " " << m.type << "\n";
+    if (m.type!="histogram") {
+      os << m.name << " " << Number(m.value) << "\n";
+      continue;
+    }
+    for (SIZE_T b=0;b<m.counts.size();b++) {
+      os << m.name << "_bucket{le=\""
+	 << (b<m.bounds.size() ? Number(m.bounds[b]) : string("+Inf"))
+	 << "\"} " << m.counts[b] << "\n";
+    }
+    os << m.name << "_sum " << Number(m.value) << "\n"
+       << m.name << "_count " << m.counts.back() << "\n";
+  }
+  return os;
+}
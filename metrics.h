@@ -0,0 +1,56 @@
+#ifndef _metrics
+#define _metrics
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// A set of named measurements, gathered from the parts of the system
+// (see the ExportMetrics methods of DiskSystem, BufferCache and
+// BTreeIndex) and written out as JSON or in the Prometheus text format.
+//
+// A counter only ever grows, a gauge is a value as of now, and a
+// histogram counts values into buckets with the given upper bounds,
+// plus one for the values above them all.  Names follow the Prometheus
+// conventions: btree_ first, the unit last, and _total for a counter.
+//
+
+class Metrics {
+ protected:
+  struct Metric {
+    string         name;
+    string         help;
+    string         type;    // "counter", "gauge" or "histogram"
+    double         value;   // or, for a histogram, the sum of the values
+    vector<double> bounds;
+    vector<SIZE_T> counts;  // cumulative, with the +Inf bucket last
+  };
+  vector<Metric> metrics;
+
+  void Add(const string &name, const string &help, const char *type, const double value);
+
+ public:
+  void AddCounter(const string &name, const string &help, const double value);
+  void AddGauge(const string &name, const string &help, const double value);
+  // counts has a count for each bound, of the values above the bound
+  // before it, then a last one for the values above every bound
+  void AddHistogram(const string &name, const string &help,
+		    const vector<double> &bounds, const vector<SIZE_T> &counts,
+		    const double sum);
+
+  void   Clear() { metrics.clear(); }
+  SIZE_T GetNumMetrics() const { return metrics.size(); }
+
+  ostream & PrintJSON(ostream &os) const;
+  ostream & PrintPrometheus(ostream &os) const;
+};
+
+// Divides, giving 0 rather than NaN when there is nothing to divide
+inline double Ratio(const double num, const double den) { return den>0 ? num/den : 0; }
+
+#endif
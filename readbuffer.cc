@@ -1,4 +1,6 @@
 #include <string>
+#include <vector>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "buffercache.h"
@@ -6,18 +8,30 @@
 
 void usage() 
 {
-  cerr << "usage: readbuffer cachesize filestem blocknum numblocks > data\n";
+  cerr << "usage: readbuffer cachesize filestem blocknum numblocks [blocknum numblocks ...] > data\n";
+  cerr << "       readbuffer cachesize filestem - < ranges > data\n";
+  cerr << "  with -, reads a \"blocknum numblocks\" range from each line of stdin\n";
 }
 
 int main(int argc, char *argv[])
 {
-  if (argc<5) { 
+  if (argc<4 || (string(argv[3])!="-" && (argc<5 || argc%2==0))) { 
     usage();
     exit(-1);
   }
   SIZE_T cachesize=atoi(argv[1]);
-  SIZE_T blocknum=atoi(argv[3]);
-  SIZE_T numblocks=atoi(argv[4]);
+  vector<pair<SIZE_T,SIZE_T> > ranges;
+
+  if (string(argv[3])=="-") {
+    SIZE_T blocknum, numblocks;
+    while (scanf("%u %u",&blocknum,&numblocks)==2) {
+      ranges.push_back(make_pair(blocknum,numblocks));
+    }
+  } else {
+    for (int a=3;a+1<argc;a+=2) {
+      ranges.push_back(make_pair((SIZE_T)atoi(argv[a]),(SIZE_T)atoi(argv[a+1])));
+    }
+  }
 
   DiskSystem disk(argv[2]);
   BufferCache cache(&disk,cachesize);
@@ -26,16 +40,17 @@ int main(int argc, char *argv[])
 
   cache.Attach();
 
-  for (unsigned i=blocknum;i<(blocknum+numblocks);i++) { 
-    Block block(blocksize);
-    ERROR_T rc;
-    rc=cache.ReadBlock(i,block);
-    if (rc!=ERROR_NOERROR) { 
-      cerr << "Error " << rc <<" occured when reading block "<< i << endl;
-      return -1;
-    }
-    for (SIZE_T j=0;j<block.length;j++) { 
-      cout << block.data[j];
+  // Every range goes through the one cache
+  Block block(blocksize);
+  for (SIZE_T r=0;r<ranges.size();r++) {
+    for (SIZE_T i=ranges[r].first;i<ranges[r].first+ranges[r].second;i++) { 
+      ERROR_T rc;
+      rc=cache.ReadBlock(i,block);
+      if (rc!=ERROR_NOERROR) { 
+	cerr << "Error " << rc <<" occured when reading block "<< i << endl;
+	return -1;
+      }
+      cout.write((const char *)block.data,block.length);
     }
   }
 
@@ -49,6 +64,10 @@ int main(int argc, char *argv[])
   cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
   cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
   cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << "numhits         = "<<cache.GetNumHits()<<endl;
+  cerr << "nummisses       = "<<cache.GetNumMisses()<<endl;
+  cerr << "numevictions    = "<<cache.GetNumEvictions()<<endl;
+  cerr << "numwritebacks   = "<<cache.GetNumWritebacks()<<endl;
   cerr << endl;
 
   cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
@@ -0,0 +1,388 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "session.h"
+#include "btree_fixed.h"
+#include "hashindex.h"
+#include "lsmindex.h"
+#include "metrics.h"
+
+
+static const char *opnames[] = {"insert", "update", "delete", "lookup", "scan", "batch", 0};
+
+
+// The cache goes first, since measuring the tree reads through it
+ERROR_T PrintMetrics(ostream &o, const BufferCache &cache, const BTreeIndex *btree,
+		     const string &format)
+{
+  Metrics m;
+  ERROR_T rc;
+
+  cache.ExportMetrics(m);
+  if ((rc=btree->ExportMetrics(m))!=ERROR_NOERROR) {
+    return rc;
+  }
+  if (format == "json") {
+    m.PrintJSON(o);
+  } else {
+    m.PrintPrometheus(o);
+  }
+  return ERROR_NOERROR;
+}
+
+
+string NextWord(const char *&p)
+{
+  const char *start;
+
+  while (*p && isspace((unsigned char)*p)) {
+    p++;
+  }
+  for (start=p; *p && !isspace((unsigned char)*p); p++) {
+  }
+  return string(start,p-start);
+}
+
+
+void SetBlock(Block &b, const char *data, const SIZE_T len)
+{
+  if (b.length!=len && b.Resize(len,false)!=ERROR_NOERROR) {
+    throw GenericException();
+  }
+  memcpy(b.data,data,len);
+}
+
+
+void RunKeyLines(FILE *file, ostream &o, BTreeIndex &index, KeyLineOp op,
+		 const bool withresult, const char *name)
+{
+  static char line[1 << 20];
+  KEY_T key;
+  VALUE_T value, result;
+  SIZE_T ops=0, fails=0;
+
+  while (fgets(line,sizeof(line),file)) {
+    const char *p=line;
+    string keyword=NextWord(p), valueword=NextWord(p);
+    if (keyword=="") {
+      continue;
+    }
+    SetBlock(key,keyword.data(),keyword.size());
+    SetBlock(value,valueword.data(),valueword.size());
+    ops++;
+    if (op(index,key,value,result)!=ERROR_NOERROR) {
+      fails++;
+      o << "FAIL\n";
+    } else if (withresult) {
+      o << "OK ";
+      o.write((const char *)result.data,result.length);
+      o << "\n";
+    } else {
+      o << "OK\n";
+    }
+  }
+  cerr << ops << " " << name << ", " << fails << " failed\n";
+}
+
+
+Session::Session(BufferCache *c) :
+  cache(c), btree(0), unique(true), bloombits(0), stats(c,opnames)
+{}
+
+
+Session::~Session()
+{
+  if (btree) {
+    delete btree;
+  }
+}
+
+
+bool Session::Init(const char *p)
+{
+  int fmt = BTREE_FORMAT_FIXED, cmp = BTREE_COMPARE_BYTES;
+  bool ok = true, hash = false;
+  int pinlevels = -1;
+  SIZE_T memtable = 0;
+  string option;
+  ERROR_T rc;
+
+  int keysize = atoi(NextWord(p).c_str());
+  int valuesize = atoi(NextWord(p).c_str());
+
+  unique = true;
+  bloombits = 0;
+  metrics = "";
+  while ((option=NextWord(p)) != "") {
+    if (option == "duplicates") {
+      unique = false;
+    } else if (option == "hash") {
+      hash = true;
+    } else if (option == "bloom") {
+      bloombits = 10;
+    } else if (option.compare(0,6,"bloom=")==0 && atoi(option.c_str()+6)>0) {
+      bloombits = atoi(option.c_str()+6);
+    } else if (option == "lsm") {
+      memtable = LSM_DEFAULT_MEMTABLE;
+    } else if (option.compare(0,4,"lsm=")==0 && atoi(option.c_str()+4)>0) {
+      memtable = atoi(option.c_str()+4);
+    } else if (option == "metrics=json" || option == "metrics=prometheus") {
+      metrics = option.substr(8);
+    } else if (option.compare(0,4,"pin=")==0 && option.size()>4) {
+      pinlevels = atoi(option.c_str()+4);
+    } else if (FormatFromName(option.c_str())>=0) {
+      fmt = FormatFromName(option.c_str());
+    } else if (KeyOrderFromName(option.c_str())>=0) {
+      cmp = KeyOrderFromName(option.c_str());
+    } else {
+      cerr << "Unknown INIT option "<<option<<"\n";
+      ok = false;
+    }
+  }
+  if (hash && (fmt!=BTREE_FORMAT_FIXED || !unique || bloombits || memtable)) {
+    cerr << "A hash index has no node format, duplicates, filter or memtable\n";
+    ok = false;
+  }
+  if (memtable && (!unique || fmt==BTREE_FORMAT_BUFFERED)) {
+    cerr << "A memtable needs a unique index that is not buffered\n";
+    ok = false;
+  }
+  if (!ok) {
+    return false;
+  }
+  if (btree) {
+    delete btree;
+  }
+  if (hash) {
+    btree = new HashIndex(keysize,valuesize,cache,cmp);
+  } else if (memtable) {
+    btree = new LSMIndex(keysize,valuesize,cache,fmt,cmp,memtable);
+  } else if (!unique) {
+    btree = new BTreeIndex(keysize,valuesize,cache,false,fmt,cmp);
+  } else if (fmt==BTREE_FORMAT_FIXED && keysize==8 && valuesize==8 &&
+	     cmp==BTREE_COMPARE_BYTES) {
+    // the common cases get the specialized index
+    btree = new BTreeIndexT<8,8,BigEndianU64KeyCompare>(cache);
+  } else if (fmt==BTREE_FORMAT_FIXED && keysize==8 && valuesize==8 &&
+	     cmp==BTREE_COMPARE_U64) {
+    btree = new BTreeIndexT<8,8,U64KeyCompare>(cache);
+  } else {
+    btree = new BTreeIndex(keysize,valuesize,cache,true,fmt,cmp);
+  }
+  btree->UseFilter(bloombits);
+  if (pinlevels>=0 && !hash) {
+    btree->PinLevels(pinlevels);
+  }
+  if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
+    cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
+    delete btree;
+    btree = 0;
+    return false;
+  }
+  stats.SetIndex(btree);
+  return true;
+}
+
+
+bool Session::Deinit()
+{
+  SIZE_T superblocknum;
+  ERROR_T rc;
+
+  if (!btree) {
+    return false;
+  }
+  if (metrics != "" && (rc=PrintMetrics(cerr,*cache,btree,metrics))!=ERROR_NOERROR) {
+    cerr <<"Can't measure the index due to error "<<rc<<"\n";
+  }
+  if (bloombits) {
+    const BloomFilter &f = btree->GetFilter();
+    cerr << "bloom filter: "<<f.GetNumQueries()<<" queries, "
+	 <<f.GetNumRuledOut()<<" ruled out, "
+	 <<f.GetNumFalsePositives()<<" false positives, "
+	 <<"false positive rate "<<f.GetFalsePositiveRate()<<"\n";
+  }
+  if ((rc=btree->Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr << "Can't detach btree due to error "<<rc<<"\n";
+    return false;
+  }
+  if ((rc=cache->Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach cache due to error "<<rc<<"\n";
+    return false;
+  }
+  stats.SetIndex(0);
+  delete btree;
+  btree = 0;
+  return true;
+}
+
+
+void Session::Execute(const char *p, ostream &o)
+{
+  ERROR_T rc;
+  string action = NextWord(p);
+
+  if (action == "") {
+    return;
+  }
+  if (action == "INIT") {
+    o << (Init(p) ? "OK\n" : "FAIL\n");
+    return;
+  }
+  if (action == "STATS") {
+    // STATS [RESET] prints the latencies and I/O of each kind of
+    // operation so far, or starts them over
+    if (NextWord(p) == "RESET") {
+      stats.Reset();
+      o <<"OK\n";
+    } else {
+      o <<"OK BEGIN STATS\n";
+      o << stats;
+      o <<"OK END STATS\n";
+    }
+    return;
+  }
+  if (action == "FLUSH") {
+    // Writes back the dirty blocks of the cache as one batch
+    if ((rc=cache->Flush())!=ERROR_NOERROR) {
+      o <<"FAIL\n";
+      cerr <<"Can't flush due to error "<<rc<<"\n";
+    } else {
+      o <<"OK\n";
+    }
+    return;
+  }
+  if (!btree) {
+    o << "FAIL\n";
+    cerr << "No index for "<<action<<"\n";
+    return;
+  }
+
+  string keyword = NextWord(p), valueword = NextWord(p);
+  SetBlock(key,keyword.data(),keyword.size());
+  SetBlock(value,valueword.data(),valueword.size());
+
+  if (action == "INSERT"){
+    stats.Begin();
+    rc=btree->Insert(key,value);
+    stats.End(OP_INSERT,rc==ERROR_NOERROR);
+    if (rc!=ERROR_NOERROR) {
+      o <<"FAIL\n";
+      cerr <<"Can't insert due to error "<<rc<<"\n";
+    } else {
+      o <<"OK\n";
+    }
+  } else if (action == "UPDATE"){
+    stats.Begin();
+    rc=btree->Update(key,value);
+    stats.End(OP_UPDATE,rc==ERROR_NOERROR);
+    if (rc!=ERROR_NOERROR) {
+      o <<"FAIL\n";
+      cerr <<"Can't update due to error "<<rc<<"\n";
+    } else {
+      o <<"OK\n";
+    }
+  } else if (action == "DELETE"){
+    stats.Begin();
+    rc=btree->Delete(key);
+    stats.End(OP_DELETE,rc==ERROR_NOERROR);
+    if (rc!=ERROR_NOERROR) {
+      o <<"FAIL\n";
+      cerr <<"Can't delete due to error "<<rc<<"\n";
+    } else {
+      o <<"OK\n";
+    }
+  } else if (action == "LOOKUP" && !unique){
+    // Every value stored under the key, in one reply
+    BTreeCursor cursor;
+    stats.Begin();
+    if ((rc=btree->LookupFirst(key,cursor,lookup_value))!=ERROR_NOERROR) {
+      stats.End(OP_LOOKUP,false);
+      o <<"FAIL\n";
+      cerr <<"Can't lookup due to error "<<rc<<"\n";
+    } else {
+      o <<"OK";
+      do {
+	o << " ";
+	o.write((const char *)lookup_value.data,lookup_value.length);
+      } while ((rc=btree->LookupNext(cursor,lookup_value))==ERROR_NOERROR);
+      stats.End(OP_LOOKUP,rc==ERROR_NONEXISTENT);
+      o << "\n";
+      if (rc!=ERROR_NONEXISTENT) {
+	cerr <<"Can't lookup due to error "<<rc<<"\n";
+      }
+    }
+  } else if (action == "LOOKUP"){
+    stats.Begin();
+    rc=btree->Lookup(key,lookup_value);
+    stats.End(OP_LOOKUP,rc==ERROR_NOERROR);
+    if (rc!=ERROR_NOERROR) {
+      o <<"FAIL\n";
+      cerr <<"Can't lookup due to error "<<rc<<"\n";
+    } else {
+      o <<"OK ";
+      o.write((const char *)lookup_value.data,lookup_value.length);
+      o << "\n";
+    }
+  } else if (action == "SNAPSHOT") {
+    SIZE_T snapshot;
+    if ((rc=btree->CreateSnapshot(snapshot))!=ERROR_NOERROR) {
+      o <<"FAIL\n";
+      cerr <<"Can't snapshot due to error "<<rc<<"\n";
+    } else {
+      o <<"OK "<<snapshot<<"\n";
+    }
+  } else if (action == "RELEASE") {
+    if ((rc=btree->ReleaseSnapshot(atoi(keyword.c_str())))!=ERROR_NOERROR) {
+      o <<"FAIL\n";
+      cerr <<"Can't release snapshot due to error "<<rc<<"\n";
+    } else {
+      o <<"OK\n";
+    }
+  } else if (action == "LOOKUPAT") {
+    // LOOKUPAT snapshot key
+    stats.Begin();
+    rc=btree->LookupSnapshot(atoi(keyword.c_str()),value,lookup_value);
+    stats.End(OP_LOOKUP,rc==ERROR_NOERROR);
+    if (rc!=ERROR_NOERROR) {
+      o <<"FAIL\n";
+      cerr <<"Can't lookup due to error "<<rc<<"\n";
+    } else {
+      o <<"OK ";
+      o.write((const char *)lookup_value.data,lookup_value.length);
+      o << "\n";
+    }
+  } else if (action == "DISPLAYAT") {
+    o <<"OK BEGIN DISPLAY\n";
+    stats.Begin();
+    rc=btree->DisplaySnapshot(atoi(keyword.c_str()),o,BTREE_SORTED_KEYVAL);
+    stats.End(OP_SCAN,rc==ERROR_NOERROR);
+    if (rc!=ERROR_NOERROR) {
+      cerr <<"Can't display snapshot due to error "<<rc<<"\n";
+    }
+    o <<"OK END DISPLAY\n";
+  } else if (action == "DISPLAY") {
+    // This should always be OK
+    o <<"OK BEGIN DISPLAY\n";
+    stats.Begin();
+    rc=btree->Display(o, BTREE_SORTED_KEYVAL);
+    stats.End(OP_SCAN,rc==ERROR_NOERROR);
+    o <<"OK END DISPLAY\n";
+  } else if (action == "METRICS") {
+    // METRICS [json|prometheus]
+    if (keyword != "" && keyword != "json" && keyword != "prometheus") {
+      o << "FAIL\n";
+      cerr << "Unknown metrics format "<<keyword<<"\n";
+      return;
+    }
+    o <<"OK BEGIN METRICS\n";
+    if ((rc=PrintMetrics(o,*cache,btree,keyword))!=ERROR_NOERROR) {
+      cerr <<"Can't measure the index due to error "<<rc<<"\n";
+    }
+    o <<"OK END METRICS\n";
+  } else if (action == "DEINIT"){
+    o << (Deinit() ? "OK\n" : "FAIL\n");
+  }
+}
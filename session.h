@@ -0,0 +1,85 @@
+#ifndef _session
+#define _session
+
+#include <iostream>
+#include <string>
+
+#include "global.h"
+#include "block.h"
+#include "buffercache.h"
+#include "btree.h"
+#include "latency.h"
+
+using namespace std;
+
+//
+// An index as INIT sets it up, over a buffer cache that is already
+// attached, and the text protocol of ref_impl.pl run against it, a line
+// per request and a reply per line.  sim drives one from stdin, and
+// btree_server one for all of its clients.
+//
+// The session times each operation for STATS.  A read-only batch (see
+// sim's binary mode) is looked up, and timed, as a whole.
+//
+
+enum { OP_INSERT, OP_UPDATE, OP_DELETE, OP_LOOKUP, OP_SCAN, OP_BATCH };
+
+class Session {
+ protected:
+  BufferCache *cache;
+  BTreeIndex  *btree;      // 0 until INIT
+  bool         unique;
+  SIZE_T       bloombits;
+  string       metrics;    // format to print the metrics in at DEINIT, if any
+  OpStats      stats;
+
+  // Reused from one request to the next
+  KEY_T        key;
+  VALUE_T      value, lookup_value;
+
+ public:
+  Session(BufferCache *cache);
+  virtual ~Session();
+
+  // Sets up and attaches an index from the words that follow INIT:
+  //   keysize valuesize [format|hash] [comparator] [duplicates] [bloom[=bits]]
+  //   [pin=levels] [lsm[=entries]] [metrics=json|prometheus]
+  // return false, having said why on stderr, if it could not
+  bool Init(const char *words);
+  // Reports on the index, detaches it and the cache, and lets it go
+  bool Deinit();
+
+  // Runs one line of the text protocol, writing its reply to o.  Any
+  // request but INIT, STATS and FLUSH fails while there is no index
+  void Execute(const char *line, ostream &o);
+
+  BTreeIndex *GetIndex() const { return btree; }
+  bool        IsUnique() const { return unique; }
+  OpStats    &GetStats() { return stats; }
+};
+
+
+// Prints the metrics of the cache and the index as JSON, or in the
+// Prometheus text format for any other format
+ERROR_T PrintMetrics(ostream &o, const BufferCache &cache, const BTreeIndex *btree,
+		     const string &format);
+
+// Gives the next word of a line, moving p past it, or "" at the end
+string NextWord(const char *&p);
+
+// Fills b with len bytes, reusing its buffer when the length is the same
+void SetBlock(Block &b, const char *data, const SIZE_T len);
+
+// An operation RunKeyLines runs on a line: the key and value are its
+// first two words, and result is for a lookup to fill in
+typedef ERROR_T (*KeyLineOp)(BTreeIndex &index, const KEY_T &key, const VALUE_T &value,
+			     VALUE_T &result);
+
+// Runs op on each line of file, all in the one attach, and answers each
+// on o with OK, or "OK result" if withresult, or FAIL; blank lines are
+// skipped.  At the end it says on stderr how many there were and how
+// many failed, counting them as name ("inserts", ...)
+void RunKeyLines(FILE *file, ostream &o, BTreeIndex &index, KeyLineOp op,
+		 const bool withresult, const char *name);
+
+#endif
@@ -2,127 +2,298 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string>
-#include <strstream>
-#include <fstream>
-#include "btree.h"
+#include <sstream>
+#include <vector>
+#include "session.h"
 
 
 using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim filestem cachesize [binary] < specfile \n";
 }
 
 
+// The text protocol of ref_impl.pl, a line per request and per reply
+static void RunText(FILE *file, Session &s)
+{
+  static char line[1 << 20];
+  int max = sizeof(line);
+
+  //Now simply read each line and call btree functions corresponding to the same
+  while (fgets(line, max, file) != NULL){
+    s.Execute(line,cout);
+  }
+}
+
+
+//
+// The binary protocol.  Requests come in batches, and each batch gets
+// a batch of replies, in the same order, written out in one piece once
+// the whole batch has run.  Integers are little-endian.
+//
+//   batch    u32 count, then count requests
+//   request  u8 op, u32 keylength, u32 valuelength, key bytes, value bytes
+//   replies  u32 count, then count replies
+//   reply    u8 status (BIN_OK or BIN_FAIL), u32 count, then count
+//            values, each a u32 length and its bytes
+//
+// INIT carries the words that follow INIT in the text protocol as its
+// key, STATS "RESET" or nothing, and METRICS the format.  A LOOKUP
+// replies with the value (in a non-unique index, every value) of the
+// key, and STATS and METRICS with their text.  A batch of nothing but
+// LOOKUPs in a unique index goes to LookupBatch, so the keys that
+// share a path down the tree share its reads.
+//
+#define BIN_INIT    'N'
+#define BIN_INSERT  'I'
+#define BIN_UPDATE  'U'
+#define BIN_DELETE  'D'
+#define BIN_LOOKUP  'L'
+#define BIN_STATS   'T'
+#define BIN_METRICS 'M'
+#define BIN_DEINIT  'X'
+
+#define BIN_OK   0
+#define BIN_FAIL 1
+
+// Most requests in a batch, and longest key or value, as the longest
+// line of the text protocol
+#define BIN_MAX_COUNT  (1<<20)
+#define BIN_MAX_LENGTH (1<<20)
+
+struct BinRequest {
+  char   op;
+  size_t key;                 // where the key is in the batch
+  SIZE_T keylength;
+  size_t value;
+  SIZE_T valuelength;
+};
+
+
+static bool ReadU32(FILE *file, SIZE_T &v)
+{
+  unsigned char b[4];
+
+  if (fread(b,1,4,file)!=4) {
+    return false;
+  }
+  v=b[0] | b[1]<<8 | b[2]<<16 | (SIZE_T)b[3]<<24;
+  return true;
+}
+
+
+// Collects the replies to a batch, to be written out with a single fwrite
+class BinWriter {
+ protected:
+  string out;
+
+ public:
+  void Clear() { out.clear(); }
+  void U8(const unsigned v) { out+=(char)v; }
+  void U32(const SIZE_T v) {
+    char b[4]={(char)v,(char)(v>>8),(char)(v>>16),(char)(v>>24)};
+    out.append(b,4);
+  }
+  void Bytes(const void *data, const SIZE_T len) { U32(len); out.append((const char *)data,len); }
+  // A reply with no values, or with one
+  void Status(const bool ok) { U8(ok ? BIN_OK : BIN_FAIL); U32(0); }
+  void Value(const void *data, const SIZE_T len) { U8(BIN_OK); U32(1); Bytes(data,len); }
+  bool Flush(FILE *file) { return fwrite(out.data(),1,out.size(),file)==out.size() && fflush(file)==0; }
+};
+
+
+static void RunBinary(FILE *file, BufferCache &cache, Session &s)
+{
+  OpStats &stats = s.GetStats();
+  // Reused from one batch to the next
+  vector<char> in;
+  vector<BinRequest> requests;
+  vector<KEY_T> keys;
+  vector<VALUE_T> values;
+  vector<ERROR_T> results;
+  KEY_T key;
+  VALUE_T value, lookup_value;
+  BinWriter w;
+  SIZE_T count;
+  ERROR_T rc;
+
+  while (ReadU32(file,count)) {
+    if (count>BIN_MAX_COUNT) {
+      cerr << "Bad batch\n";
+      return;
+    }
+    // Read the whole batch before running any of it
+    in.clear();
+    requests.resize(count);
+    bool readonly = count>0 && s.GetIndex() && s.IsUnique();
+    for (SIZE_T i=0;i<count;i++) {
+      BinRequest &r = requests[i];
+      int op = fgetc(file);
+      if (op==EOF || !ReadU32(file,r.keylength) || !ReadU32(file,r.valuelength)) {
+	cerr << "Truncated batch\n";
+	return;
+      }
+      if (r.keylength>BIN_MAX_LENGTH || r.valuelength>BIN_MAX_LENGTH) {
+	cerr << "Bad batch\n";
+	return;
+      }
+      r.op = op;
+      r.key = in.size();
+      r.value = r.key+(size_t)r.keylength;
+      in.resize(r.value+(size_t)r.valuelength+1);
+      if (fread(&in[r.key],1,(size_t)r.keylength+r.valuelength,file)!=(size_t)r.keylength+r.valuelength) {
+	cerr << "Truncated batch\n";
+	return;
+      }
+      readonly = readonly && r.op==BIN_LOOKUP;
+    }
+
+    w.Clear();
+    w.U32(count);
+    if (readonly) {
+      keys.resize(count);
+      for (SIZE_T i=0;i<count;i++) {
+	SetBlock(keys[i],&in[requests[i].key],requests[i].keylength);
+      }
+      stats.Begin();
+      rc=s.GetIndex()->LookupBatch(keys,values,results);
+      stats.End(OP_BATCH,rc==ERROR_NOERROR);
+      if (rc!=ERROR_NOERROR) {
+	cerr <<"Can't lookup due to error "<<rc<<"\n";
+      }
+      for (SIZE_T i=0;i<count;i++) {
+	if (results[i]==ERROR_NOERROR) {
+	  w.Value(values[i].data,values[i].length);
+	} else {
+	  w.Status(false);
+	}
+      }
+    } else {
+      for (SIZE_T i=0;i<count;i++) {
+	const BinRequest &r = requests[i];
+	if (r.op==BIN_INIT) {
+	  string words(&in[r.key],r.keylength);
+	  w.Status(!s.GetIndex() && s.Init(words.c_str()));
+	  continue;
+	}
+	BTreeIndex *btree = s.GetIndex();
+	if (!btree) {
+	  w.Status(false);
+	  continue;
+	}
+	SetBlock(key,&in[r.key],r.keylength);
+	if (r.op==BIN_INSERT || r.op==BIN_UPDATE) {
+	  SetBlock(value,&in[r.value],r.valuelength);
+	  stats.Begin();
+	  rc = r.op==BIN_INSERT ? btree->Insert(key,value) : btree->Update(key,value);
+	  stats.End(r.op==BIN_INSERT ? OP_INSERT : OP_UPDATE,rc==ERROR_NOERROR);
+	  w.Status(rc==ERROR_NOERROR);
+	} else if (r.op==BIN_DELETE) {
+	  stats.Begin();
+	  rc=btree->Delete(key);
+	  stats.End(OP_DELETE,rc==ERROR_NOERROR);
+	  w.Status(rc==ERROR_NOERROR);
+	} else if (r.op==BIN_LOOKUP && !s.IsUnique()) {
+	  // Every value stored under the key, in one reply
+	  BTreeCursor cursor;
+	  vector<VALUE_T> all;
+	  stats.Begin();
+	  for (rc=btree->LookupFirst(key,cursor,lookup_value); rc==ERROR_NOERROR;
+	       rc=btree->LookupNext(cursor,lookup_value)) {
+	    all.push_back(lookup_value);
+	  }
+	  stats.End(OP_LOOKUP,!all.empty() && rc==ERROR_NONEXISTENT);
+	  if (all.empty()) {
+	    w.Status(false);
+	  } else {
+	    w.U8(BIN_OK);
+	    w.U32(all.size());
+	    for (SIZE_T v=0;v<all.size();v++) {
+	      w.Bytes(all[v].data,all[v].length);
+	    }
+	  }
+	} else if (r.op==BIN_LOOKUP) {
+	  stats.Begin();
+	  rc=btree->Lookup(key,lookup_value);
+	  stats.End(OP_LOOKUP,rc==ERROR_NOERROR);
+	  if (rc==ERROR_NOERROR) {
+	    w.Value(lookup_value.data,lookup_value.length);
+	  } else {
+	    w.Status(false);
+	  }
+	} else if (r.op==BIN_STATS) {
+	  ostringstream text;
+	  if (string(&in[r.key],r.keylength) == "RESET") {
+	    stats.Reset();
+	  } else {
+	    text << stats;
+	  }
+	  w.Value(text.str().data(),text.str().size());
+	} else if (r.op==BIN_METRICS) {
+	  ostringstream text;
+	  string format(&in[r.key],r.keylength);
+	  if ((format != "" && format != "json" && format != "prometheus") ||
+	      PrintMetrics(text,cache,btree,format)!=ERROR_NOERROR) {
+	    w.Status(false);
+	  } else {
+	    w.Value(text.str().data(),text.str().size());
+	  }
+	} else if (r.op==BIN_DEINIT) {
+	  w.Status(s.Deinit());
+	} else {
+	  cerr << "Unknown request "<<(int)r.op<<"\n";
+	  w.Status(false);
+	}
+      }
+    }
+    if (!w.Flush(stdout)) {
+      cerr << "Can't write replies\n";
+      return;
+    }
+  }
+}
+
+
+
 int main(int argc, char *argv[])
 {
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  if (argc != 3 && !(argc == 4 && string(argv[3]) == "binary")){
     usage();
     return 1;
   }
 
   char *filestem=argv[1];
   SIZE_T cachesize=atoi(argv[2]);
-  SIZE_T superblocknum;
-
-  FILE *file; 
-  char line[1024];
-  int max = 8192;
   ERROR_T rc;
-  
+
   // We'll connect to the btree only once and then
   // run lots of operations
   // so we need to do this outside the loop
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  // will be set on init
-  BTreeIndex *btree;
+  // the index will be set up on init
+  Session s(&cache);
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
     cerr << "Can't attach cache due to error "<<rc<<"\n";
     return -1;
   }
-  
-  file=stdin;
 
-  //Now simply read each line and call btree functions corresponding to the same
-  while (fgets(line, max, file) != NULL){
-    // foreach line read we will refer to a case switch statement
-    string line2, action, key, value;
-    line2 = line;
-    istrstream is(line2.c_str(),line2.size());
-    is >> action >> key >> value;
-
-    if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
-      if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
-	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
-	cout << "FAIL\n";
-      } else {
-	cout << "OK\n";
-      }
-    } else if (action == "INSERT"){
-      if ((rc=btree->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<<endl;
-	cerr <<"Can't insert due to error "<<rc<<"\n";
-      } else {
-        cout <<"OK\n";
-      }
-    } else if (action == "UPDATE"){
-      if ((rc=btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL" <<endl;
-	cerr <<"Can't update due to error "<<rc<<"\n";
-      } else {
-        cout <<"OK\n";
-      }
-    } else if (action == "DELETE"){
-      if ((rc=btree->Delete(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<<endl;
-	cerr <<"Can't delete due to error "<<rc<<endl;
-      } else {
-        cout <<"OK\n";
-      }
-    } else if (action == "LOOKUP"){
-      VALUE_T lookup_value;
-      if ((rc=btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<< endl;
-	cerr <<"Can't lookup due to error "<<rc<<endl;
-      } else {
-        cout <<"OK ";
- 	for (unsigned int k=0; k<lookup_value.length; k++) {
- 	    cout << lookup_value.data[k];
-	}
- 	cout << endl;
-      }
-    } else if (action == "DISPLAY") {
-      // This should always be OK
-      cout <<"OK BEGIN DISPLAY\n";
-      btree->Display(cout, BTREE_SORTED_KEYVAL);
-      cout <<"OK END DISPLAY\n";
-    } else if (action == "DEINIT"){
-      if ((rc=btree->Detach(superblocknum))!=ERROR_NOERROR) { 
-	cout << "FAIL"<<endl;
-	cerr << "Can't detach btree due to error "<<rc<<endl;
-      } else {
-	if ((rc=cache.Detach())!=ERROR_NOERROR) { 
-	  cout <<"FAIL"<<endl;
-	  cerr <<"Can't detach cache due to error "<<rc<<endl;
-	} else {
-	  delete btree;
-	  cout << "OK\n";
-	}
-      }
-    }
+  if (argc == 4) {
+    RunBinary(stdin,cache,s);
+  } else {
+    RunText(stdin,s);
   }
-    
-  fclose(file);
+  cout.flush();
+
+  fclose(stdin);
 
   return 0;
 
 }
-
@@ -54,6 +54,10 @@ int main(int argc, char *argv[])
   cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
   cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
   cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << "numhits         = "<<cache.GetNumHits()<<endl;
+  cerr << "nummisses       = "<<cache.GetNumMisses()<<endl;
+  cerr << "numevictions    = "<<cache.GetNumEvictions()<<endl;
+  cerr << "numwritebacks   = "<<cache.GetNumWritebacks()<<endl;
   cerr << endl;
 
   cerr << "total time      = "<<cache.GetCurrentTime()<<endl;